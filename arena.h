@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include <memory_resource>
+
+using namespace std;
+
+// Memory for the temporaries of one macro expansion: the parameter list, what each parameter is replaced with.
+//
+// An expansionArena is made on the stack for every expansion. The first EXPANSION_ARENA_SIZE bytes come from
+// the arena itself, so a typical call never touches the heap; a call with a huge parameter list gets more
+// from the heap and all of it is given back at once when the arena goes away. Nothing is freed one by one.
+// The temporaries are pmr containers made with &arena.memory.
+
+const size_t EXPANSION_ARENA_SIZE = 4096;
+
+struct expansionArena {
+    alignas(max_align_t) char block[EXPANSION_ARENA_SIZE];
+    pmr::monotonic_buffer_resource memory{ block, sizeof(block) };
+};
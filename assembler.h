@@ -0,0 +1,491 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ostream>
+#include <cctype>
+#include "./utils.h"
+#include "./lineparser.h"
+#include "./symbols.h"
+#include "./outputsink.h"
+
+using namespace std;
+
+// An assembler for the expanded program, so --object can go straight from macros to object code.
+//
+// The expanded code never leaves memory: pass 1 splits every line once, gives it its address and
+// collects the symbols, pass 2 encodes the lines it kept and writes the H, T, M and E records.
+// Addressing is PC-relative, format 4 ('+') reaches the whole memory and gets a modification record.
+// There is no BASE directive among the SIC/XE directives here, so base-relative addressing is never used.
+
+const unsigned int TEXT_RECORD_BYTES = 30;
+const unsigned int MEMORY_SIZE = 1 << 20;
+
+struct assemblySymbol {
+    int value = 0;
+    bool relative = false;   // an address inside the program, it moves when the program is relocated
+    bool defined = false;
+};
+
+// assemblyLine - a line of the expanded program that takes up memory or defines something
+struct assemblyLine {
+    unsigned int lineNumber;
+    unsigned int address;
+    const opcodeEntry* entry;  // nullptr for a line with only a label
+    bool format4;
+    string_view operands;      // comment cut off, surrounding whitespace removed
+};
+
+struct assembler {
+    symbolTable names;
+    vector<assemblySymbol> symbols;   // by symbol id
+    vector<assemblyLine> lines;
+    string programName;
+    unsigned int startAddress = 0;
+    unsigned int endAddress = 0;
+    string_view firstInstruction;     // operand of END
+    unsigned int endLineNumber = 0;
+    ostream* messages;
+    unsigned int errors = 0;
+
+    // The text record being filled and the modification records collected so far
+    unsigned int textStart = 0;
+    string textBytes;
+    string modifications;
+};
+
+void assemblyError(assembler* state, unsigned int lineNumber, const string& message) {
+    *state->messages << "Assembly line " << lineNumber << ": Error - " << message << endl;
+    state->errors++;
+}
+
+void appendHex(string* out, unsigned int value, int digits) {
+    const char* hexDigits = "0123456789ABCDEF";
+    for (int i = digits - 1; i >= 0; i--)
+        *out += hexDigits[(value >> (4 * i)) & 0xF];
+}
+
+string_view trimWhitespace(string_view text) {
+    const char* whitespace = "\t\n\v\f\r ";
+    size_t start = text.find_first_not_of(whitespace);
+    if (start == string_view::npos)
+        return string_view();
+    return text.substr(start, text.find_last_not_of(whitespace) - start + 1);
+}
+
+// splitOperand - the operand before the first comma and what comes after it, with whitespace removed
+string_view splitOperand(string_view operands, string_view* rest) {
+    size_t comma = operands.find(',');
+    *rest = comma != string_view::npos ? trimWhitespace(operands.substr(comma + 1)) : string_view();
+    return trimWhitespace(operands.substr(0, comma));
+}
+
+bool parseNumber(string_view text, int* value) {
+    if (text.empty())
+        return false;
+    int number = 0;
+    for (char c : text) {
+        if (!isdigit((unsigned char)c) || number > (1 << 24))
+            return false;
+        number = number * 10 + (c - '0');
+    }
+    *value = number;
+    return true;
+}
+
+// evaluateExpression - works out terms joined by + and -: numbers, symbols and * for the current address
+// The result is relative if the relative terms leave exactly one address, absolute if they cancel out.
+bool evaluateExpression(assembler* state, string_view text, unsigned int address, unsigned int lineNumber, int* value, bool* relative) {
+    int result = 0;
+    int relativeTerms = 0;
+    size_t position = 0;
+    text = trimWhitespace(text);
+    if (text.empty()) {
+        assemblyError(state, lineNumber, "missing operand");
+        return false;
+    }
+
+    while (position < text.length()) {
+        int sign = 1;
+        if (text[position] == '+' || text[position] == '-') {
+            sign = text[position] == '-' ? -1 : 1;
+            position++;
+        }
+        size_t end = text.find_first_of("+-", position + 1);
+        string_view term = trimWhitespace(text.substr(position, end == string_view::npos ? string_view::npos : end - position));
+        position = end == string_view::npos ? text.length() : end;
+
+        int termValue;
+        if (term == "*") {
+            result += sign * (int)address;
+            relativeTerms += sign;
+        }
+        else if (parseNumber(term, &termValue))
+            result += sign * termValue;
+        else {
+            unsigned int id = findSymbol(&state->names, term);
+            if (id == NO_SYMBOL || !state->symbols[id].defined) {
+                assemblyError(state, lineNumber, "undefined symbol " + string(term));
+                return false;
+            }
+            result += sign * state->symbols[id].value;
+            relativeTerms += state->symbols[id].relative ? sign : 0;
+        }
+    }
+
+    if (relativeTerms != 0 && relativeTerms != 1) {
+        assemblyError(state, lineNumber, "expression " + string(text) + " is not a single address");
+        return false;
+    }
+    *value = result;
+    *relative = relativeTerms == 1;
+    return true;
+}
+
+void defineSymbol(assembler* state, string_view name, int value, bool relative, unsigned int lineNumber) {
+    unsigned int id = internSymbol(&state->names, name);
+    if (id >= state->symbols.size())
+        state->symbols.resize(id + 1);
+    if (state->symbols[id].defined) {
+        assemblyError(state, lineNumber, "symbol " + string(name) + " is already defined");
+        return;
+    }
+    state->symbols[id] = { value, relative, true };
+}
+
+// byteConstantLength - how many bytes C'...' or X'...' take, 0 if the constant is malformed
+unsigned int byteConstantLength(string_view constant) {
+    if (constant.length() < 3 || constant[1] != '\'' || constant.back() != '\'')
+        return 0;
+    string_view contents = constant.substr(2, constant.length() - 3);
+    if (constant[0] == 'C')
+        return contents.length();
+    if (constant[0] == 'X' && contents.length() % 2 == 0) {
+        for (char c : contents) {
+            if (!isxdigit((unsigned char)c)) return 0;
+        }
+        return contents.length() / 2;
+    }
+    return 0;
+}
+
+// registerNumber - the number of a register operand of a format 2 command, -1 if it isn't one
+int registerNumber(string_view name) {
+    const string_view registers[] = { "A", "X", "L", "B", "S", "T", "F", "", "PC", "SW" };
+    for (int i = 0; i < (int)size(registers); i++) {
+        if (!registers[i].empty() && registers[i] == name)
+            return i;
+    }
+    return -1;
+}
+
+// instructionLength - the bytes a line takes up, worked out in pass 1
+unsigned int instructionLength(assembler* state, const assemblyLine* line) {
+    if (line->entry == nullptr)
+        return 0;
+    if (line->entry->kind == OPCODE_COMMAND)
+        return line->format4 ? 4 : SICXE_OPCODE_FORMATS[line->entry->index];
+
+    int count;
+    bool relative;
+    switch (line->entry->index) {
+    case DIRECTIVE_WORD:
+        return 3;
+    case DIRECTIVE_RESW:
+        if (!evaluateExpression(state, line->operands, line->address, line->lineNumber, &count, &relative))
+            return 0;
+        if (relative || count < 0) {
+            assemblyError(state, line->lineNumber, "RESW needs a positive number of words");
+            return 0;
+        }
+        return 3 * count;
+    case DIRECTIVE_BYTE: {
+        unsigned int length = byteConstantLength(line->operands);
+        if (length == 0)
+            assemblyError(state, line->lineNumber, "malformed constant " + string(line->operands));
+        return length;
+    }
+    default:
+        return 0;
+    }
+}
+
+// assemblePass1 - gives every line its address and defines the symbols
+void assemblePass1(assembler* state, string_view program) {
+    unsigned int address = 0;
+    unsigned int lineNumber = 0;
+    size_t position = 0;
+    bool started = false;
+    lineFields fields;
+
+    while (position < program.length()) {
+        size_t end = program.find('\n', position);
+        string_view text = program.substr(position, end == string_view::npos ? string_view::npos : end - position);
+        position = end == string_view::npos ? program.length() : end + 1;
+        lineNumber++;
+
+        splitLineFields(text, &fields);
+        if (fields.label.empty() && fields.opcode.empty())
+            continue;
+
+        assemblyLine line = { lineNumber, address, nullptr, false, trimWhitespace(fields.params) };
+        if (!fields.opcode.empty()) {
+            string_view opcode = fields.opcode;
+            line.format4 = opcode[0] == '+';
+            line.entry = findOpcode(line.format4 ? opcode.substr(1) : opcode);
+            if (line.entry == nullptr) {
+                assemblyError(state, lineNumber, "unknown command " + string(opcode));
+                continue;
+            }
+            if (line.format4 && (line.entry->kind != OPCODE_COMMAND || SICXE_OPCODE_FORMATS[line.entry->index] != 3)) {
+                assemblyError(state, lineNumber, string(opcode) + " has no format 4");
+                line.format4 = false;
+            }
+        }
+        bool directive = line.entry != nullptr && line.entry->kind == OPCODE_DIRECTIVE;
+
+        if (directive && line.entry->index == DIRECTIVE_START) {
+            bool valid = !started;
+            for (char c : line.operands)
+                valid = valid && isxdigit((unsigned char)c);
+            if (!valid || line.operands.empty() || line.operands.length() > 5) {
+                assemblyError(state, lineNumber, "START has to come first and needs a hexadecimal address");
+                continue;
+            }
+            int start = stoi(string(line.operands), nullptr, 16);
+            state->programName = string(fields.label.substr(0, 6));
+            state->startAddress = address = start;
+            started = true;
+            if (!fields.label.empty())
+                defineSymbol(state, fields.label, address, true, lineNumber);
+            continue;
+        }
+        if (directive && line.entry->index == DIRECTIVE_END) {
+            state->firstInstruction = line.operands;
+            state->endLineNumber = lineNumber;
+            break;
+        }
+        started = true;
+
+        if (directive && line.entry->index == DIRECTIVE_EQU) {
+            int value;
+            bool relative;
+            if (fields.label.empty())
+                assemblyError(state, lineNumber, "EQU needs a label");
+            else if (evaluateExpression(state, line.operands, address, lineNumber, &value, &relative))
+                defineSymbol(state, fields.label, value, relative, lineNumber);
+            continue;
+        }
+        if (!fields.label.empty())
+            defineSymbol(state, fields.label, address, true, lineNumber);
+
+        address += instructionLength(state, &line);
+        if (address > MEMORY_SIZE) {
+            assemblyError(state, lineNumber, "the program doesn't fit into memory");
+            break;
+        }
+        if (line.entry != nullptr)
+            state->lines.push_back(line);
+    }
+    state->endAddress = address;
+}
+
+// flushTextRecord - writes the text record being filled, if it has anything in it
+void flushTextRecord(assembler* state, outputSink* destFile) {
+    if (state->textBytes.empty())
+        return;
+    string record = "T";
+    appendHex(&record, state->textStart, 6);
+    appendHex(&record, state->textBytes.length() / 2, 2);
+    record += state->textBytes;
+    record += '\n';
+    writeOutput(destFile, record);
+    state->textBytes.clear();
+}
+
+// emitBytes - adds the hex digits of length bytes at address to the text records
+void emitBytes(assembler* state, outputSink* destFile, unsigned int address, string_view hexDigits) {
+    if (!state->textBytes.empty() && (state->textStart + state->textBytes.length() / 2 != address
+                                      || state->textBytes.length() + hexDigits.length() > 2 * TEXT_RECORD_BYTES))
+        flushTextRecord(state, destFile);
+    if (state->textBytes.empty())
+        state->textStart = address;
+    state->textBytes.append(hexDigits.data(), hexDigits.length());
+}
+
+// addModification - the halfBytes lowest half bytes at address hold an address that moves with the program
+void addModification(assembler* state, unsigned int address, unsigned int halfBytes) {
+    state->modifications += 'M';
+    appendHex(&state->modifications, address, 6);
+    appendHex(&state->modifications, halfBytes, 2);
+    state->modifications += '\n';
+}
+
+// encodeInstruction - the object code of a format 3 or 4 command
+bool encodeInstruction(assembler* state, const assemblyLine* line, string* code) {
+    unsigned int opcode = SICXE_OPCODE_VALUES[line->entry->index];
+    unsigned int length = line->format4 ? 4 : 3;
+    string_view rest;
+    string_view operand = splitOperand(line->operands, &rest);
+
+    unsigned int flagN = 1, flagI = 1, flagX = 0, flagP = 0, flagE = line->format4 ? 1 : 0;
+    if (!operand.empty() && operand[0] == '#') {
+        flagN = 0;
+        operand.remove_prefix(1);
+    }
+    else if (!operand.empty() && operand[0] == '@') {
+        flagI = 0;
+        operand.remove_prefix(1);
+    }
+    if (rest == "X")
+        flagX = 1;
+    else if (!rest.empty()) {
+        assemblyError(state, line->lineNumber, "unexpected operand " + string(rest));
+        return false;
+    }
+
+    int target = 0;
+    bool relative = false;
+    unsigned int field = 0;
+    if (operand.empty()) {
+        // Only RSUB goes without an operand
+        if (line->entry->name != "RSUB") {
+            assemblyError(state, line->lineNumber, "missing operand");
+            return false;
+        }
+    }
+    else if (!evaluateExpression(state, operand, line->address, line->lineNumber, &target, &relative))
+        return false;
+    else if (line->format4) {
+        if (target < 0 || target >= (int)MEMORY_SIZE) {
+            assemblyError(state, line->lineNumber, "address out of range");
+            return false;
+        }
+        field = target;
+        if (relative)
+            addModification(state, line->address + 1, 5);
+    }
+    else if (!relative) {
+        // A constant, or a direct address in the first 4 KiB
+        if (target < 0 || target >= 4096) {
+            assemblyError(state, line->lineNumber, "value out of range, use format 4");
+            return false;
+        }
+        field = target;
+    }
+    else {
+        int displacement = target - (int)(line->address + length);
+        if (displacement < -2048 || displacement > 2047) {
+            assemblyError(state, line->lineNumber, "address out of PC-relative range, use format 4");
+            return false;
+        }
+        flagP = 1;
+        field = displacement & 0xFFF;
+    }
+
+    unsigned int flags = (flagX << 3) | (flagP << 1) | flagE;
+    appendHex(code, opcode | (flagN << 1) | flagI, 2);
+    appendHex(code, flags, 1);
+    appendHex(code, field, line->format4 ? 5 : 3);
+    return true;
+}
+
+// encodeRegisters - the object code of a format 2 command
+bool encodeRegisters(assembler* state, const assemblyLine* line, string* code) {
+    string_view rest;
+    string_view first = splitOperand(line->operands, &rest);
+    int firstRegister = registerNumber(first);
+    int secondRegister = rest.empty() ? 0 : registerNumber(rest);
+    // SVC takes a number instead of a register
+    if (line->entry->name == "SVC" && parseNumber(first, &firstRegister) && firstRegister > 15)
+        firstRegister = -1;
+    if (firstRegister < 0 || secondRegister < 0) {
+        assemblyError(state, line->lineNumber, "bad register operand " + string(line->operands));
+        return false;
+    }
+    appendHex(code, SICXE_OPCODE_VALUES[line->entry->index], 2);
+    appendHex(code, firstRegister, 1);
+    appendHex(code, secondRegister, 1);
+    return true;
+}
+
+// assemblePass2 - encodes the lines of pass 1 and writes the object program
+void assemblePass2(assembler* state, outputSink* destFile) {
+    string header = "H";
+    header += state->programName;
+    header.append(6 - state->programName.length(), ' ');
+    appendHex(&header, state->startAddress, 6);
+    appendHex(&header, state->endAddress - state->startAddress, 6);
+    header += '\n';
+    writeOutput(destFile, header);
+
+    string code;
+    for (const assemblyLine& line : state->lines) {
+        code.clear();
+        if (line.entry->kind == OPCODE_COMMAND) {
+            unsigned int format = line.format4 ? 4 : SICXE_OPCODE_FORMATS[line.entry->index];
+            if (format == 1)
+                appendHex(&code, SICXE_OPCODE_VALUES[line.entry->index], 2);
+            else if (format == 2 && !encodeRegisters(state, &line, &code))
+                continue;
+            else if (format >= 3 && !encodeInstruction(state, &line, &code))
+                continue;
+        }
+        else if (line.entry->index == DIRECTIVE_WORD) {
+            int value;
+            bool relative;
+            if (!evaluateExpression(state, line.operands, line.address, line.lineNumber, &value, &relative))
+                continue;
+            appendHex(&code, value & 0xFFFFFF, 6);
+            if (relative)
+                addModification(state, line.address, 6);
+        }
+        else if (line.entry->index == DIRECTIVE_BYTE && byteConstantLength(line.operands) > 0) {
+            string_view contents = line.operands.substr(2, line.operands.length() - 3);
+            if (line.operands[0] == 'X') {
+                // Written in upper case like every other digit of the records
+                for (char c : contents)
+                    code += (char)toupper((unsigned char)c);
+            }
+            else {
+                for (char c : contents)
+                    appendHex(&code, (unsigned char)c, 2);
+            }
+        }
+        else if (line.entry->index == DIRECTIVE_RESW) {
+            // Reserved memory isn't loaded, the next text record starts after it
+            flushTextRecord(state, destFile);
+            continue;
+        }
+        if (!code.empty())
+            emitBytes(state, destFile, line.address, code);
+    }
+    flushTextRecord(state, destFile);
+    writeOutput(destFile, state->modifications);
+
+    int first = state->startAddress;
+    bool relative;
+    if (!state->firstInstruction.empty())
+        evaluateExpression(state, state->firstInstruction, state->endAddress, state->endLineNumber, &first, &relative);
+    string end = "E";
+    appendHex(&end, first, 6);
+    end += '\n';
+    writeOutput(destFile, end);
+}
+
+// assembleProgram - assembles the expanded program into the H/T/M/E records of objectProgram
+// Errors go to messages; returns false if there were any, objectProgram is left empty then.
+bool assembleProgram(string_view program, string* objectProgram, ostream* messages) {
+    assembler state;
+    state.messages = messages;
+    assemblePass1(&state, program);
+
+    // Pass 2 still runs after errors in pass 1, to report its own errors too, the records are only kept without any
+    outputSink records;
+    openOutputMemory(&records);
+    assemblePass2(&state, &records);
+    if (state.errors > 0)
+        return false;
+    *objectProgram = move(records.buffer);
+    return true;
+}
@@ -0,0 +1,67 @@
+// bench_macrotable - compares macro lookup in the hashed macro table against the old linear scan
+// Lookup cost in the table should stay flat as the number of defined macros grows.
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../macrotable.h"
+
+using namespace std;
+
+// The findMacro that used to live in main.cpp, kept here as the baseline
+macroDefinition findMacroLinear(vector<macroDefinition>* macroDefArray, string macroName) {
+    for (unsigned int i = 0; i < macroDefArray->size(); i++) {
+        if (macroDefArray->at(i).name == macroName)
+            return macroDefArray->at(i);
+    }
+    macroDefinition nullMacro; nullMacro.name = ""; nullMacro.params = "";
+    return nullMacro;
+}
+
+macroDefinition makeMacro(unsigned int i) {
+    macroDefinition definition;
+    definition.name = "M" + to_string(i);
+    definition.params = "&A,&B";
+    return definition;
+}
+
+int main() {
+    const unsigned int macroCounts[] = { 16, 256, 4096, 65536 };
+    const unsigned int lookups = 200000;
+
+    cout << "macros\ttable ns/lookup\tlinear ns/lookup" << endl;
+    for (unsigned int macroCount : macroCounts) {
+        macroTable table;
+        vector<macroDefinition> array;
+        vector<string> names;
+        for (unsigned int i = 0; i < macroCount; i++) {
+            addMacro(&table, makeMacro(i));
+            array.push_back(makeMacro(i));
+            names.push_back(array.back().name);
+        }
+        // Every other lookup misses, like the plain SIC/XE commands processLine looks up
+        names.push_back("LDA");
+
+        size_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (unsigned int i = 0; i < lookups; i++) {
+            const string& name = (i % 2) ? names.back() : names[(i * 7919u) % macroCount];
+            found += findMacro(&table, name).params.size();
+        }
+        double tableNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / lookups;
+
+        // The linear scan is far too slow to run the same number of lookups on large tables
+        unsigned int linearLookups = max(1000u, lookups / macroCount * 16);
+        start = chrono::steady_clock::now();
+        for (unsigned int i = 0; i < linearLookups; i++) {
+            const string& name = (i % 2) ? names.back() : names[(i * 7919u) % macroCount];
+            found += findMacroLinear(&array, name).params.size();
+        }
+        double linearNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / linearLookups;
+
+        cout << macroCount << "\t" << tableNs << "\t" << linearNs << endl;
+        if (found == 0) cout << "(nothing found)" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+// bench_opcodes - compares the perfect hash opcode classifier against the old linear isCommand
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../utils.h"
+
+using namespace std;
+
+// The isCommand that used to live in utils.h, kept here as the baseline
+string OLD_SICXE_COMMANDS[] = { "ADD", "ADDF", "ADDR", "AND", "CLEAR", "COMP", "COMPF", "DIV", "DIVF", "DIVR", "FIX", "FLOAT", "HIO", "J", "JEQ", "JGT", "JLT", "JSUB", "LDA", "LDB", "LDCH", "LDF", "LDL", "LDS", "LDT", "LDX", "LPS", "MUL", "MULF", "MULR", "NORM", "OR", "RD", "RMO", "RSUB", "SIO", "SSK", "STA", "STB", "STCH", "STF", "STI", "STL", "STS", "STSW", "STT", "STX", "SUB", "SUBF", "SUBR", "SVC", "TD", "TIO", "TIX", "TIXR", "WD" };
+string OLD_SICXE_DIRECTIVES[] = { "BYTE", "EQU", "WORD", "RESW", "START", "END" };
+
+bool isCommandLinear(string opcode) {
+    if (opcode.length() > 0) {
+        if (opcode[0] == '+') {
+            opcode.erase(0, 1);
+        }
+        for (int i = 0; i < 56; i++) {
+            if (opcode == OLD_SICXE_COMMANDS[i]) return true;
+        }
+        for (int i = 0; i < 6; i++) {
+            if (opcode == OLD_SICXE_DIRECTIVES[i]) return true;
+        }
+    }
+    return false;
+}
+
+int main() {
+    // A mix like a real program: mostly commands, some format 4, directives and unknown opcodes
+    vector<string> opcodes = { "LDA", "STA", "+JSUB", "LDX", "TIX", "JLT", "RSUB", "WORD", "RESW", "COMP", "JEQ", "WD", "TD", "STCH", "LDCH", "CLEAR", "TIXR", "+LDT", "BYTE", "FOO", "PUSH", "MACRO", "" };
+    const unsigned int rounds = 200000;
+
+    // Both classifiers must agree before their speed means anything
+    for (const string& opcode : opcodes) {
+        if (isCommandLinear(opcode) != isCommand(opcode)) {
+            cout << "Mismatch on opcode " << opcode << endl;
+            return 1;
+        }
+    }
+
+    size_t hits = 0;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < rounds; i++) {
+        for (const string& opcode : opcodes)
+            hits += isCommandLinear(opcode);
+    }
+    double linearNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (rounds * opcodes.size());
+
+    start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < rounds; i++) {
+        for (const string& opcode : opcodes)
+            hits += classifyOpcode(opcode) != OPCODE_UNKNOWN;
+    }
+    double hashNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (rounds * opcodes.size());
+
+    cout << "linear isCommand:\t" << linearNs << " ns/opcode" << endl;
+    cout << "classifyOpcode:\t\t" << hashNs << " ns/opcode" << endl;
+    cout << "speedup:\t\t" << linearNs / hashNs << "x" << endl;
+    if (hits == 0) cout << "(no opcodes found)" << endl;
+
+    return 0;
+}
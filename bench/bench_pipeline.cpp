@@ -0,0 +1,259 @@
+// bench_pipeline - runs the macro processor on a synthetic source and reports every phase on its own
+//
+// Prints lines/sec and expansions/sec of a whole run, and the time, allocations and peak RSS of the
+// phases a line goes through: splitting it into fields, looking up its opcode, expanding a call and
+// writing the output. Options shape the generated source, see bench/workload.h:
+//   --macros N --lines N --density PERCENT --depth N --params N --body N --labels N --seed N
+//   --repeat N    runs every phase N times and keeps the fastest
+//   --emit FILE   only writes the generated source to FILE
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../macroprocessor.h"
+#include "./workload.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+// GCC takes the malloc in operator new and the free in operator delete for a mismatch, they are a pair here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Every allocation of the process goes through these, so a phase's allocations are the difference of the counters
+atomic<size_t> allocationCount(0);
+atomic<size_t> allocatedBytes(0);
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == nullptr)
+        throw bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
+// peakMemory - the most memory the process had at any time so far, in kilobytes (0 where it can't be told)
+size_t peakMemory() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+struct phaseResult {
+    double seconds = 0;
+    size_t allocations = 0;
+    size_t bytes = 0;
+};
+
+// measurePhase - runs a phase repeat times and keeps the fastest run, allocations are counted on that run
+template <typename Phase>
+phaseResult measurePhase(unsigned int repeat, Phase phase) {
+    phaseResult best;
+    for (unsigned int i = 0; i < repeat; i++) {
+        size_t allocationsBefore = allocationCount.load();
+        size_t bytesBefore = allocatedBytes.load();
+        auto start = chrono::steady_clock::now();
+        phase();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best.seconds) {
+            best.seconds = seconds;
+            best.allocations = allocationCount.load() - allocationsBefore;
+            best.bytes = allocatedBytes.load() - bytesBefore;
+        }
+    }
+    return best;
+}
+
+void printPhase(const string& name, const phaseResult* result, size_t items, const string& itemName) {
+    cout << name << "\t" << result->seconds * 1000 << " ms\t" << (size_t)(items / result->seconds) << " " << itemName << "/sec\t"
+         << result->allocations << " allocations\t" << result->bytes << " bytes\tpeak RSS " << peakMemory() << " KB" << endl;
+}
+
+// splitSource - the lines of the source, as processFile reads them
+vector<string_view> splitSource(const string& source) {
+    sourceBuffer buffer;
+    buffer.data = source.data();
+    buffer.size = source.size();
+    vector<string_view> lines;
+    string_view line;
+    while (readLine(&buffer, &line))
+        lines.push_back(line);
+    return lines;
+}
+
+bool readOption(int argc, char* argv[], int* i, const char* name, unsigned int* value) {
+    if (strcmp(argv[*i], name) != 0 || *i + 1 >= argc)
+        return false;
+    *value = (unsigned int)strtoul(argv[++*i], nullptr, 10);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    workloadOptions options;
+    unsigned int repeat = 3;
+    string emitFilepath;
+    for (int i = 1; i < argc; i++) {
+        if (readOption(argc, argv, &i, "--macros", &options.macroCount) || readOption(argc, argv, &i, "--lines", &options.lineCount)
+            || readOption(argc, argv, &i, "--density", &options.callDensity) || readOption(argc, argv, &i, "--depth", &options.nestingDepth)
+            || readOption(argc, argv, &i, "--params", &options.parameterCount) || readOption(argc, argv, &i, "--body", &options.bodyLines)
+            || readOption(argc, argv, &i, "--labels", &options.localLabels) || readOption(argc, argv, &i, "--seed", &options.seed)
+            || readOption(argc, argv, &i, "--repeat", &repeat))
+            continue;
+        if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            emitFilepath = argv[++i];
+            continue;
+        }
+        cerr << "Unknown option " << argv[i] << endl;
+        return 1;
+    }
+    if (repeat == 0)
+        repeat = 1;
+
+    workloadStats stats;
+    string source = generateWorkload(&options, &stats);
+    if (!emitFilepath.empty()) {
+        ofstream emitFile(emitFilepath, ios::binary);
+        return (emitFile << source) ? 0 : 1;
+    }
+
+    filesystem::path sourceFilepath = filesystem::temp_directory_path() / "sicmacro_bench.sic";
+    filesystem::path destFilepath = filesystem::temp_directory_path() / "sicmacro_bench.asm";
+    {
+        ofstream sourceFile(sourceFilepath, ios::binary);
+        sourceFile << source;
+    }
+
+    // The warnings of the generated source aren't what is measured
+    ostream discardedMessages(nullptr);
+    messageStream = &discardedMessages;
+
+    cout << "macros " << options.macroCount << ", lines " << stats.lines << ", calls " << stats.calls << ", density " << options.callDensity
+         << "%, depth " << options.nestingDepth << ", params " << options.parameterCount << ", body " << options.bodyLines
+         << ", labels " << options.localLabels << endl;
+
+    // The whole run, like the command line does it
+    phaseResult total = measurePhase(repeat, [&]() {
+        expansionContext context;
+        context.diagnostics.out = &discardedMessages;
+        outputSink destFile;
+        openOutputFile(&destFile, destFilepath);
+        processFile(&context, sourceFilepath, &destFile);
+        finishDiagnostics(&context.diagnostics);
+        closeOutput(&destFile);
+    });
+    printPhase("total", &total, stats.lines, "lines");
+    cout << "\t\t\t" << (size_t)(stats.calls / total.seconds) << " expansions/sec" << endl;
+
+    // The phases below work on what a full run sees: the source lines, the defined macros and the planned calls
+    vector<string_view> lines = splitSource(source);
+    expansionContext context;
+    context.diagnostics.out = &discardedMessages;
+    // The planned lines point into the source, so it stays open until the end
+    vector<plannedLine> plan;
+    sourceBuffer sourceFile;
+    openSourceFile(&sourceFile, sourceFilepath);
+    unsigned int lineNumber = 1;
+    planLines(&context, &sourceFile, &lineNumber, &plan, SIZE_MAX);
+
+    phaseResult split = measurePhase(repeat, [&]() {
+        size_t fieldLength = 0;
+        lineFields fields;
+        for (string_view line : lines) {
+            splitLineFields(line, &fields);
+            fieldLength += fields.opcode.length();
+        }
+        if (fieldLength == 0) cout << "(no opcodes)" << endl;
+    });
+    printPhase("splitLine", &split, lines.size(), "lines");
+
+    vector<lineFields> fieldsOfLines(lines.size());
+    for (size_t i = 0; i < lines.size(); i++)
+        splitLineFields(lines[i], &fieldsOfLines[i]);
+    phaseResult lookup = measurePhase(repeat, [&]() {
+        size_t found = 0;
+        string opcodeScratch;
+        for (const lineFields& fields : fieldsOfLines) {
+            string_view opcode = foldedView(fields.opcode, fields.opcodeInString, &opcodeScratch);
+            found += lookupMacro(&context, opcode).name.length();
+        }
+        if (found == 0) cout << "(no macros found)" << endl;
+    });
+    printPhase("findMacro", &lookup, lines.size(), "lookups");
+
+    // Expansions go to memory that is emptied after every call, so writing them out is left to the output phase
+    size_t expansions = 0;
+    for (const plannedLine& line : plan)
+        expansions += line.macro != nullptr;
+    outputSink expanded;
+    openOutputMemory(&expanded);
+    phaseResult expand = measurePhase(repeat, [&]() {
+        expansionMemo memo;
+        for (const plannedLine& line : plan) {
+            if (line.macro == nullptr)
+                continue;
+            writeExpansion(&expanded, line.macro, line.label, line.parameters, line.labelBase, line.lineNumber, &memo);
+            expanded.buffer.clear();
+        }
+    });
+    printPhase("expandMacro", &expand, expansions, "expansions");
+
+    // The finished output written line by line to a file, as processFile hands it to the sink
+    outputSink collected;
+    openOutputMemory(&collected);
+    for (const plannedLine& line : plan) {
+        if (line.macro == nullptr)
+            writeLine(&collected, &line.fields);
+        else
+            writeExpansion(&collected, line.macro, line.label, line.parameters, line.labelBase, line.lineNumber);
+    }
+    vector<string_view> outputLines = splitSource(collected.buffer);
+    phaseResult output = measurePhase(repeat, [&]() {
+        outputSink destFile;
+        openOutputFile(&destFile, destFilepath);
+        for (string_view line : outputLines) {
+            writeOutput(&destFile, line);
+            writeOutput(&destFile, '\n');
+        }
+        closeOutput(&destFile);
+    });
+    printPhase("output", &output, outputLines.size(), "lines");
+
+    closeSourceFile(&sourceFile);
+    error_code error;
+    filesystem::remove(sourceFilepath, error);
+    filesystem::remove(destFilepath, error);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <string>
+#include <random>
+#include <algorithm>
+
+using namespace std;
+
+// Synthetic SIC/XE sources for the benchmarks.
+//
+// The generated program first defines macroCount macros, then has lineCount lines of code of which about
+// callDensity percent are macro calls. Every macro has parameterCount parameters, bodyLines lines and
+// localLabels of those lines carry a $ label that other lines jump to. With a nestingDepth above 1 macros
+// call the macro defined before them, so a call goes up to nestingDepth macros deep.
+
+struct workloadOptions {
+    unsigned int macroCount = 64;
+    unsigned int lineCount = 100000;
+    unsigned int callDensity = 30;      // percent of the code lines that are macro calls
+    unsigned int nestingDepth = 1;
+    unsigned int parameterCount = 2;
+    unsigned int bodyLines = 6;
+    unsigned int localLabels = 1;       // per macro
+    unsigned int seed = 1;
+};
+
+// workloadStats - what ended up in the generated source
+struct workloadStats {
+    unsigned int lines = 0;             // every line of the source, definitions included
+    unsigned int calls = 0;             // macro calls outside of definitions, each one is an expansion
+};
+
+const char* WORKLOAD_COMMANDS[] = { "LDA", "STA", "ADD", "SUB", "COMP", "LDX", "STX", "LDCH", "STCH", "TIX", "MUL", "+LDT" };
+const char* WORKLOAD_REGISTERS[] = { "A", "X", "S", "T" };
+
+string workloadMacroName(unsigned int index) {
+    return "MC" + to_string(index);
+}
+
+string workloadParameter(unsigned int index) {
+    return "&P" + to_string(index);
+}
+
+// generateWorkload - returns the source text, and what it contains in stats
+string generateWorkload(const workloadOptions* options, workloadStats* stats) {
+    mt19937 random(options->seed);
+    auto pick = [&random](unsigned int count) { return (unsigned int)(random() % count); };
+    const unsigned int commandCount = sizeof(WORKLOAD_COMMANDS) / sizeof(WORKLOAD_COMMANDS[0]);
+    unsigned int nestingDepth = options->nestingDepth > 0 ? options->nestingDepth : 1;
+    unsigned int localLabels = min(options->localLabels, options->bodyLines);
+
+    string source;
+    *stats = workloadStats();
+    auto addLine = [&source, stats](const string& line) {
+        source += line;
+        source += '\n';
+        stats->lines++;
+    };
+
+    addLine("BENCH\tSTART\t0");
+
+    for (unsigned int m = 0; m < options->macroCount; m++) {
+        string header = workloadMacroName(m) + "\tMACRO\t";
+        for (unsigned int p = 0; p < options->parameterCount; p++)
+            header += (p == 0 ? "" : ",") + workloadParameter(p);
+        addLine(header);
+
+        for (unsigned int l = 0; l < options->bodyLines; l++) {
+            string label = l < localLabels ? "$L" + to_string(l) : "";
+            string operand;
+            if (options->parameterCount > 0 && pick(2) == 0)
+                operand = (pick(4) == 0 ? "#" : "") + workloadParameter(pick(options->parameterCount));
+            else if (localLabels > 0 && pick(3) == 0)
+                operand = "$L" + to_string(pick(localLabels));
+            else
+                operand = string(WORKLOAD_REGISTERS[pick(4)]) + ",X";
+            addLine(label + "\t" + WORKLOAD_COMMANDS[pick(commandCount)] + "\t" + operand);
+        }
+
+        // Nested macros call the one defined right before them, passing their own parameters on
+        if (m % nestingDepth != 0) {
+            string call = "\t" + workloadMacroName(m - 1) + "\t";
+            for (unsigned int p = 0; p < options->parameterCount; p++)
+                call += (p == 0 ? "" : ",") + workloadParameter(p);
+            addLine(call);
+        }
+        addLine("\tMEND");
+    }
+
+    for (unsigned int i = 0; i < options->lineCount; i++) {
+        string label = pick(8) == 0 ? "L" + to_string(i % 10000) : "";
+        if (options->macroCount > 0 && pick(100) < options->callDensity) {
+            string call = label + "\t" + workloadMacroName(pick(options->macroCount)) + "\t";
+            for (unsigned int p = 0; p < options->parameterCount; p++)
+                call += (p == 0 ? "" : ",") + string(pick(3) == 0 ? "#" : "") + "V" + to_string(pick(1000));
+            addLine(call);
+            stats->calls++;
+        }
+        else if (pick(10) == 0)
+            addLine(label + "\t" + WORKLOAD_COMMANDS[pick(commandCount)] + "\tV" + to_string(pick(1000)) + "\t; some comment");
+        else
+            addLine(label + "\t" + WORKLOAD_COMMANDS[pick(commandCount)] + "\tV" + to_string(pick(1000)));
+    }
+
+    addLine("\tEND\tBENCH");
+    return source;
+}
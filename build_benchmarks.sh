@@ -0,0 +1,5 @@
+set -e
+mkdir -p ./bin/Bench
+g++ -Wall -std=c++17 -O2 bench/bench_macrotable.cpp -o "./bin/Bench/bench_macrotable"
+g++ -Wall -std=c++17 -O2 bench/bench_opcodes.cpp -o "./bin/Bench/bench_opcodes"
+g++ -Wall -std=c++17 -O2 bench/bench_pipeline.cpp -o "./bin/Bench/bench_pipeline" -pthread
@@ -0,0 +1,7 @@
+set -e
+mkdir -p ./bin/Fuzz
+g++ -Wall -std=c++17 -O2 fuzz/fuzz_expander.cpp -o "./bin/Fuzz/fuzz_expander" -pthread
+# libFuzzer comes with clang, the target is only built where there is one
+if command -v clang++ > /dev/null; then
+    clang++ -Wall -std=c++17 -O1 -g -DLIBFUZZER -fsanitize=fuzzer,address,undefined fuzz/fuzz_expander.cpp -o "./bin/Fuzz/fuzz_expander_libfuzzer" -pthread
+fi
@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+
+using namespace std;
+
+// The dependency map --incremental keeps next to the output.
+//
+// For every macro call it records the source line, what was called (a hash of the call and one of the
+// definition), the number its local labels started from, where its expansion is in the output and whether a
+// WHILE of it was stopped, so a copied expansion is reported the same way as a written one.
+// A call of the next run with the same three keys expands to exactly the same text, so it is copied from
+// the previous output instead of being expanded again.
+
+const char* DEPENDENCY_MAP_HEADER = "SICMACRO-DEPENDENCIES 2";
+
+struct expansionRecord {
+    uint64_t callHash;        // label and parameters of the call
+    uint64_t definitionHash;  // the definition that was expanded
+    unsigned int labelBase;
+    unsigned int lineNumber;  // source line of the call
+    size_t offset;            // span of the expansion in the output
+    size_t length;
+    bool loopStopped;         // a WHILE of the expansion was stopped
+};
+
+struct dependencyMap {
+    uint64_t outputHash = 0;  // hash of the whole output the records point into
+    vector<expansionRecord> records;
+};
+
+bool writeDependencyMap(const filesystem::path& mapFilepath, const dependencyMap* map) {
+    ostringstream out;
+    out << DEPENDENCY_MAP_HEADER << "\n" << hex << map->outputHash << "\n";
+    for (const expansionRecord& record : map->records) {
+        out << dec << record.lineNumber << " " << hex << record.callHash << " " << record.definitionHash
+            << " " << dec << record.labelBase << " " << record.offset << " " << record.length
+            << " " << record.loopStopped << "\n";
+    }
+
+    ofstream mapFile(mapFilepath, ios::trunc);
+    return (bool)(mapFile << out.str());
+}
+
+// readDependencyMap - returns false if there is no map or it can't be read, nothing gets reused then
+bool readDependencyMap(const filesystem::path& mapFilepath, dependencyMap* map) {
+    ifstream mapFile(mapFilepath);
+    string header;
+    if (!getline(mapFile, header) || header != DEPENDENCY_MAP_HEADER)
+        return false;
+    if (!(mapFile >> hex >> map->outputHash))
+        return false;
+
+    expansionRecord record;
+    while (mapFile >> dec >> record.lineNumber >> hex >> record.callHash >> record.definitionHash >> dec >> record.labelBase >> record.offset >> record.length >> record.loopStopped)
+        map->records.push_back(record);
+    return mapFile.eof();
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include "./stats.h"
+
+using namespace std;
+
+// Warnings and errors about the source, collected as records instead of printed on the spot.
+//
+// Every file being processed reports into a diagnosticLog of its own, so files processed in parallel never
+// share one and the parallel expansion reports its warnings from the thread that planned the lines, in source
+// order. As text, the records are formatted into a buffer that is written DIAGNOSTIC_BATCH bytes at a time
+// instead of a flush per line; with --diagnostics-json they are kept and written as one JSON file at the end.
+// --werror turns warnings into errors, --dedupe-diagnostics reports a message that repeats one reported before
+// only once, --diagnostic-limit stops reporting a kind of diagnostic after that many; what was left out is
+// counted and summed up at the end.
+
+const size_t DIAGNOSTIC_BATCH = 1 << 16;
+
+enum diagnosticSeverity { SEVERITY_WARNING, SEVERITY_ERROR };
+const char* const SEVERITY_NAMES[] = { "warning", "error" };
+const char* const SEVERITY_LABELS[] = { "Warning", "Error" };
+
+enum diagnosticCode {
+    DIAGNOSTIC_LONG_LABEL,        // a label over 6 characters
+    DIAGNOSTIC_UNKNOWN_COMMAND,   // an opcode that is no SIC/XE command and no macro
+    DIAGNOSTIC_REPLACES_COMMAND,  // a macro named like a SIC/XE command
+    DIAGNOSTIC_ALREADY_DEFINED,   // a macro defined a second time, the first definition keeps being used
+    DIAGNOSTIC_DIRECTIVE,         // a macro-time directive that doesn't fit, it is kept as an ordinary line
+    DIAGNOSTIC_LOOP_STOPPED,      // a WHILE stopped after MAX_LOOP_ITERATIONS rounds
+    DIAGNOSTIC_TOO_DEEP,          // --recursive calls nested deeper than --max-depth
+    DIAGNOSTIC_CODES
+};
+const char* const DIAGNOSTIC_NAMES[DIAGNOSTIC_CODES] = { "long-label", "unknown-command", "replaces-command", "already-defined", "directive", "loop-stopped", "too-deep" };
+
+// diagnosticSettings - how diagnostics are reported, set once before any work starts
+struct diagnosticSettings {
+    bool warningsAreErrors = false;
+    bool deduplicate = false;
+    uint64_t limit = 0;   // diagnostics of one code reported at most, 0 for no limit
+    bool json = false;    // keep the records for the JSON file instead of writing text
+};
+diagnosticSettings diagnosticOptions;
+
+struct diagnostic {
+    diagnosticSeverity severity;
+    diagnosticCode code;
+    unsigned int line;   // 0 if it isn't about one line
+    string macro;        // the macro being defined or expanded, empty outside of macros
+    string message;
+};
+
+// diagnosticLog - the diagnostics of one file
+struct diagnosticLog {
+    string file;                      // the source the diagnostics are about, for the JSON file
+    ostream* out = &cout;             // where the text goes
+    bool keepAll = false;             // also keep every record as it was reported, before any limits
+    vector<diagnostic> all;
+    vector<diagnostic> records;       // the reported records, only kept for the JSON file
+    string text;                      // formatted text not written yet
+    unordered_set<string> seen;       // what was reported so far, with --dedupe-diagnostics
+    uint64_t reported[DIAGNOSTIC_CODES] = {};
+    uint64_t suppressed[DIAGNOSTIC_CODES] = {};
+    uint64_t warnings = 0;
+    uint64_t errors = 0;
+    string message;                   // for the callers to put a message together in, so it doesn't allocate every time
+    string key;
+};
+
+void flushDiagnostics(diagnosticLog* log) {
+    if (log->text.empty())
+        return;
+    log->out->write(log->text.data(), log->text.length());
+    log->out->flush();
+    log->text.clear();
+}
+
+// appendDiagnosticText - a diagnostic as the text it has always been printed as
+void appendDiagnosticText(string* text, diagnosticSeverity severity, unsigned int line, string_view message) {
+    if (line > 0) {
+        char number[16];
+        *text += "Line ";
+        text->append(number, to_chars(number, number + sizeof(number), line).ptr - number);
+        *text += ": ";
+    }
+    *text += SEVERITY_LABELS[severity];
+    *text += " - ";
+    *text += message;
+    *text += '\n';
+}
+
+// reportDiagnostic - reports a warning about the source, unless it is deduplicated or over the limit
+void reportDiagnostic(diagnosticLog* log, diagnosticCode code, unsigned int line, string_view macro, string_view message) {
+    diagnosticSeverity severity = diagnosticOptions.warningsAreErrors ? SEVERITY_ERROR : SEVERITY_WARNING;
+    if (log->keepAll)
+        log->all.push_back({ SEVERITY_WARNING, code, line, string(macro), string(message) });
+
+    bool over = diagnosticOptions.limit > 0 && log->reported[code] >= diagnosticOptions.limit;
+    if (!over && diagnosticOptions.deduplicate) {
+        log->key.assign(1, (char)code);
+        log->key.append(macro);
+        log->key += '\0';
+        log->key.append(message);
+        over = !log->seen.insert(log->key).second;
+    }
+    if (over) {
+        log->suppressed[code]++;
+        return;
+    }
+
+    log->reported[code]++;
+    if (severity == SEVERITY_ERROR)
+        log->errors++;
+    else
+        log->warnings++;
+    if (diagnosticOptions.json) {
+        log->records.push_back({ severity, code, line, string(macro), string(message) });
+        return;
+    }
+    appendDiagnosticText(&log->text, severity, line, message);
+    if (log->text.length() >= DIAGNOSTIC_BATCH)
+        flushDiagnostics(log);
+}
+
+// reportDiagnostics - reports records kept by another log again, a cached prelude's
+void reportDiagnostics(diagnosticLog* log, const vector<diagnostic>* records) {
+    for (const diagnostic& record : *records)
+        reportDiagnostic(log, record.code, record.line, record.macro, record.message);
+}
+
+// finishDiagnostics - writes what is left of the text, and how many diagnostics were left out
+void finishDiagnostics(diagnosticLog* log) {
+    if (!diagnosticOptions.json) {
+        diagnosticSeverity severity = diagnosticOptions.warningsAreErrors ? SEVERITY_ERROR : SEVERITY_WARNING;
+        for (int code = 0; code < DIAGNOSTIC_CODES; code++) {
+            if (log->suppressed[code] == 0)
+                continue;
+            log->text += SEVERITY_LABELS[severity];
+            log->text += " - " + to_string(log->suppressed[code]) + " more " + DIAGNOSTIC_NAMES[code] + " diagnostics not shown\n";
+        }
+    }
+    flushDiagnostics(log);
+}
+
+// writeDiagnosticsJson - every diagnostic of the logs, for --diagnostics-json
+// The records are put together in a buffer that is written DIAGNOSTIC_BATCH bytes at a time, like the text.
+void writeDiagnosticsJson(ostream* out, const vector<const diagnosticLog*>* logs) {
+    uint64_t warnings = 0, errors = 0, suppressed = 0;
+    string json = "{\"diagnostics\":[";
+    char number[16];
+    bool first = true;
+    for (const diagnosticLog* log : *logs) {
+        for (const diagnostic& record : log->records) {
+            json += first ? "\n{\"file\":" : ",\n{\"file\":";
+            first = false;
+            appendJsonString(&json, log->file);
+            json += ",\"severity\":\"";
+            json += SEVERITY_NAMES[record.severity];
+            json += "\",\"code\":\"";
+            json += DIAGNOSTIC_NAMES[record.code];
+            json += "\",\"line\":";
+            json.append(number, to_chars(number, number + sizeof(number), record.line).ptr - number);
+            json += ",\"macro\":";
+            appendJsonString(&json, record.macro);
+            json += ",\"message\":";
+            appendJsonString(&json, record.message);
+            json += '}';
+            if (json.length() >= DIAGNOSTIC_BATCH) {
+                out->write(json.data(), json.length());
+                json.clear();
+            }
+        }
+        warnings += log->warnings;
+        errors += log->errors;
+        for (int code = 0; code < DIAGNOSTIC_CODES; code++)
+            suppressed += log->suppressed[code];
+    }
+    out->write(json.data(), json.length());
+    *out << "\n],\"warnings\":" << warnings << ",\"errors\":" << errors << ",\"suppressed\":" << suppressed << '}' << endl;
+}
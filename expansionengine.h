@@ -0,0 +1,447 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "./macrotable.h"
+
+using namespace std;
+
+// The expansion engine: macros that call other macros.
+//
+// A call of an earlier macro inside a definition stays in the body as a call line, the called body is not
+// copied in. Whenever the body is expanded, the call is flattened: every line of the called macro becomes a
+// line of the caller just like the copy used to be made - local labels renamed to $tmN, parameters replaced
+// by the call's arguments, the result read again as a line of the caller - so the output is what it always
+// was, but a body only holds its own lines however deep the calls go.
+//
+// The arguments of a call inside a body are the literal text of the call, so its flattened lines are always
+// the same. They are kept in an expansionMemo on first use, every later expansion just reuses them. The memo
+// is bounded, past MEMO_LINES lines it starts over, so memory stays flat even when every call is different.
+//
+// With --recursive, lines calling a macro that wasn't defined yet when the body was (the macro itself
+// included) are expanded as the expansion is written, up to --max-depth calls deep.
+//
+// Macro-time directives - IF/ELSE/ENDIF, WHILE/ENDW and SET - stay in the body as lines of their own, their
+// expressions compiled (see macroexpression.h) and every IF, ELSE and WHILE knowing the line it goes on at.
+// Which lines such a body writes depends on the arguments, so a call of it is never flattened ahead of time:
+// the called body is run in place with the arguments the caller has at that point.
+
+const size_t MEMO_LINES = 1 << 18;         // flattened lines a memo keeps, a memo that grows past this starts over
+const unsigned int DEFAULT_MAX_DEPTH = 64;
+const unsigned int MAX_LOOP_ITERATIONS = 1 << 20;   // rounds a WHILE may run before it is stopped
+
+// macroResolver - returns the macro an opcode calls, nullptr if it calls none
+typedef function<const macroDefinition*(const string&)> macroResolver;
+
+// templateProblem - a directive that doesn't fit, codeLine counts the lines of the code given to compileMacroTemplate
+struct templateProblem {
+    unsigned int codeLine;
+    string message;
+};
+
+// expansionMemo - flattened calls, by the call they were flattened from
+struct expansionMemo {
+    unordered_map<const templateCall*, lineTable> calls;
+    size_t lines = 0;
+};
+
+// controlDirective - the macro-time directive an opcode is, CONTROL_NONE if it is none
+int controlDirective(string_view opcode) {
+    if (opcode == "IF") return CONTROL_IF;
+    if (opcode == "ELSE") return CONTROL_ELSE;
+    if (opcode == "ENDIF") return CONTROL_ENDIF;
+    if (opcode == "WHILE") return CONTROL_WHILE;
+    if (opcode == "ENDW") return CONTROL_ENDW;
+    if (opcode == "SET") return CONTROL_SET;
+    return CONTROL_NONE;
+}
+
+// compileControlLine - fills in a directive line, pairing it with the IF or WHILE it closes
+// Expressions are compiled once every variable is known, *expressionTexts keeps their text until then.
+void compileControlLine(macroTemplate* body, templateLine* line, unsigned int codeLine, const string& lineParameters, vector<size_t>* openBlocks, vector<pair<size_t, string>>* expressionTexts, vector<templateProblem>* problems) {
+    size_t index = body->code.lines.size();
+    const char* closes = line->control == CONTROL_ELSE || line->control == CONTROL_ENDIF ? "IF" : "WHILE";
+    templateLine* opened = openBlocks->empty() ? nullptr : &body->code.lines[openBlocks->back()];
+    string label(symbolText(&body->code, line->label));
+    string_view opcode = symbolText(&body->code, line->opcode);
+
+    switch (line->control) {
+    case CONTROL_IF:
+    case CONTROL_WHILE:
+        openBlocks->push_back(index);
+        expressionTexts->emplace_back(index, lineParameters);
+        break;
+    case CONTROL_SET:
+        if (label == "" || label[0] == '$') {
+            problems->push_back({ codeLine, "SET needs a variable name as its label" });
+            line->control = CONTROL_NONE;
+            break;
+        }
+        if (find(body->parameters.begin(), body->parameters.end(), label) != body->parameters.end()) {
+            problems->push_back({ codeLine, "SET can't change the parameter " + label });
+            line->control = CONTROL_NONE;
+            break;
+        }
+        line->variable = find(body->variables.begin(), body->variables.end(), label) - body->variables.begin();
+        if (line->variable == (int)body->variables.size())
+            body->variables.push_back(label);
+        line->variable += body->parameters.size();
+        expressionTexts->emplace_back(index, lineParameters);
+        break;
+    case CONTROL_ELSE:
+    case CONTROL_ENDIF:
+    case CONTROL_ENDW: {
+        bool matches = opened != nullptr && (line->control == CONTROL_ENDW ? opened->control == CONTROL_WHILE : opened->control != CONTROL_WHILE);
+        if (!matches || (line->control == CONTROL_ELSE && opened->control == CONTROL_ELSE)) {
+            problems->push_back({ codeLine, string(opcode) + " without " + closes });
+            line->control = CONTROL_NONE;
+            break;
+        }
+        // A false IF goes on past its ELSE, the ELSE reached from the true part goes on at ENDIF
+        if (line->control == CONTROL_ENDW) {
+            opened->target = index + 1;
+            line->target = openBlocks->back();
+        }
+        else
+            opened->target = line->control == CONTROL_ELSE ? index + 1 : index;
+        openBlocks->pop_back();
+        if (line->control == CONTROL_ELSE)
+            openBlocks->push_back(index);
+        break;
+    }
+    }
+}
+
+// isLocalLabel - a label that starts with '$', it gets a new name every expansion
+bool isLocalLabel(string_view label) {
+    return !label.empty() && label[0] == '$';
+}
+
+// compileMacroTemplate - splits the code of a macro into lines and operands and resolves parameters, local labels and calls
+// Without a resolver no line is a call. Every call moves *labelNames, the $tmN counter of the definitions, on.
+// Directives that don't fit together are described in *problems, with the line of code they are on, and kept as
+// ordinary lines.
+macroTemplate compileMacroTemplate(const string& params, const string& code, const macroResolver* resolve = nullptr, unsigned int* labelNames = nullptr, vector<templateProblem>* problems = nullptr) {
+    macroTemplate body;
+    body.parameters = splitParameters(params);
+    tableBuilder builder = {};
+    builder.table = &body.code;
+    lineTable* table = &body.code;
+    vector<templateProblem> ignoredProblems;
+    if (problems == nullptr)
+        problems = &ignoredProblems;
+
+    // A paranoid check if the macro has any code
+    if (code == "")
+        return body;
+
+    // Copied calls that expanded to nothing left no code at all, a body of only those stays empty.
+    // Directives count as code, a body of only SET lines or an empty WHILE still runs them.
+    bool hasCode = false;
+    vector<size_t> openBlocks;
+    vector<pair<size_t, string>> expressionTexts;
+    unordered_map<size_t, unsigned int> controlLines;   // the line of code of every directive, by its line in the table
+    size_t lineSeek = 0;
+    size_t seekEnd = 0;
+    for (unsigned int codeLine = 0; seekEnd != string::npos; codeLine++) {
+        seekEnd = code.find('\n', lineSeek);
+        string currentLine = code.substr(lineSeek, seekEnd - lineSeek);
+        lineSeek = seekEnd + 1;
+
+        templateLine line;
+        string lineParameters;
+        compileTemplateLine(&body, &builder, currentLine, &line, &lineParameters);
+        string label(symbolText(table, line.label));
+        string_view opcode = symbolText(table, line.opcode);
+
+        const macroDefinition* called = nullptr;
+        if (resolve != nullptr && (label != "" || opcode != ""))
+            called = (*resolve)(string(opcode));
+        if (called != nullptr) {
+            const macroTemplate* calledBody = &called->body;
+            templateCall call;
+            call.macro = called;
+            call.arguments = splitParameters(lineParameters, calledBody->parameters.size());
+            call.arguments.resize(calledBody->parameters.size());
+            body.directives = body.directives || calledBody->directives;
+            // The call line's own operands are not kept, the arguments are
+            table->operands.resize(line.firstOperand);
+
+            // If the macro call has a label, it is preserved on a line of its own
+            if (label != "") {
+                templateLine labelLine;
+                compileTemplateLine(&body, &builder, label, &labelLine, &lineParameters);
+                string_view labelLineLabel = symbolText(table, labelLine.label);
+                if (isLocalLabel(labelLineLabel)) {
+                    labelLine.localLabel = body.labelCount++;
+                    body.localLabels.emplace(labelLineLabel, labelLine.localLabel);
+                }
+                table->lines.push_back(labelLine);
+                hasCode = true;
+            }
+
+            // The called macro's local labels become local labels of this one, under their $tmN names
+            call.labelName = *labelNames;
+            call.firstLabel = body.labelCount;
+            *labelNames += calledBody->labelCount;
+            for (unsigned int k = 0; k < calledBody->labelCount; k++)
+                body.localLabels.emplace("$TM" + to_string(call.labelName + k), call.firstLabel + k);
+            body.labelCount += calledBody->labelCount;
+            hasCode = hasCode || !calledBody->code.lines.empty();
+
+            templateLine callLine;
+            callLine.call = body.calls.size();
+            body.calls.push_back(move(call));
+            table->lines.push_back(callLine);
+            continue;
+        }
+
+        // Directives are not written, they decide which lines are and how often
+        line.control = controlDirective(opcode);
+        if (line.control != CONTROL_NONE) {
+            compileControlLine(&body, &line, codeLine, lineParameters, &openBlocks, &expressionTexts, problems);
+            if (line.control != CONTROL_NONE) {
+                body.directives = true;
+                hasCode = true;
+                table->operands.resize(line.firstOperand);
+                line.operandCount = 0;
+                controlLines.emplace(table->lines.size(), codeLine);
+                table->lines.push_back(line);
+                continue;
+            }
+        }
+
+        // If label has '$' prefix, it is a local label inside the macro and gets a new name every expansion
+        if (isLocalLabel(label)) {
+            line.localLabel = body.labelCount++;
+            body.localLabels.emplace(label, line.localLabel);
+        }
+        hasCode = hasCode || label != "" || opcode != "";
+        table->lines.push_back(line);
+    }
+
+    // An IF or WHILE left open runs to the end of the body
+    for (size_t index : openBlocks) {
+        templateLine& line = table->lines[index];
+        problems->push_back({ controlLines[index], string(symbolText(table, line.opcode)) + " without " + (line.control == CONTROL_WHILE ? "ENDW" : "ENDIF") });
+        line.target = table->lines.size();
+    }
+
+    if (!hasCode) {
+        body.code = lineTable();
+        body.calls.clear();
+        body.variables.clear();
+        body.directives = false;
+        return body;
+    }
+
+    // Every variable is known now, an expression that can't be compiled is always 0
+    vector<string> symbols = body.parameters;
+    symbols.insert(symbols.end(), body.variables.begin(), body.variables.end());
+    for (auto& text : expressionTexts) {
+        templateLine& line = table->lines[text.first];
+        line.expression = body.expressions.size();
+        body.expressions.emplace_back();
+        string error;
+        if (!compileMacroExpression(text.second, &symbols, &body.expressions.back(), &error)) {
+            problems->push_back({ controlLines[text.first], "can't evaluate " + string(symbolText(table, line.opcode)) + " " + text.second + ", " + error });
+            body.expressions.back().tokens.clear();
+        }
+    }
+
+    // Local labels are only known once every line was seen, operands can name labels defined further down,
+    // and the same goes for the variables an operand names
+    string scratch;
+    for (templateOperand& operand : table->operands) {
+        auto variable = find(body.variables.begin(), body.variables.end(), symbolText(table, operand.text));
+        if (operand.parameter < 0 && variable != body.variables.end())
+            operand.parameter = body.parameters.size() + (variable - body.variables.begin());
+        findOperandLabels(&body, table, &operand, &scratch);
+    }
+
+    // A called macro with directives is expanded in place, its arguments are filled in like operands of this body
+    for (templateCall& call : body.calls) {
+        if (!call.macro->body.directives)
+            continue;
+        call.firstOperand = table->operands.size();
+        for (const string& argument : call.arguments) {
+            table->operands.push_back(compileTemplateOperand(&body, &builder, argument));
+            findOperandLabels(&body, table, &table->operands.back(), &scratch);
+        }
+        call.operandCount = table->operands.size() - call.firstOperand;
+    }
+
+    finishTable(table);
+    return body;
+}
+
+// appendRenamed - appends operand text to the code of a macro, with the local labels it names renamed to prefix and their number
+void appendRenamed(string* code, string_view text, const labelReference* labels, size_t labelCount, const char* prefix, unsigned int labelBase) {
+    size_t position = 0;
+    for (size_t i = 0; i < labelCount; i++) {
+        code->append(text.data() + position, labels[i].start - position);
+        *code += prefix;
+        *code += to_string(labelBase + labels[i].localLabel);
+        position = labels[i].start + labels[i].length;
+    }
+    code->append(text.data() + position, text.length() - position);
+}
+
+// isPlainText - text that reading it again as a line leaves as it is: upper case, and nothing that starts a string or a comment
+bool isPlainText(string_view text) {
+    for (char c : text) {
+        if (c == '\'' || c == ';' || (c >= 'a' && c <= 'z'))
+            return false;
+    }
+    return true;
+}
+
+// flattenScratch - strings flattenLine works in, kept from line to line so they don't allocate every time
+struct flattenScratch {
+    string text;
+    string name;
+    vector<string> values;
+    vector<vector<labelReference>> references;
+};
+
+// flattenLine - turns a line of a called macro, from the table lines, into the line of the caller it stands for
+// The line is what used to be copied into the caller's code and compiled again as a line of the caller. A line
+// without quotes, comments and lower case comes out of that as it went in, so it is put together directly.
+// The flattened line is added to the builder's table.
+void flattenLine(const macroTemplate* caller, tableBuilder* builder, const templateCall* call, const lineTable* lines, const templateLine* line, flattenScratch* work) {
+    const macroTemplate* body = &call->macro->body;
+    lineTable* table = builder->table;
+    string* text = &work->text;
+    string* scratch = &work->name;
+    vector<string>& values = work->values;
+    vector<vector<labelReference>>& references = work->references;
+    values.resize(line->operandCount);
+    if (references.size() < values.size())
+        references.resize(values.size());
+    string_view label = symbolText(lines, line->label);
+    string_view opcode = symbolText(lines, line->opcode);
+    bool plain = isPlainText(label) && isPlainText(opcode);
+
+    for (unsigned int j = 0; j < line->operandCount; j++) {
+        const templateOperand& operand = *lineOperand(lines, line, j);
+        string_view operandText = symbolText(lines, operand.text);
+
+        // Unlike an expansion, arguments are compared again with their prefix attached,
+        // and a prefixed operand that is not a parameter loses its prefix
+        string& value = values[j];
+        value.clear();
+        if (body->parameters.empty()) {
+            if (operand.prefix != 0) value += operand.prefix;
+            value += operandText;
+        }
+        else if (operand.parameter < 0) {
+            value = operandText;
+        }
+        else {
+            if (operand.prefix != 0) value += operand.prefix;
+            value += call->arguments[operand.parameter];
+            for (unsigned int k = operand.parameter + 1; k < body->parameters.size(); k++) {
+                if (value == body->parameters[k]) {
+                    value.resize(operand.prefix != 0 ? 1 : 0);
+                    value += call->arguments[k];
+                }
+            }
+        }
+
+        // Local labels named in the operand, also inside expressions, become local labels of the caller
+        references[j].clear();
+        findLocalLabels(body, operandBody(value), &references[j], scratch);
+        plain = plain && isPlainText(value);
+    }
+
+    // The local labels are named $tmN in the copy, which reads back as $TMN outside of strings
+    const char* labelPrefix = plain ? "$TM" : "$tm";
+    text->clear();
+    if (line->localLabel >= 0) {
+        *text += labelPrefix;
+        *text += to_string(call->labelName + line->localLabel);
+    }
+    else
+        *text += label;
+
+    templateLine flattened;
+    if (plain) {
+        flattened.label = addSymbol(builder, *text);
+        flattened.opcode = addSymbol(builder, opcode);
+        flattened.firstOperand = table->operands.size();
+        // A single empty operand leaves no parameters at all on the line
+        bool noParameters = values.size() == 1 && values[0].empty();
+        for (unsigned int j = 0; j < values.size() && !noParameters; j++) {
+            string_view valueBody = operandBody(values[j]);
+            text->assign(values[j], 0, values[j].length() - valueBody.length());
+            appendRenamed(text, valueBody, references[j].data(), references[j].size(), labelPrefix, call->labelName);
+            table->operands.push_back(compileTemplateOperand(caller, builder, *text));
+        }
+        flattened.operandCount = table->operands.size() - flattened.firstOperand;
+    }
+    else {
+        *text += '\t';
+        *text += opcode;
+        for (unsigned int j = 0; j < values.size(); j++) {
+            string_view valueBody = operandBody(values[j]);
+            *text += (j == 0 ? '\t' : ',');
+            text->append(values[j], 0, values[j].length() - valueBody.length());
+            appendRenamed(text, valueBody, references[j].data(), references[j].size(), labelPrefix, call->labelName);
+        }
+        string lineParameters;
+        compileTemplateLine(caller, builder, *text, &flattened, &lineParameters);
+    }
+
+    if (line->localLabel >= 0)
+        flattened.localLabel = call->firstLabel + line->localLabel;
+    for (unsigned int j = 0; j < flattened.operandCount; j++)
+        findOperandLabels(caller, table, &table->operands[flattened.firstOperand + j], scratch);
+    table->lines.push_back(flattened);
+}
+
+// flattenCall - the lines a call of the caller stands for, as lines of the caller
+// Calls inside the called macro are flattened into its lines first, and those into the caller's. The lines
+// come from the memo if the call was flattened before, else they are flattened into *lines.
+const lineTable* flattenCall(const macroTemplate* caller, const templateCall* call, expansionMemo* memo, lineTable* lines) {
+    if (memo != nullptr) {
+        auto found = memo->calls.find(call);
+        if (found != memo->calls.end())
+            return &found->second;
+    }
+
+    const macroTemplate* body = &call->macro->body;
+    lineTable innerLines;
+    flattenScratch work;
+    *lines = lineTable();
+    tableBuilder builder = {};
+    builder.table = lines;
+    for (const templateLine& line : body->code.lines) {
+        if (line.call < 0) {
+            flattenLine(caller, &builder, call, &body->code, &line, &work);
+            continue;
+        }
+        const lineTable* inner = flattenCall(body, &body->calls[line.call], memo, &innerLines);
+        for (const templateLine& innerLine : inner->lines)
+            flattenLine(caller, &builder, call, inner, &innerLine, &work);
+    }
+
+    finishTable(lines);
+
+    // The lines handed out stay valid while the expansion is written, the memo is only emptied between expansions
+    if (memo != nullptr) {
+        memo->lines += lines->lines.size();
+        return &memo->calls.emplace(call, move(*lines)).first->second;
+    }
+    return lines;
+}
+
+// trimMemo - empties a memo that grew past MEMO_LINES, only called between expansions
+// The calls that are still used are flattened again on their next expansion.
+void trimMemo(expansionMemo* memo) {
+    if (memo != nullptr && memo->lines > MEMO_LINES) {
+        memo->calls.clear();
+        memo->lines = 0;
+    }
+}
@@ -0,0 +1,256 @@
+// fuzz_expander - runs the reference expander and the engine on the same sources and reports where they differ
+//
+// The reference (fuzz/referenceexpander.h) is the macro processor as it was before the performance work. Every
+// source goes through it and through each engine in macroprocessor.h: processSource, the way a file or stdin is
+// processed, processSource with lazy definitions that are compiled on their first call, and
+// processSourceParallel with a few lines to a chunk so the chunks, the planned label numbers and the per chunk
+// memos all come into play. The expanded code and the warnings have to be the same byte for byte. Macro-time
+// directives only exist in the engine, a source with them is checked against the sequential engine instead
+// of the reference; built with the sanitizers, that still catches what their arithmetic gets wrong.
+//
+// Standalone it generates sources (fuzz/sourcegen.h) or replays the files it is given:
+//   fuzz_expander [--seed N] [--iterations N] [--jobs N] [--mutate] [--directives] [--save DIR] [file...]
+// --mutate garbles every generated source a little more with random bytes, see mutateSource. --directives
+// generates macro bodies with IF, WHILE and SET lines.
+// A difference is shrunk to the fewest lines that still show it, printed and, with --save, written to DIR.
+// Built with -DLIBFUZZER and clang's -fsanitize=fuzzer, libFuzzer drives LLVMFuzzerTestOneInput instead and
+// a difference aborts the run, libFuzzer keeps the input.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../macroprocessor.h"
+#include "./referenceexpander.h"
+#include "./sourcegen.h"
+
+using namespace std;
+
+// Lines processSourceParallel hands to a thread at a time here, small so even short sources have several chunks
+const size_t FUZZ_CHUNK_LINES = 3;
+
+enum fuzzEngine { ENGINE_SEQUENTIAL, ENGINE_LAZY, ENGINE_PARALLEL, FUZZ_ENGINES };
+const char* const FUZZ_ENGINE_NAMES[FUZZ_ENGINES] = { "sequential", "lazy", "parallel" };
+
+unsigned int fuzzJobs = 3;
+
+// expanderRun - what an expander made of a source
+struct expanderRun {
+    string output;
+    string messages;
+};
+
+void runReference(const string& source, expanderRun* run) {
+    istringstream sourceFile(source);
+    ostringstream destFile, messages;
+    reference::processSource(&sourceFile, &destFile, &messages);
+    run->output = destFile.str();
+    run->messages = messages.str();
+}
+
+void runEngine(const string& source, fuzzEngine engine, expanderRun* run) {
+    expansionContext context;
+    ostringstream messages;
+    context.diagnostics.out = &messages;
+    context.lazy = engine == ENGINE_LAZY;
+
+    sourceBuffer sourceFile;
+    openSourceMemory(&sourceFile, source);
+    outputSink destFile;
+    openOutputMemory(&destFile);
+    if (engine == ENGINE_PARALLEL)
+        processSourceParallel(&context, &sourceFile, &destFile, fuzzJobs, FUZZ_CHUNK_LINES);
+    else
+        processSource(&context, &sourceFile, &destFile);
+    closeSourceFile(&sourceFile);
+    finishDiagnostics(&context.diagnostics);
+
+    run->output = move(destFile.buffer);
+    run->messages = messages.str();
+}
+
+// knownToReference - false if a line of the source is a macro-time directive, the reference would only warn about it
+bool knownToReference(const string& source) {
+    istringstream sourceFile(source);
+    string line, label, opcode, params;
+    while (getline(sourceFile, line)) {
+        reference::splitLine(line, &label, &opcode, &params);
+        if (controlDirective(opcode) != CONTROL_NONE)
+            return false;
+    }
+    return true;
+}
+
+// firstDifference - the first line two texts differ on, as a message
+string firstDifference(const string& expected, const string& found) {
+    istringstream expectedLines(expected), foundLines(found);
+    string expectedLine, foundLine;
+    for (unsigned int line = 1; ; line++) {
+        bool hasExpected = (bool)getline(expectedLines, expectedLine);
+        bool hasFound = (bool)getline(foundLines, foundLine);
+        if (!hasExpected && !hasFound)
+            return "the last line end differs";
+        if (!hasExpected || !hasFound || expectedLine != foundLine)
+            return "line " + to_string(line) + ": expected \"" + (hasExpected ? expectedLine : "<end>") + "\", found \"" + (hasFound ? foundLine : "<end>") + "\"";
+    }
+}
+
+// compareEngine - runs the source through the reference and the engine, false and a description if they differ
+bool compareEngine(const string& source, fuzzEngine engine, string* difference) {
+    expanderRun expected, found;
+    if (knownToReference(source))
+        runReference(source, &expected);
+    else
+        runEngine(source, ENGINE_SEQUENTIAL, &expected);
+    runEngine(source, engine, &found);
+    if (expected.output != found.output) {
+        *difference = string(FUZZ_ENGINE_NAMES[engine]) + " output differs at " + firstDifference(expected.output, found.output);
+        return false;
+    }
+    if (expected.messages != found.messages) {
+        *difference = string(FUZZ_ENGINE_NAMES[engine]) + " warnings differ at " + firstDifference(expected.messages, found.messages);
+        return false;
+    }
+    return true;
+}
+
+// compareEngines - compareEngine for every engine, stops at the first one that differs
+// Without the reference, the sequential engine is what the others are compared with.
+bool compareEngines(const string& source, string* difference, fuzzEngine* failed) {
+    for (int engine = knownToReference(source) ? 0 : 1; engine < FUZZ_ENGINES; engine++) {
+        if (!compareEngine(source, (fuzzEngine)engine, difference)) {
+            *failed = (fuzzEngine)engine;
+            return false;
+        }
+    }
+    return true;
+}
+
+// shrinkSource - drops lines of a source the engine differs on, as long as it keeps differing
+// Halves of the source go first, then ever smaller runs of lines down to single ones.
+string shrinkSource(const string& source, fuzzEngine engine) {
+    vector<string> lines;
+    istringstream sourceLines(source);
+    for (string line; getline(sourceLines, line); )
+        lines.push_back(line);
+    auto join = [](const vector<string>& parts) {
+        string text;
+        for (const string& part : parts)
+            text += part + "\n";
+        return text;
+    };
+    string difference;
+    // A source that only differs because of how its last line ends can't be cut into lines
+    if (compareEngine(join(lines), engine, &difference))
+        return source;
+    // What the engine is compared with stays the same while the source is shrunk
+    bool known = knownToReference(source);
+
+    for (size_t run = max<size_t>(lines.size() / 2, 1); run > 0; run /= 2) {
+        for (size_t start = 0; start < lines.size(); ) {
+            vector<string> shorter(lines.begin(), lines.begin() + start);
+            shorter.insert(shorter.end(), lines.begin() + min(lines.size(), start + run), lines.end());
+            if (knownToReference(join(shorter)) == known && !compareEngine(join(shorter), engine, &difference))
+                lines = move(shorter);
+            else
+                start += run;
+        }
+    }
+    return join(lines);
+}
+
+#ifdef LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    string source((const char*)data, size);
+    string difference;
+    fuzzEngine failed;
+    if (!compareEngines(source, &difference, &failed)) {
+        cerr << "fuzz_expander: " << difference << endl;
+        abort();
+    }
+    return 0;
+}
+#else
+// reportDifference - prints a source the engine differs on, shrunk, and saves it to saveDirectory if there is one
+void reportDifference(const string& name, const string& source, const string& difference, fuzzEngine failed, const string& saveDirectory) {
+    string shrunk = shrinkSource(source, failed);
+    string shrunkDifference = difference;
+    compareEngine(shrunk, failed, &shrunkDifference);
+    cout << name << ": " << shrunkDifference << endl;
+    cout << "---- " << count(shrunk.begin(), shrunk.end(), '\n') << " lines that show it:" << endl << shrunk << "----" << endl;
+    if (saveDirectory != "") {
+        filesystem::path savePath = filesystem::path(saveDirectory) / (name + ".sic");
+        ofstream saved(savePath, ios::binary);
+        saved << source;
+        cout << "The whole source is in " << savePath.string() << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long seed = 1;
+    unsigned long long iterations = 1000;
+    bool mutate = false;
+    bool directives = false;
+    string saveDirectory;
+    vector<string> filepaths;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if ((argument == "--seed" || argument == "--iterations" || argument == "--jobs") && i + 1 < argc) {
+            char* end;
+            unsigned long long number = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i]) {
+                cout << "ERROR: " << argument << " needs a number" << endl;
+                return 1;
+            }
+            if (argument == "--seed") seed = number;
+            else if (argument == "--iterations") iterations = number;
+            else fuzzJobs = number;
+        }
+        else if (argument == "--mutate")
+            mutate = true;
+        else if (argument == "--directives")
+            directives = true;
+        else if (argument == "--save" && i + 1 < argc)
+            saveDirectory = argv[++i];
+        else
+            filepaths.push_back(argument);
+    }
+
+    unsigned long long checked = 0, withDirectives = 0, differing = 0;
+    auto check = [&](const string& name, const string& source) {
+        checked++;
+        withDirectives += knownToReference(source) ? 0 : 1;
+        string difference;
+        fuzzEngine failed;
+        if (!compareEngines(source, &difference, &failed)) {
+            differing++;
+            reportDifference(name, source, difference, failed, saveDirectory);
+        }
+    };
+
+    if (!filepaths.empty()) {
+        for (const string& filepath : filepaths) {
+            ifstream sourceFile(filepath, ios::binary);
+            if (!sourceFile) {
+                cout << "ERROR: Could not open " << filepath << endl;
+                return 1;
+            }
+            check(filesystem::path(filepath).stem().string(), string(istreambuf_iterator<char>(sourceFile), istreambuf_iterator<char>()));
+        }
+    }
+    else {
+        for (unsigned long long i = 0; i < iterations; i++) {
+            string source = generateSource(seed + i, directives);
+            if (mutate)
+                mutateSource(seed + i, &source);
+            check("seed-" + to_string(seed + i), source);
+        }
+    }
+
+    cout << checked << " sources checked, " << withDirectives << " with directives, " << differing << " differ" << endl;
+    return differing > 0 ? 1 : 0;
+}
+#endif
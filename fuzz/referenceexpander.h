@@ -0,0 +1,556 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+using namespace std;
+
+// The macro processor as it was before any of the performance work, kept as the reference the fuzzer compares
+// the engine in macroprocessor.h against. It is the original code with its quirks (the "bugfix?" prefix handling
+// of expandMacro, the prefix lost by expandInsideDefinition, chained parameter substitution, the first definition
+// of a name winning), only what was undefined behaviour is fixed, marked "reference fix":
+//  - seekEnd was read before it was set when splitting a body into lines
+//  - a call passing more parameters than the macro has wrote past the end of the substitutions
+//  - toupper and isspace were given negative chars for bytes of 0x80 and above
+// What the engine does differently on purpose is marked "reference change", so far only that local labels are
+// also renamed inside expressions like $LOOP+3.
+// Everything lives in its own namespace, the names are the same as the engine's.
+
+namespace reference {
+
+struct macroDefinition {
+    string name;
+    string params;
+    string code;
+};
+
+// Where the warnings go, and the label numbers, reset by processSource
+ostream* messages = &cout;
+unsigned int labelSubstitutions = 0;
+unsigned int defineMacroLabelSubstitutions = 0;
+
+string SICXE_COMMANDS[] = { "ADD", "ADDF", "ADDR", "AND", "CLEAR", "COMP", "COMPF", "DIV", "DIVF", "DIVR", "FIX", "FLOAT", "HIO", "J", "JEQ", "JGT", "JLT", "JSUB", "LDA", "LDB", "LDCH", "LDF", "LDL", "LDS", "LDT", "LDX", "LPS", "MUL", "MULF", "MULR", "NORM", "OR", "RD", "RMO", "RSUB", "SIO", "SSK", "STA", "STB", "STCH", "STF", "STI", "STL", "STS", "STSW", "STT", "STX", "SUB", "SUBF", "SUBR", "SVC", "TD", "TIO", "TIX", "TIXR", "WD" };
+string SICXE_DIRECTIVES[] = { "BYTE", "EQU", "WORD", "RESW", "START", "END" };
+
+bool isCommand(string opcode) {
+    if (opcode.length() > 0) {
+        if (opcode[0] == '+') {
+            opcode.erase(0, 1);
+        }
+        for (int i = 0; i < 56; i++) {
+            if (opcode == SICXE_COMMANDS[i]) return true;
+        }
+        for (int i = 0; i < 6; i++) {
+            if (opcode == SICXE_DIRECTIVES[i]) return true;
+        }
+    }
+    return false;
+}
+
+// reference fix: isspace of a negative char is undefined
+bool isSpace(char c) {
+    return ::isspace((unsigned char)c);
+}
+
+// findRenamed - the new name of a local label, the first one if there are several lines with it; nullptr if it isn't one
+const string* findRenamed(const vector<pair<string, string>>* renamed, const string& label) {
+    for (const pair<string, string>& labels : *renamed) {
+        if (labels.first == label)
+            return &labels.second;
+    }
+    return nullptr;
+}
+
+// renameLabelTerms - renames the local labels in an operand, after its '#' or '@' prefix
+// reference change: the original only renamed an operand that was a local label as a whole. That still comes first,
+// otherwise every term between the operators + - * / ( ) that is a local label is renamed.
+void renameLabelTerms(string* operand, const vector<pair<string, string>>* renamed) {
+    size_t start = ((*operand)[0] == '#' || (*operand)[0] == '@') ? 1 : 0;
+    const string* newLabel = findRenamed(renamed, operand->substr(start));
+    if (newLabel != nullptr) {
+        operand->replace(start, string::npos, *newLabel);
+        return;
+    }
+    while (start < operand->length()) {
+        size_t end = operand->find_first_of("+-*/()", start);
+        if (end == string::npos)
+            end = operand->length();
+        newLabel = findRenamed(renamed, operand->substr(start, end - start));
+        if (newLabel != nullptr) {
+            operand->replace(start, end - start, *newLabel);
+            end = start + newLabel->length();
+        }
+        start = end + 1;
+    }
+}
+
+void processLine(vector<macroDefinition>* macroDefArray, string line, istream* sourceFile, ostream* destFile, unsigned int* lineNumber);
+macroDefinition defineMacro(istream* sourceFile, vector<macroDefinition>* macroDefArray, unsigned int* lineNumber, string macroName, string macroParameters);
+void expandInsideDefinition(macroDefinition* macroDef, macroDefinition macroToExpand, string label, string parameters);
+void expandMacro(ostream* destFile, macroDefinition macroToExpand, string label, string parameters);
+
+// processSource - what main did with the source file, warnings go to messageFile
+void processSource(istream* sourceFile, ostream* destFile, ostream* messageFile) {
+    vector<macroDefinition> macroDefArray;
+    messages = messageFile;
+    labelSubstitutions = 0;
+    defineMacroLabelSubstitutions = 0;
+
+    string lineOfCode;
+    unsigned int lineNumber = 1;
+
+    while(getline(*sourceFile, lineOfCode)) {
+        processLine(&macroDefArray, lineOfCode, sourceFile, destFile, &lineNumber);
+        lineNumber++;
+    }
+}
+
+// sanitizeString - Make all characters upper case except for strings and delete comments
+string sanitizeString(string line) {
+    bool insideString = false;
+    for (long unsigned int i = 0; i < line.length(); i++) {
+        if (line[i] == '\'') insideString = !insideString;
+        // since there can be a ";" symbol inside a SIC/XE string, also check for the comment symbol but only OUTSIDE a SIC/XE string
+        // if there is a ";" (comment symbol) outside of a SIC/XE string, delete it and all that comes after it
+        if (!insideString && line[i] == ';') {
+            line.erase(i, line.length());
+            break;
+        }
+        // else just make the character upper case so we can easily parse the file later on
+        // reference fix: toupper of a negative char is undefined
+        else if (!insideString) line[i] = ::toupper((unsigned char)line[i]);
+    }
+    return line;
+}
+
+macroDefinition findMacro(vector<macroDefinition>* macroDefArray, string macroName) {
+    for (unsigned int i = 0; i < macroDefArray->size(); i++) {
+        if (macroDefArray->at(i).name == macroName)
+            return macroDefArray->at(i);
+    }
+    macroDefinition nullMacro; nullMacro.name = ""; nullMacro.code = ""; nullMacro.params = "";
+    return nullMacro;
+}
+
+// splitLine - delete comments and split the string into separate strings - label, opcode, parameters. Returns the values through pointers to strings passed into it.
+void splitLine(string line, string* label, string* opcode, string* params) {
+
+    line = sanitizeString(line);
+
+    size_t lineSeek = line.find_first_not_of("\t\n\v\f\r ");
+    size_t seekEnd; // the end of the current part of line (label, opcode, params)
+
+    *label = "";
+    *opcode = "";
+    *params = "";
+
+    if (lineSeek != string::npos) {
+        if (lineSeek == 0) {
+            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
+            *label = line.substr(lineSeek, seekEnd - lineSeek);
+            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
+        }
+
+        // the line can have only a label and nothing else, check if it's not the case
+        if (lineSeek != string::npos) {
+            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
+            *opcode = line.substr(lineSeek, seekEnd - lineSeek);
+
+            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
+            // the line can have no params, check if it's not the case
+            if (lineSeek != string::npos) {
+                *params = line.substr(lineSeek, line.length() - lineSeek);
+            }
+        }
+    }
+}
+
+void processLine(vector<macroDefinition>* macroDefArray, string line, istream* sourceFile, ostream* destFile, unsigned int* lineNumber) {
+    string label = "";
+    string opcode = "";
+    string parameters = "";
+
+    splitLine(line, &label, &opcode, &parameters);
+
+    if (label == "" && opcode == "" && parameters == "") {
+        return;
+    }
+
+    if (label.length() > 6) *messages << "Line " << *lineNumber << ": Warning - label " << label << " is over 6 characters long!" << endl;
+
+    // Searches for a macro definition of the same name in the vector
+    // If not found, will return a null macro with all empty fields
+    macroDefinition foundMacro = findMacro(macroDefArray, opcode);
+    if (opcode == "MACRO") {
+        macroDefinition newDefinition = defineMacro(sourceFile, macroDefArray, lineNumber, label, parameters);
+        macroDefArray->push_back(newDefinition);
+    }
+    else if (foundMacro.name == opcode) {
+        expandMacro(destFile, foundMacro, label, parameters);
+    }
+    else if (isCommand(opcode)) {
+        *destFile << label << "\t" << opcode << "\t" << parameters << endl;
+    }
+    else {
+        *messages << "Line " << *lineNumber << ": Warning - unknown command " << opcode << endl;
+        *destFile << label << "\t" << opcode << "\t" << parameters << endl;
+    }
+}
+
+macroDefinition defineMacro(istream* sourceFile, vector<macroDefinition>* macroDefArray, unsigned int* lineNumber, string macroName, string macroParameters) {
+    macroDefinition newDefinition;
+    newDefinition.name = macroName;
+    newDefinition.params = macroParameters;
+
+    if (isCommand(macroName)) *messages << "Line " << *lineNumber << ": Warning - " << macroName << " replaces a SIC/XE command!" << endl;
+    macroDefinition searchDefinedMacro = findMacro(macroDefArray, macroName);
+    if (searchDefinedMacro.name == macroName) *messages << "Line " << *lineNumber << ": Warning - " << macroName << " is already defined!" << endl;
+
+    string line;
+
+    string label = "";
+    string opcode = "";
+    string params = "";
+
+    // get first line
+    bool isEOF = false;
+    if (!getline(*sourceFile, line))
+        isEOF = true;
+    *lineNumber = *lineNumber + 1;
+
+    splitLine(line, &label, &opcode, &params);
+
+    while (opcode != "MEND" && !isEOF) {
+        line = sanitizeString(line);
+        bool lineIsNotEmpty = (label != "" || opcode != "" || params != "");
+        bool macroExpanded = false;
+        if (lineIsNotEmpty) {
+            macroDefinition foundMacro = findMacro(macroDefArray, opcode);
+            if (foundMacro.name == opcode) {
+                expandInsideDefinition(&newDefinition, foundMacro, label, params);
+                macroExpanded = true;
+            }
+            else {
+                newDefinition.code += line;
+            }
+        }
+
+
+        if (!getline(*sourceFile, line)) isEOF = true;
+        *lineNumber = *lineNumber + 1;
+
+        splitLine(line, &label, &opcode, &params);
+        if (opcode != "MEND" && lineIsNotEmpty && !macroExpanded) newDefinition.code += "\n";
+    }
+
+    return newDefinition;
+}
+
+
+void expandInsideDefinition(macroDefinition* macroDef, macroDefinition macroToExpand, string label, string parameters) {
+    struct substitution {
+        string match;
+        string replacement;
+    };
+
+    struct lineOfCode {
+        string label;
+        string opcode;
+        vector<string> parameters;
+    };
+
+    // Step 1, turn the code of the macro into a vector of lines
+    vector<lineOfCode> codeToExpand;
+    size_t lineSeek = 0;
+    size_t seekEnd = 0;   // reference fix: was read uninitialized by the loop below
+
+    // A paranoid check if the macro has any code
+    if (macroToExpand.code != "") {
+        // Process each line, putting it into a vector of code lines (makes it easier to substitute labels later)
+        while (seekEnd != string::npos) {
+            seekEnd = macroToExpand.code.find_first_of("\n", lineSeek);
+            string currentLine = macroToExpand.code.substr(lineSeek, seekEnd - lineSeek);
+
+            string currentLineLabel, currentLineOpcode, currentLineParameters;
+            splitLine(currentLine, &currentLineLabel, &currentLineOpcode, &currentLineParameters);
+
+            lineOfCode currentLineOfCode;
+            currentLineOfCode.label = currentLineLabel;
+            currentLineOfCode.opcode = currentLineOpcode;
+
+            vector<string> tempParameterVector;
+            if (currentLineParameters != "") {
+                // Remove all spaces in the parameters strings
+                currentLineParameters.erase(remove_if(currentLineParameters.begin(), currentLineParameters.end(), isSpace), currentLineParameters.end());
+                string delimiter = ",";
+                size_t paramLineSeek;
+                size_t paramSeekEnd = -1;
+                do {
+                    paramLineSeek = paramSeekEnd + 1;
+                    paramSeekEnd = currentLineParameters.find(delimiter, paramLineSeek);
+                    string tempParameter = currentLineParameters.substr(paramLineSeek, paramSeekEnd - paramLineSeek);
+                    tempParameterVector.push_back(tempParameter);
+                } while (paramSeekEnd != string::npos);
+            }
+            lineSeek = seekEnd + 1;
+            currentLineOfCode.parameters = tempParameterVector;
+            codeToExpand.push_back(currentLineOfCode);
+        }
+    }
+
+
+    // Step 2, take macro parameters and substitute them
+    //
+    // Remove all spaces in the parameters strings
+    macroToExpand.params.erase(remove_if(macroToExpand.params.begin(), macroToExpand.params.end(), isSpace), macroToExpand.params.end());
+    parameters.erase(remove_if(parameters.begin(), parameters.end(), isSpace), parameters.end());
+
+    // Create a vector that stores substitutions
+    // Parameters to replace (match) and what to replace them with (replacement)
+    vector<substitution> substitutionVector;
+
+    // If the macro has any parameters, add them to the substitutionVector
+    if (macroToExpand.params != "") {
+        // Parameters are separated by commas, spaces were trimmed
+        string delimiter = ",";
+        size_t lineSeek;
+        size_t seekEnd = -1;
+        // Parse the parameters of the macro itself
+        do {
+            lineSeek = seekEnd + 1;
+            seekEnd = macroToExpand.params.find(delimiter, lineSeek);
+            string macroParameter = macroToExpand.params.substr(lineSeek, seekEnd - lineSeek);
+            substitution tempSubstitution;
+            tempSubstitution.match = macroParameter; tempSubstitution.replacement = "";
+            substitutionVector.push_back(tempSubstitution);
+        } while (seekEnd != string::npos);
+
+        // Parse the passed parameters
+        // TODO: Error if less parameters were passed than intended by the macro definition.
+        seekEnd = -1;
+        unsigned int i = -1;
+        do {
+            i++;
+            lineSeek = seekEnd + 1;
+            seekEnd = parameters.find(delimiter, lineSeek);
+            string parameter = parameters.substr(lineSeek, seekEnd - lineSeek);
+            substitutionVector[i].replacement = parameter;
+        } while (seekEnd != string::npos && i + 1 < substitutionVector.size());   // reference fix: was i < size, one past the end
+
+        // Go through the parameters in the code and substitute them
+        for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+            for (unsigned int j = 0; j < codeToExpand.at(i).parameters.size(); j++) {
+                // Prefixes would make it difficult to compare strings so we'll store the prefix in a string
+                // and remove it from the parameter string, adding it back later
+                string prefix = "";
+                if (codeToExpand.at(i).parameters.at(j)[0] == '#' || codeToExpand.at(i).parameters.at(j)[0] == '@') {
+                        prefix = codeToExpand.at(i).parameters.at(j)[0];
+                        codeToExpand.at(i).parameters.at(j).erase(0, 1);
+                }
+                // Search the substitution vector for matches and replace with the corresponding replacement parameter, adding the prefix back in
+                for (unsigned int k = 0; k < substitutionVector.size(); k++) {
+                    if (codeToExpand.at(i).parameters.at(j) == substitutionVector.at(k).match) {
+                        codeToExpand.at(i).parameters.at(j) = (prefix + substitutionVector.at(k).replacement);
+                    }
+                }
+            }
+        }
+    }
+
+    // Substitute labels to avoid label conflicts when expanding macro two times or more
+    // reference change: the new names are all given out first and the operands renamed after, see renameLabelTerms
+    vector<pair<string, string>> renamed;
+    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+        // If label has '$' prefix, it is a local label inside the macro and should be replaced
+        if (codeToExpand.at(i).label[0] == '$') {
+            string oldLabel = codeToExpand.at(i).label;
+            string newLabel = "$tm" + to_string(defineMacroLabelSubstitutions++);
+            renamed.push_back({ oldLabel, newLabel });
+            codeToExpand.at(i).label = newLabel;
+        }
+    }
+    for (unsigned int j = 0; j < codeToExpand.size() && !renamed.empty(); j++) {
+        for (unsigned int k = 0; k < codeToExpand.at(j).parameters.size(); k++) {
+            renameLabelTerms(&codeToExpand.at(j).parameters.at(k), &renamed);
+        }
+    }
+
+    // Output the code to destination file
+    //
+    // If the macro call string has a label, it should be preserved
+    if (label != "")
+        macroDef->code += (label + "\n");
+
+    // Output the code line vector
+    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+        macroDef->code += (codeToExpand.at(i).label + "\t" + codeToExpand.at(i).opcode);
+        if (codeToExpand.at(i).parameters.size() > 0) {
+            macroDef->code += ("\t" + codeToExpand.at(i).parameters.at(0));
+            for (unsigned int j = 1; j < codeToExpand.at(i).parameters.size(); j++) {
+                macroDef->code += ("," + codeToExpand.at(i).parameters.at(j));
+            }
+        }
+        macroDef->code += "\n";
+    }
+}
+
+
+
+void expandMacro(ostream* destFile, macroDefinition macroToExpand, string label, string parameters) {
+    struct substitution {
+        string match;
+        string replacement;
+    };
+
+    struct lineOfCode {
+        string label;
+        string opcode;
+        vector<string> parameters;
+    };
+
+    // Step 1, turn the code of the macro into a vector of lines
+    vector<lineOfCode> codeToExpand;
+    size_t lineSeek = 0;
+    size_t seekEnd = 0;   // reference fix: was read uninitialized by the loop below
+
+    // A paranoid check if the macro has any code
+    if (macroToExpand.code != "") {
+        // Process each line, putting it into a vector of code lines (makes it easier to substitute labels later)
+        while (seekEnd != string::npos) {
+            seekEnd = macroToExpand.code.find_first_of("\n", lineSeek);
+            string currentLine = macroToExpand.code.substr(lineSeek, seekEnd - lineSeek);
+
+            string currentLineLabel, currentLineOpcode, currentLineParameters;
+            splitLine(currentLine, &currentLineLabel, &currentLineOpcode, &currentLineParameters);
+
+            lineOfCode currentLineOfCode;
+            currentLineOfCode.label = currentLineLabel;
+            currentLineOfCode.opcode = currentLineOpcode;
+
+            vector<string> tempParameterVector;
+            if (currentLineParameters != "") {
+                // Remove all spaces in the parameters strings
+                currentLineParameters.erase(remove_if(currentLineParameters.begin(), currentLineParameters.end(), isSpace), currentLineParameters.end());
+                string delimiter = ",";
+                size_t paramLineSeek;
+                size_t paramSeekEnd = -1;
+                do {
+                    paramLineSeek = paramSeekEnd + 1;
+                    paramSeekEnd = currentLineParameters.find(delimiter, paramLineSeek);
+                    string tempParameter = currentLineParameters.substr(paramLineSeek, paramSeekEnd - paramLineSeek);
+                    tempParameterVector.push_back(tempParameter);
+                } while (paramSeekEnd != string::npos);
+            }
+            lineSeek = seekEnd + 1;
+            currentLineOfCode.parameters = tempParameterVector;
+            codeToExpand.push_back(currentLineOfCode);
+        }
+    }
+
+
+    // Step 2, take macro parameters and substitute them
+    //
+    // Remove all spaces in the parameters strings
+    macroToExpand.params.erase(remove_if(macroToExpand.params.begin(), macroToExpand.params.end(), isSpace), macroToExpand.params.end());
+    parameters.erase(remove_if(parameters.begin(), parameters.end(), isSpace), parameters.end());
+
+    // Create a vector that stores substitutions
+    // Parameters to replace (match) and what to replace them with (replacement)
+    vector<substitution> substitutionVector;
+
+    // If the macro has any parameters, add them to the substitutionVector
+    if (macroToExpand.params != "") {
+        // Parameters are separated by commas, spaces were trimmed
+        string delimiter = ",";
+        size_t lineSeek;
+        size_t seekEnd = -1;
+        // Parse the parameters of the macro itself
+        do {
+            lineSeek = seekEnd + 1;
+            seekEnd = macroToExpand.params.find(delimiter, lineSeek);
+            string macroParameter = macroToExpand.params.substr(lineSeek, seekEnd - lineSeek);
+            substitution tempSubstitution;
+            tempSubstitution.match = macroParameter; tempSubstitution.replacement = "";
+            substitutionVector.push_back(tempSubstitution);
+        } while (seekEnd != string::npos);
+
+        // Parse the passed parameters
+        // TODO: Error if less parameters were passed than intended by the macro definition.
+        seekEnd = -1;
+        unsigned int i = -1;
+        do {
+            i++;
+            lineSeek = seekEnd + 1;
+            seekEnd = parameters.find(delimiter, lineSeek);
+            string parameter = parameters.substr(lineSeek, seekEnd - lineSeek);
+            substitutionVector[i].replacement = parameter;
+        } while (seekEnd != string::npos && i + 1 < substitutionVector.size());   // reference fix: was i < size, one past the end
+
+        // Go through the parameters in the code and substitute them
+        for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+            for (unsigned int j = 0; j < codeToExpand.at(i).parameters.size(); j++) {
+                // Prefixes would make it difficult to compare strings so we'll store the prefix in a string
+                // and remove it from the parameter string, adding it back later
+                string prefix = "";
+                if (codeToExpand.at(i).parameters.at(j)[0] == '#' || codeToExpand.at(i).parameters.at(j)[0] == '@') {
+                        prefix = codeToExpand.at(i).parameters.at(j)[0];
+                        codeToExpand.at(i).parameters.at(j).erase(0, 1);
+                }
+                // Search the substitution vector for matches and replace with the corresponding replacement parameter, adding the prefix back in
+                for (unsigned int k = 0; k < substitutionVector.size(); k++) {
+                    if (codeToExpand.at(i).parameters.at(j) == substitutionVector.at(k).match) {
+                        codeToExpand.at(i).parameters.at(j) = substitutionVector.at(k).replacement;
+                    }
+                }
+                // bugfix?
+                codeToExpand.at(i).parameters.at(j) = prefix + codeToExpand.at(i).parameters.at(j);
+            }
+        }
+    }
+
+    // Substitute labels to avoid label conflicts when expanding macro two times or more
+    // reference change: the new names are all given out first and the operands renamed after, see renameLabelTerms
+    vector<pair<string, string>> renamed;
+    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+        // If label has '$' prefix, it is a local label inside the macro and should be replaced
+        if (codeToExpand.at(i).label[0] == '$') {
+            string oldLabel = codeToExpand.at(i).label;
+            string newLabel = "lb" + to_string(labelSubstitutions++);
+            renamed.push_back({ oldLabel, newLabel });
+            codeToExpand.at(i).label = newLabel;
+        }
+    }
+    for (unsigned int j = 0; j < codeToExpand.size() && !renamed.empty(); j++) {
+        for (unsigned int k = 0; k < codeToExpand.at(j).parameters.size(); k++) {
+            renameLabelTerms(&codeToExpand.at(j).parameters.at(k), &renamed);
+        }
+    }
+
+    // Output the code to destination file
+    //
+    // If the macro call string has a label, it should be preserved
+    if (label != "")
+        *destFile << label << endl;
+
+    // Add a comment marking the beginning of macro expansion to the assembler program code
+    *destFile << "; " << macroToExpand.name << " " << parameters << endl;
+
+    // Output the code line vector
+    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
+        *destFile << codeToExpand.at(i).label << "\t" << codeToExpand.at(i).opcode;
+        if (codeToExpand.at(i).parameters.size() > 0) {
+            *destFile << "\t" << codeToExpand.at(i).parameters.at(0);
+            for (unsigned int j = 1; j < codeToExpand.at(i).parameters.size(); j++) {
+                *destFile << "," << codeToExpand.at(i).parameters.at(j);
+            }
+        }
+        *destFile << endl;
+    }
+
+    // Add a comment marking the end of macro expansion to the assembler program code
+    *destFile << "; MEND" << endl;
+}
+
+}
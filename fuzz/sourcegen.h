@@ -0,0 +1,278 @@
+#pragma once
+#include <string>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Random SIC/XE sources for the fuzzer, shaped to hit the corners of the expander rather than to look real.
+//
+// Macros are defined with 0 to 3 parameters and $ local labels, called with too few arguments and in lower
+// case, redefined, named like commands, left without a name; bodies call the macros defined before them and
+// have labels only, empty lines and comments. Operands mix parameters, local labels, expressions of both,
+// # and @ prefixes, strings with ';' and ',' in them and empty operands, some local labels have an operator in
+// their name. Whitespace is spaces and tabs in any mix, and some sources have "\r\n" line ends or no line end
+// after the last line. Macro-time directives are left out, the reference expander doesn't know them, unless
+// the generator is asked for them: then bodies also SET, loop and branch on numbers at the ends of the 64 bit
+// range, divide by -1 and 0 and write numbers too large to read. mutateSource then breaks a source up byte
+// by byte, the way libFuzzer would.
+
+struct sourceGenerator {
+    mt19937 random;
+    vector<pair<string, unsigned int>> macros;   // name and parameter count of every macro defined so far
+    bool directives = false;                      // bodies get IF, WHILE and SET lines too
+};
+
+const char* FUZZ_OPCODES[] = { "LDA", "STA", "ADD", "sub", "Comp", "JEQ", "J", "+JSUB", "RSUB", "LDX", "TIX", "JLT", "BYTE", "WORD", "RESW", "CLEAR", "TIXR", "FOO", "BAR", "ldch" };
+const char* FUZZ_WHITESPACE[] = { " ", "\t", "  ", " \t", "\t\t" };
+const char* FUZZ_OPERANDS[] = { "BUF", "len", "ZERO", "#3", "@PTR", "4096", "$EXT", "lb1", "&Q" };
+const char* FUZZ_NUMBERS[] = { "0", "1", "-1", "2", "7", "9223372036854775807", "0-9223372036854775807-1", "4611686018427387904", "9223372036854775808", "99999999999999999999" };
+const char* FUZZ_ARITHMETIC[] = { "+", "-", "*", "/", " MOD " };
+const char* FUZZ_MACRO_NAMES[] = { "M", "PUSH", "POP", "Swap", "INC", "LDA", "MAC", "CALLX", "copy", "" };
+
+template <size_t count>
+const char* pickFrom(sourceGenerator* generator, const char* const (&choices)[count]) {
+    return choices[generator->random() % count];
+}
+
+unsigned int pickNumber(sourceGenerator* generator, unsigned int low, unsigned int high) {
+    return low + generator->random() % (high - low + 1);
+}
+
+bool chance(sourceGenerator* generator, double probability) {
+    return uniform_real_distribution<double>(0, 1)(generator->random) < probability;
+}
+
+string fuzzOperand(sourceGenerator* generator, const vector<string>* formals, const vector<string>* locals) {
+    double c = uniform_real_distribution<double>(0, 1)(generator->random);
+    string operand;
+    if (!formals->empty() && c < 0.35)
+        operand = (*formals)[generator->random() % formals->size()];
+    else if (!locals->empty() && c < 0.55)
+        operand = (*locals)[generator->random() % locals->size()];
+    else if (c < 0.65)
+        operand = pickFrom(generator, { "X", "A", "S", "T" });
+    else if (c < 0.7)
+        operand = "C'Ab;c d'";
+    else if (c < 0.75)
+        operand = "X'F1'";
+    else if (c < 0.8)
+        operand = "";
+    else if (c < 0.88) {
+        // An expression, its terms local labels, parameters or numbers
+        unsigned int terms = pickNumber(generator, 2, 3);
+        for (unsigned int i = 0; i < terms; i++) {
+            if (i > 0)
+                operand += pickFrom(generator, { "+", "-", "*", "/" });
+            if (!locals->empty() && chance(generator, 0.5))
+                operand += (*locals)[generator->random() % locals->size()];
+            else if (!formals->empty() && chance(generator, 0.3))
+                operand += (*formals)[generator->random() % formals->size()];
+            else
+                operand += to_string(pickNumber(generator, 0, 9));
+        }
+        if (chance(generator, 0.2))
+            operand = "(" + operand + ")";
+    }
+    else
+        operand = pickFrom(generator, FUZZ_OPERANDS);
+    if (operand != "" && operand[0] != '#' && operand[0] != '@' && operand[0] != 'C' && chance(generator, 0.25))
+        operand = pickFrom(generator, { "#", "@" }) + operand;
+    return operand;
+}
+
+string fuzzArguments(sourceGenerator* generator, unsigned int count, const vector<string>* formals, const vector<string>* locals) {
+    string arguments;
+    for (unsigned int i = 0; i < count; i++)
+        arguments += (i > 0 ? "," : "") + fuzzOperand(generator, formals, locals);
+    return arguments;
+}
+
+// fuzzCodeLine - a line of code or a macro call, inside a body when there are formals or locals
+string fuzzCodeLine(sourceGenerator* generator, const vector<string>* formals, const vector<string>* locals) {
+    string label;
+    if (!locals->empty() && chance(generator, 0.3))
+        label = (*locals)[generator->random() % locals->size()];
+    else if (chance(generator, 0.1))
+        label = pickFrom(generator, { "LOOP", "veryLongLabel", "X1", "$" });
+
+    if (!generator->macros.empty() && chance(generator, 0.2)) {
+        const pair<string, unsigned int>& macro = generator->macros[generator->random() % generator->macros.size()];
+        string arguments = fuzzArguments(generator, pickNumber(generator, 0, macro.second), formals, locals);
+        if (chance(generator, 0.2)) {
+            string lower = macro.first;
+            for (char& c : lower)
+                c = tolower((unsigned char)c);
+            return label + pickFrom(generator, FUZZ_WHITESPACE) + lower;
+        }
+        string line = label + pickFrom(generator, FUZZ_WHITESPACE) + macro.first;
+        if (arguments != "" || chance(generator, 0.5))
+            line += pickFrom(generator, FUZZ_WHITESPACE) + arguments;
+        return line;
+    }
+    if (chance(generator, 0.05))
+        return label;
+
+    string line = label + pickFrom(generator, FUZZ_WHITESPACE) + pickFrom(generator, FUZZ_OPCODES);
+    unsigned int operandCount = pickFrom(generator, { "0", "1", "1", "2", "3" })[0] - '0';
+    const char* separator = pickFrom(generator, { ",", ", ", " ," });
+    if (operandCount > 0) {
+        line += pickFrom(generator, FUZZ_WHITESPACE);
+        for (unsigned int i = 0; i < operandCount; i++)
+            line += (i > 0 ? separator : "") + fuzzOperand(generator, formals, locals);
+    }
+    if (chance(generator, 0.2))
+        line += string(pickFrom(generator, FUZZ_WHITESPACE)) + "; comment, with 'quote";
+    return line;
+}
+
+// fuzzExpressionTerm - a number, a variable or a parameter, some of them past what 64 bits hold
+string fuzzExpressionTerm(sourceGenerator* generator, const vector<string>* formals, const vector<string>* variables) {
+    if (!variables->empty() && chance(generator, 0.4))
+        return (*variables)[generator->random() % variables->size()];
+    if (!formals->empty() && chance(generator, 0.2))
+        return (*formals)[generator->random() % formals->size()];
+    return pickFrom(generator, FUZZ_NUMBERS);
+}
+
+string fuzzExpression(sourceGenerator* generator, const vector<string>* formals, const vector<string>* variables) {
+    string expression = fuzzExpressionTerm(generator, formals, variables);
+    unsigned int terms = pickNumber(generator, 0, 2);
+    for (unsigned int i = 0; i < terms; i++)
+        expression += pickFrom(generator, FUZZ_ARITHMETIC) + fuzzExpressionTerm(generator, formals, variables);
+    return expression;
+}
+
+// fuzzDirectiveLines - a SET, a bounded WHILE that keeps doubling a variable or an IF, their values written with WORD
+void fuzzDirectiveLines(sourceGenerator* generator, const vector<string>* formals, vector<string>* variables, vector<string>* lines) {
+    string variable = "&V" + to_string(pickNumber(generator, 0, 2));
+    string ws = pickFrom(generator, FUZZ_WHITESPACE);
+    switch (generator->random() % 4) {
+    case 0:
+        lines->push_back(variable + ws + "SET" + ws + fuzzExpression(generator, formals, variables));
+        break;
+    case 1:
+        // The smallest number divided by -1, the one division that doesn't fit
+        lines->push_back(variable + ws + "SET" + ws + "0-9223372036854775807-1");
+        lines->push_back(variable + ws + "SET" + ws + variable + pickFrom(generator, { "/-1", " MOD -1", "*-1", "-1", "/0" }));
+        break;
+    case 2:
+        lines->push_back("&I" + ws + "SET" + ws + "0");
+        lines->push_back(variable + ws + "SET" + ws + pickFrom(generator, FUZZ_NUMBERS));
+        lines->push_back(ws + "WHILE" + ws + "&I < " + to_string(pickNumber(generator, 1, 70)));
+        lines->push_back(variable + ws + "SET" + ws + variable + pickFrom(generator, { "*2", "*3", "+9223372036854775807", "-9223372036854775807" }));
+        lines->push_back("&I" + ws + "SET" + ws + "&I+1");
+        lines->push_back(ws + "ENDW");
+        break;
+    default:
+        lines->push_back(ws + "IF" + ws + fuzzExpression(generator, formals, variables) + pickFrom(generator, { " < ", " > ", " = " }) + fuzzExpression(generator, formals, variables));
+        lines->push_back(ws + "WORD" + ws + variable);
+        lines->push_back(ws + "ELSE");
+        lines->push_back(ws + "WORD" + ws + "-" + variable);
+        lines->push_back(ws + "ENDIF");
+        break;
+    }
+    lines->push_back(ws + "WORD" + ws + variable);
+    if (find(variables->begin(), variables->end(), variable) == variables->end())
+        variables->push_back(variable);
+}
+
+void fuzzDefinition(sourceGenerator* generator, vector<string>* lines) {
+    string name = pickFrom(generator, FUZZ_MACRO_NAMES) + to_string(pickNumber(generator, 0, 6));
+    if (chance(generator, 0.05))
+        name = "";
+    if (!generator->macros.empty() && chance(generator, 0.1))
+        name = generator->macros[generator->random() % generator->macros.size()].first;
+
+    vector<string> formals, locals;
+    unsigned int parameterCount = pickNumber(generator, 0, 3);
+    for (unsigned int i = 0; i < parameterCount; i++)
+        formals.push_back(string("&") + pickFrom(generator, { "A", "B", "C", "D", "E", "F", "G" }) + to_string(i));
+    unsigned int localCount = pickNumber(generator, 0, 3);
+    for (unsigned int i = 0; i < localCount; i++)
+        locals.push_back(string("$") + pickFrom(generator, { "L", "LOOP", "END", "x", "P+" }) + to_string(i));
+
+    string header = name + pickFrom(generator, FUZZ_WHITESPACE) + "MACRO";
+    for (unsigned int i = 0; i < parameterCount; i++)
+        header += (i > 0 ? ", " : pickFrom(generator, FUZZ_WHITESPACE)) + formals[i];
+    lines->push_back(header);
+
+    vector<string> variables;
+    unsigned int bodyLines = pickNumber(generator, 0, 7);
+    for (unsigned int i = 0; i < bodyLines; i++) {
+        if (chance(generator, 0.1))
+            lines->push_back(pickFrom(generator, { "", "   ", "; just a comment" }));
+        if (generator->directives && chance(generator, 0.4))
+            fuzzDirectiveLines(generator, &formals, &variables, lines);
+        else
+            lines->push_back(fuzzCodeLine(generator, &formals, &locals));
+    }
+    if (chance(generator, 0.15))
+        lines->push_back("");
+    lines->push_back(pickFrom(generator, { "", "LBL" }) + string(pickFrom(generator, FUZZ_WHITESPACE)) + pickFrom(generator, { "MEND", "mend", "Mend" }));
+
+    for (char& c : name)
+        c = toupper((unsigned char)c);
+    generator->macros.push_back({ name, parameterCount });
+}
+
+// generateSource - the source of one fuzzer round, the same for the same seed
+string generateSource(unsigned int seed, bool directives = false) {
+    sourceGenerator generator;
+    generator.random.seed(seed);
+    generator.directives = directives;
+    vector<string> lines;
+    const vector<string> none;
+
+    unsigned int statements = pickNumber(&generator, 5, 60);
+    for (unsigned int i = 0; i < statements; i++) {
+        double c = uniform_real_distribution<double>(0, 1)(generator.random);
+        if (c < 0.25)
+            fuzzDefinition(&generator, &lines);
+        else if (c < 0.55 && !generator.macros.empty()) {
+            const pair<string, unsigned int>& macro = generator.macros[generator.random() % generator.macros.size()];
+            string arguments = fuzzArguments(&generator, pickNumber(&generator, 0, macro.second), &none, &none);
+            string line = pickFrom(&generator, { "", "", "CALL1", "$Q", "averylonglabel" }) + string(pickFrom(&generator, FUZZ_WHITESPACE));
+            if (chance(&generator, 0.8))
+                line += macro.first;
+            else {
+                for (char c : macro.first)
+                    line += tolower((unsigned char)c);
+            }
+            if (arguments != "")
+                line += pickFrom(&generator, FUZZ_WHITESPACE) + arguments;
+            lines.push_back(line);
+        }
+        else
+            lines.push_back(fuzzCodeLine(&generator, &none, &none));
+        if (chance(&generator, 0.1))
+            lines.push_back(pickFrom(&generator, { "", "  ", "\t", ";comment only", "ONLYLBL" }));
+    }
+
+    const char* lineEnd = chance(&generator, 0.1) ? "\r\n" : "\n";
+    string source;
+    for (size_t i = 0; i < lines.size(); i++)
+        source += (i > 0 ? lineEnd : "") + lines[i];
+    if (chance(&generator, 0.7))
+        source += lineEnd;
+    return source;
+}
+
+// Bytes mutateSource puts in, the ones that mean something to the parser and a few that mean nothing
+const char FUZZ_BYTES[] = { ' ', '\t', '\r', '\n', '\v', '\f', ';', '\'', ',', '#', '@', '$', '&', 'M', 'E', 'N', 'D', 'm', 'a', 'X', '0', '\0', '\x80', '\xff' };
+
+// mutateSource - overwrites, inserts or deletes a few random bytes of the source
+void mutateSource(unsigned int seed, string* source) {
+    mt19937 random(seed);
+    unsigned int edits = 1 + random() % 8;
+    for (unsigned int i = 0; i < edits && !source->empty(); i++) {
+        size_t position = random() % source->size();
+        char c = FUZZ_BYTES[random() % sizeof(FUZZ_BYTES)];
+        switch (random() % 3) {
+            case 0: (*source)[position] = c; break;
+            case 1: source->insert(source->begin() + position, c); break;
+            default: source->erase(position, 1); break;
+        }
+    }
+}
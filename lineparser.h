@@ -0,0 +1,212 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include "./stats.h"
+#include "./linescan.h"
+
+using namespace std;
+
+// Texts shorter than this are folded one character at a time, classifying a whole block would cost more
+const size_t SHORT_TEXT = 16;
+
+// sanitizeString - Make all characters upper case except for strings and delete comments
+// Since there can be a ";" symbol inside a SIC/XE string, only a ";" OUTSIDE a SIC/XE string starts the comment.
+string sanitizeString(string line) {
+    bool insideString = false;
+    for (size_t base = 0; base < line.length(); base += SCAN_BLOCK) {
+        size_t length = min(SCAN_BLOCK, line.length() - base);
+        blockMasks masks;
+        classifyBlock(&line[base], length, &masks);
+        uint64_t inside = insideStringMask(masks.quotes, &insideString);
+        uint64_t comment = masks.semicolons & ~inside;
+        uint64_t upper = masks.lower & ~inside;
+        if (comment != 0)
+            upper &= lowBits(lowestBit(comment));
+        // else just make the character upper case so we can easily parse the file later on
+        for (; upper != 0; upper &= upper - 1)
+            line[base + lowestBit(upper)] -= 'a' - 'A';
+        if (comment != 0) {
+            line.erase(base + lowestBit(comment));
+            break;
+        }
+    }
+    return line;
+}
+
+// splitLine - delete comments and split the string into separate strings - label, opcode, parameters. Returns the values through pointers to strings passed into it.
+void splitLine(string line, string* label, string* opcode, string* params) {
+    uint64_t start = startTimer();
+
+    line = sanitizeString(line);
+
+    size_t lineSeek = line.find_first_not_of("\t\n\v\f\r ");
+    size_t seekEnd; // the end of the current part of line (label, opcode, params)
+
+    *label = "";
+    *opcode = "";
+    *params = "";
+
+    if (lineSeek != string::npos) {
+        if (lineSeek == 0) {
+            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
+            *label = line.substr(lineSeek, seekEnd - lineSeek);
+            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
+        }
+
+        // the line can have only a label and nothing else, check if it's not the case
+        if (lineSeek != string::npos) {
+            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
+            *opcode = line.substr(lineSeek, seekEnd - lineSeek);
+
+            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
+            // the line can have no params, check if it's not the case
+            if (lineSeek != string::npos) {
+                *params = line.substr(lineSeek, line.length() - lineSeek);
+            }
+        }
+    }
+    stopTimer(STAT_SPLIT_LINE, start);
+}
+
+// Views into the line itself, used where lines are read straight out of the source buffer.
+// Nothing gets upper cased or copied, comparisons and output fold the case on the fly instead.
+
+// lineFields - label, opcode and parameters of a line, with the comment cut off
+// A field starts inside a SIC/XE string if an earlier field left a quote open, which decides what folding does to it.
+struct lineFields {
+    string_view code;      // the line up to its comment
+    string_view label;
+    string_view opcode;
+    string_view params;
+    bool opcodeInString = false;
+    bool paramsInString = false;
+};
+
+// splitLineFields - same split as splitLine, but the fields are views into the line
+// The line is classified a block at a time, each field boundary is the lowest bit of a whitespace mask.
+void splitLineFields(string_view line, lineFields* fields) {
+    uint64_t start = startTimer();
+    fields->label = fields->opcode = fields->params = string_view();
+    fields->opcodeInString = fields->paramsInString = false;
+
+    // What is looked for next: the end of the label, the start and end of the opcode, the start of the parameters
+    enum { LABEL, SEEK_OPCODE, OPCODE, SEEK_PARAMS, FOUND } state = SEEK_OPCODE;
+    size_t cut = line.length();
+    size_t fieldStart = 0;
+    bool insideString = false;
+    for (size_t base = 0; base < line.length(); base += SCAN_BLOCK) {
+        size_t length = min(SCAN_BLOCK, line.length() - base);
+        blockMasks masks;
+        classifyBlock(line.data() + base, length, &masks);
+        uint64_t inside = insideStringMask(masks.quotes, &insideString);
+        uint64_t comment = masks.semicolons & ~inside;
+        size_t end = comment != 0 ? lowestBit(comment) : length;
+        uint64_t whitespace = masks.whitespace & lowBits(end);
+        uint64_t text = ~masks.whitespace & lowBits(end);
+        if (comment != 0)
+            cut = base + end;
+
+        // The line has a label if it doesn't start with whitespace
+        if (base == 0 && (text & 1) != 0)
+            state = LABEL;
+        size_t position = 0;
+        while (state != FOUND) {
+            uint64_t candidates = (state == LABEL || state == OPCODE ? whitespace : text) & ~lowBits(position);
+            if (candidates == 0)
+                break;
+            position = lowestBit(candidates);
+            switch (state) {
+            case LABEL:
+                fields->label = line.substr(0, base + position);
+                state = SEEK_OPCODE;
+                break;
+            case SEEK_OPCODE:
+                fieldStart = base + position;
+                fields->opcodeInString = ((inside >> position) & 1) != 0;
+                state = OPCODE;
+                break;
+            case OPCODE:
+                fields->opcode = line.substr(fieldStart, base + position - fieldStart);
+                state = SEEK_PARAMS;
+                break;
+            default:
+                fieldStart = base + position;
+                fields->paramsInString = ((inside >> position) & 1) != 0;
+                state = FOUND;
+                break;
+            }
+        }
+        if (comment != 0)
+            break;
+    }
+
+    // A field that didn't end before the comment runs up to it
+    if (state == LABEL)
+        fields->label = line.substr(0, cut);
+    else if (state == OPCODE)
+        fields->opcode = line.substr(fieldStart, cut - fieldStart);
+    else if (state == FOUND)
+        fields->params = line.substr(fieldStart, cut - fieldStart);
+    fields->code = line.substr(0, cut);
+    stopTimer(STAT_SPLIT_LINE, start);
+}
+
+// opcodeIs - compares the opcode of a line with an upper case opcode, folding the case on the fly like appendFolded
+bool opcodeIs(const lineFields* fields, string_view opcode) {
+    if (fields->opcode.length() != opcode.length())
+        return false;
+    bool insideString = fields->opcodeInString;
+    for (size_t i = 0; i < opcode.length(); i++) {
+        char c = fields->opcode[i];
+        if (c == '\'') insideString = !insideString;
+        if ((!insideString && c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c) != opcode[i]) return false;
+    }
+    return true;
+}
+
+// isFolded - true if upper casing the text outside SIC/XE strings wouldn't change it
+bool isFolded(string_view text, bool insideString) {
+    if (text.length() < SHORT_TEXT) {
+        for (char c : text) {
+            if (c == '\'') insideString = !insideString;
+            else if (!insideString && c >= 'a' && c <= 'z') return false;
+        }
+        return true;
+    }
+    for (size_t base = 0; base < text.length(); base += SCAN_BLOCK) {
+        blockMasks masks;
+        classifyBlock(text.data() + base, min(SCAN_BLOCK, text.length() - base), &masks);
+        if (foldedBits(&masks, &insideString) != 0)
+            return false;
+    }
+    return true;
+}
+
+// appendFolded - appends the text, upper cased outside SIC/XE strings, the way sanitizeString does it
+void appendFolded(string* out, string_view text, bool insideString) {
+    if (text.length() < SHORT_TEXT) {
+        for (char c : text) {
+            if (c == '\'') insideString = !insideString;
+            out->push_back(!insideString && c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c);
+        }
+        return;
+    }
+    for (size_t base = 0; base < text.length(); base += SCAN_BLOCK) {
+        size_t length = min(SCAN_BLOCK, text.length() - base);
+        blockMasks masks;
+        classifyBlock(text.data() + base, length, &masks);
+        size_t at = out->length();
+        out->append(text.data() + base, length);
+        for (uint64_t upper = foldedBits(&masks, &insideString); upper != 0; upper &= upper - 1)
+            (*out)[at + lowestBit(upper)] -= 'a' - 'A';
+    }
+}
+
+// foldedView - returns the text as it looks after sanitizeString, only copying it into scratch if folding changes it
+string_view foldedView(string_view text, bool insideString, string* scratch) {
+    if (isFolded(text, insideString))
+        return text;
+    scratch->clear();
+    appendFolded(scratch, text, insideString);
+    return *scratch;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// A lock-free ring of line batches between a thread that reads the source and the thread that processes it.
+//
+// There is exactly one producer and one consumer. The reader fills the slot at tail with whole lines and
+// publishes it by moving tail on, the processor hands the slot at head back by moving head on. Each index
+// is only written by one side, so no locks are needed. The batch strings keep their capacity, once every
+// slot was used nothing gets allocated, and memory never grows beyond the slots however long the input is.
+
+const size_t LINE_RING_SLOTS = 8;
+const size_t LINE_BATCH_SIZE = 1 << 16;
+
+struct lineRing {
+    string batches[LINE_RING_SLOTS];
+    atomic<size_t> head{ 0 };          // next batch to process
+    atomic<size_t> tail{ 0 };          // next batch to fill
+    atomic<bool> finished{ false };    // the reader published its last batch
+    atomic<bool> cancelled{ false };   // the processor stopped, the reader shouldn't wait for free slots any more
+};
+
+// ringBackoff - waits a little before checking the ring again
+// Spins briefly first; a source that comes from a slow pipe shouldn't keep a core busy, so after that it sleeps.
+void ringBackoff(unsigned int* attempts) {
+    if (++*attempts < 64)
+        this_thread::yield();
+    else
+        this_thread::sleep_for(chrono::microseconds(200));
+}
+
+// acquireFreeBatch - the reader's side: returns the slot to fill next, nullptr if the processor cancelled
+// Waits while every slot holds a batch that wasn't processed yet.
+string* acquireFreeBatch(lineRing* ring) {
+    size_t tail = ring->tail.load(memory_order_relaxed);
+    unsigned int attempts = 0;
+    while (tail - ring->head.load(memory_order_acquire) >= LINE_RING_SLOTS) {
+        if (ring->cancelled.load(memory_order_relaxed))
+            return nullptr;
+        ringBackoff(&attempts);
+    }
+    return &ring->batches[tail % LINE_RING_SLOTS];
+}
+
+void publishBatch(lineRing* ring) {
+    ring->tail.store(ring->tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void finishBatches(lineRing* ring) {
+    ring->finished.store(true, memory_order_release);
+}
+
+// acquireFullBatch - the processor's side: returns the next batch, nullptr once the reader finished and every batch was taken
+const string* acquireFullBatch(lineRing* ring) {
+    size_t head = ring->head.load(memory_order_relaxed);
+    unsigned int attempts = 0;
+    while (true) {
+        if (head != ring->tail.load(memory_order_acquire))
+            return &ring->batches[head % LINE_RING_SLOTS];
+        // The last batch is published before finished is set, so tail has to be checked once more
+        if (ring->finished.load(memory_order_acquire))
+            return head != ring->tail.load(memory_order_acquire) ? &ring->batches[head % LINE_RING_SLOTS] : nullptr;
+        ringBackoff(&attempts);
+    }
+}
+
+// releaseBatch - hands the batch acquireFullBatch returned back to the reader
+void releaseBatch(lineRing* ring) {
+    ring->head.store(ring->head.load(memory_order_relaxed) + 1, memory_order_release);
+}
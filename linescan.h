@@ -0,0 +1,146 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SCALAR_SCAN)
+#define VECTOR_SCAN 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Classifies the bytes of a line 64 at a time, everything lineparser.h needs to know about them.
+//
+// A block of up to 64 bytes becomes four bitmasks, bit i standing for byte i: quotes, semicolons, whitespace
+// ("\t\n\v\f\r ") and lower case letters. With AVX2 or SSE2 that is a handful of compares per 32 or 16 bytes,
+// picked at runtime by what the processor has; elsewhere, or built with -DSCALAR_SCAN, a plain loop does it.
+// Whether a byte is inside a SIC/XE string is the parity of the quotes before it, a prefix XOR of the quote mask,
+// so the comment cut, the field boundaries and the bytes to upper case all come out of the masks with bit tricks.
+
+const size_t SCAN_BLOCK = 64;
+
+struct blockMasks {
+    uint64_t quotes;
+    uint64_t semicolons;
+    uint64_t whitespace;
+    uint64_t lower;
+};
+
+// classifyScalar - the fallback, and the definition the vector versions have to match
+void classifyScalar(const char* block, blockMasks* masks) {
+    masks->quotes = masks->semicolons = masks->whitespace = masks->lower = 0;
+    for (size_t i = 0; i < SCAN_BLOCK; i++) {
+        unsigned char c = block[i];
+        uint64_t bit = (uint64_t)1 << i;
+        if (c == '\'') masks->quotes |= bit;
+        if (c == ';') masks->semicolons |= bit;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) masks->whitespace |= bit;
+        if (c >= 'a' && c <= 'z') masks->lower |= bit;
+    }
+}
+
+#ifdef VECTOR_SCAN
+// Bytes of 0x80 and above are negative for the signed compares, so they never fall into a range
+__attribute__((target("sse2")))
+void classifySse2(const char* block, blockMasks* masks) {
+    masks->quotes = masks->semicolons = masks->whitespace = masks->lower = 0;
+    for (int part = 0; part < 4; part++) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(block + 16 * part));
+        __m128i whitespace = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+            _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1))));
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+        int shift = 16 * part;
+        masks->quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\''))) << shift;
+        masks->semicolons |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(';'))) << shift;
+        masks->whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(whitespace) << shift;
+        masks->lower |= (uint64_t)(uint16_t)_mm_movemask_epi8(lower) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+void classifyAvx2(const char* block, blockMasks* masks) {
+    masks->quotes = masks->semicolons = masks->whitespace = masks->lower = 0;
+    for (int part = 0; part < 2; part++) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(block + 32 * part));
+        __m256i whitespace = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+            _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c)));
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+        int shift = 32 * part;
+        masks->quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\''))) << shift;
+        masks->semicolons |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(';'))) << shift;
+        masks->whitespace |= (uint64_t)(uint32_t)_mm256_movemask_epi8(whitespace) << shift;
+        masks->lower |= (uint64_t)(uint32_t)_mm256_movemask_epi8(lower) << shift;
+    }
+}
+#endif
+
+typedef void (*blockClassifier)(const char* block, blockMasks* masks);
+
+blockClassifier chooseClassifier() {
+#ifdef VECTOR_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return classifyAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return classifySse2;
+#endif
+    return classifyScalar;
+}
+
+// Picked once, before main runs
+const blockClassifier classifyFullBlock = chooseClassifier();
+
+// classifyBlock - classifies the length bytes at block, at most SCAN_BLOCK of them; bits past length are 0
+// A short block is copied first, the bytes after a line may not be readable.
+void classifyBlock(const char* block, size_t length, blockMasks* masks) {
+    if (length >= SCAN_BLOCK) {
+        classifyFullBlock(block, masks);
+        return;
+    }
+    char padded[SCAN_BLOCK] = {};
+    memcpy(padded, block, length);
+    classifyFullBlock(padded, masks);
+}
+
+// prefixXor - bit i becomes the XOR of bits 0 to i
+uint64_t prefixXor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// insideStringMask - bit i is set if byte i comes after an odd number of quotes, counting the ones of earlier
+// blocks through *insideString, which is moved on to the end of the block
+uint64_t insideStringMask(uint64_t quotes, bool* insideString) {
+    uint64_t through = prefixXor(quotes) ^ (*insideString ? ~(uint64_t)0 : 0);
+    *insideString = (through >> 63) != 0;
+    return through ^ quotes;
+}
+
+// lowBits - a mask of the bits below count
+uint64_t lowBits(size_t count) {
+    return count >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+}
+
+unsigned int lowestBit(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    unsigned int bit = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// foldedBits - bits of the lower case letters of a block that are outside SIC/XE strings
+uint64_t foldedBits(const blockMasks* masks, bool* insideString) {
+    return masks->lower & ~insideStringMask(masks->quotes, insideString);
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include "./macrotable.h"
+#include "./sourcefile.h"
+#include "./diagnostics.h"
+
+using namespace std;
+
+// A compiled macro library saved to disk, so a prelude doesn't have to be parsed again on every run.
+//
+// The cache holds every definition with its compiled template, the label counters and the diagnostics the
+// library produced. It is tied to the library source by a hash of its contents, a cache made from a
+// different version of the source is simply not used. All numbers are stored little endian.
+
+const char MACRO_CACHE_MAGIC[8] = { 'S', 'I', 'C', 'M', 'A', 'C', 'R', 'O' };
+const uint32_t MACRO_CACHE_VERSION = 9;
+const uint32_t NULL_MACRO_INDEX = 0xFFFFFFFF;   // a call of the table's null macro, a label alone on a line
+
+// macroLibraryState - what is left of processing a library, besides its macros
+struct macroLibraryState {
+    unsigned int labelSubstitutions = 0;
+    unsigned int defineMacroLabelSubstitutions = 0;
+    vector<diagnostic> diagnostics;   // as they were reported, before any limits
+};
+
+// hashSource - 64 bit FNV-1a of the library source
+uint64_t hashSource(string_view source) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : source)
+        hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    return hash;
+}
+
+void putNumber(string* out, uint64_t number, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out->push_back((char)((number >> (8 * i)) & 0xFF));
+}
+
+void putString(string* out, const string& text) {
+    putNumber(out, text.length(), 4);
+    out->append(text);
+}
+
+// cacheReader - reads the cache back, every read is bounds checked so a damaged cache is just rejected
+struct cacheReader {
+    const char* position;
+    const char* end;
+    bool failed = false;
+};
+
+uint64_t getNumber(cacheReader* reader, int bytes) {
+    if (reader->end - reader->position < bytes) {
+        reader->failed = true;
+        return 0;
+    }
+    uint64_t number = 0;
+    for (int i = 0; i < bytes; i++)
+        number |= (uint64_t)(unsigned char)reader->position[i] << (8 * i);
+    reader->position += bytes;
+    return number;
+}
+
+// getSigned - numbers like parameter indices are -1 when unused, they're stored as 32 bits
+int getSigned(cacheReader* reader) {
+    return (int)(int32_t)(uint32_t)getNumber(reader, 4);
+}
+
+string getString(cacheReader* reader) {
+    uint64_t length = getNumber(reader, 4);
+    if (reader->failed || (uint64_t)(reader->end - reader->position) < length) {
+        reader->failed = true;
+        return "";
+    }
+    string text(reader->position, length);
+    reader->position += length;
+    return text;
+}
+
+// putLineTable - a line table is stored as its arrays, symbols and references are indices that stay valid
+void putLineTable(string* out, const lineTable* table) {
+    putString(out, table->text);
+    putNumber(out, table->symbols.size(), 4);
+    for (const textSpan& symbol : table->symbols) {
+        putNumber(out, symbol.start, 4);
+        putNumber(out, symbol.length, 4);
+    }
+    putNumber(out, table->labels.size(), 4);
+    for (const labelReference& label : table->labels) {
+        putNumber(out, label.start, 4);
+        putNumber(out, label.length, 4);
+        putNumber(out, (uint32_t)label.localLabel, 4);
+    }
+    putNumber(out, table->operands.size(), 4);
+    for (const templateOperand& operand : table->operands) {
+        putNumber(out, (unsigned char)operand.prefix, 1);
+        putNumber(out, (uint32_t)operand.parameter, 4);
+        putNumber(out, operand.text, 4);
+        putNumber(out, operand.firstLabel, 4);
+        putNumber(out, operand.labelCount, 4);
+    }
+    putNumber(out, table->lines.size(), 4);
+    for (const templateLine& line : table->lines) {
+        putNumber(out, line.label, 4);
+        putNumber(out, line.opcode, 4);
+        putNumber(out, line.firstOperand, 4);
+        putNumber(out, line.operandCount, 4);
+        putNumber(out, (uint32_t)line.localLabel, 4);
+        putNumber(out, (uint32_t)line.call, 4);
+        putNumber(out, (uint32_t)line.control, 4);
+        putNumber(out, (uint32_t)line.expression, 4);
+        putNumber(out, (uint32_t)line.target, 4);
+        putNumber(out, (uint32_t)line.variable, 4);
+    }
+}
+
+// putTemplate - a call stores the index of the definition it calls, that definition is always stored before it
+void putTemplate(string* out, const macroTemplate* body, const unordered_map<const macroDefinition*, uint32_t>* indices) {
+    putNumber(out, body->parameters.size(), 4);
+    for (const string& parameter : body->parameters)
+        putString(out, parameter);
+    putNumber(out, body->localLabels.size(), 4);
+    for (const auto& label : body->localLabels) {
+        putString(out, label.first);
+        putNumber(out, (uint32_t)label.second, 4);
+    }
+    putNumber(out, body->labelCount, 4);
+    putNumber(out, body->variables.size(), 4);
+    for (const string& variable : body->variables)
+        putString(out, variable);
+    putNumber(out, body->expressions.size(), 4);
+    for (const macroExpression& expression : body->expressions) {
+        putNumber(out, expression.tokens.size(), 4);
+        for (const expressionToken& token : expression.tokens) {
+            putNumber(out, token.kind, 1);
+            putNumber(out, (uint64_t)token.number, 8);
+            putNumber(out, (uint32_t)token.symbol, 4);
+            putString(out, token.text);
+        }
+    }
+    putNumber(out, body->directives, 1);
+    putNumber(out, body->calls.size(), 4);
+    for (const templateCall& call : body->calls) {
+        auto index = indices->find(call.macro);
+        putNumber(out, index != indices->end() ? index->second : NULL_MACRO_INDEX, 4);
+        putNumber(out, call.arguments.size(), 4);
+        for (const string& argument : call.arguments)
+            putString(out, argument);
+        putNumber(out, call.labelName, 4);
+        putNumber(out, call.firstLabel, 4);
+        putNumber(out, call.firstOperand, 4);
+        putNumber(out, call.operandCount, 4);
+    }
+    putLineTable(out, &body->code);
+}
+
+// getCount - reads a count of items that take at least minimumSize bytes each, rejecting counts the cache can't hold
+uint64_t getCount(cacheReader* reader, size_t minimumSize) {
+    uint64_t count = getNumber(reader, 4);
+    if ((uint64_t)(reader->end - reader->position) < count * minimumSize)
+        reader->failed = true;
+    return reader->failed ? 0 : count;
+}
+
+// isValidRun - a run of count items from first on lies within size items
+bool isValidRun(uint64_t first, uint64_t count, size_t size) {
+    return first <= size && count <= size - first;
+}
+
+// getLineTable - reads a line table back, every index in it has to point inside the table
+void getLineTable(cacheReader* reader, lineTable* table, size_t symbolCount) {
+    table->text = getString(reader);
+    table->symbols.resize(getCount(reader, 8));
+    for (textSpan& symbol : table->symbols) {
+        symbol.start = getNumber(reader, 4);
+        symbol.length = getNumber(reader, 4);
+        if (!isValidRun(symbol.start, symbol.length, table->text.length()))
+            reader->failed = true;
+    }
+    table->labels.resize(getCount(reader, 12));
+    for (labelReference& label : table->labels) {
+        label.start = getNumber(reader, 4);
+        label.length = getNumber(reader, 4);
+        label.localLabel = getSigned(reader);
+    }
+    table->operands.resize(getCount(reader, 17));
+    for (templateOperand& operand : table->operands) {
+        operand.prefix = (char)getNumber(reader, 1);
+        operand.parameter = getSigned(reader);
+        operand.text = getNumber(reader, 4);
+        operand.firstLabel = getNumber(reader, 4);
+        operand.labelCount = getNumber(reader, 4);
+        if (operand.parameter >= (int)symbolCount || operand.text >= table->symbols.size() || !isValidRun(operand.firstLabel, operand.labelCount, table->labels.size())) {
+            reader->failed = true;
+            continue;
+        }
+        size_t length = table->symbols[operand.text].length;
+        for (unsigned int i = 0; i < operand.labelCount; i++) {
+            const labelReference& label = table->labels[operand.firstLabel + i];
+            if (!isValidRun(label.start, label.length, length))
+                reader->failed = true;
+        }
+    }
+    table->lines.resize(getCount(reader, 40));
+    for (templateLine& line : table->lines) {
+        line.label = getNumber(reader, 4);
+        line.opcode = getNumber(reader, 4);
+        line.firstOperand = getNumber(reader, 4);
+        line.operandCount = getNumber(reader, 4);
+        line.localLabel = getSigned(reader);
+        line.call = getSigned(reader);
+        line.control = getSigned(reader);
+        line.expression = getSigned(reader);
+        line.target = getSigned(reader);
+        line.variable = getSigned(reader);
+        if (line.label >= table->symbols.size() || line.opcode >= table->symbols.size() || !isValidRun(line.firstOperand, line.operandCount, table->operands.size()))
+            reader->failed = true;
+    }
+}
+
+void getTemplate(cacheReader* reader, macroTemplate* body, const macroTable* macros) {
+    body->parameters.resize(getCount(reader, 4));
+    for (string& parameter : body->parameters)
+        parameter = getString(reader);
+    uint64_t labelCount = getCount(reader, 8);
+    for (uint64_t i = 0; i < labelCount; i++) {
+        string name = getString(reader);
+        body->localLabels.emplace(move(name), getSigned(reader));
+    }
+    body->labelCount = getNumber(reader, 4);
+    body->variables.resize(getCount(reader, 4));
+    for (string& variable : body->variables)
+        variable = getString(reader);
+    size_t symbolCount = body->parameters.size() + body->variables.size();
+    body->expressions.resize(getCount(reader, 4));
+    for (macroExpression& expression : body->expressions) {
+        expression.tokens.resize(getCount(reader, 17));
+        for (expressionToken& token : expression.tokens) {
+            token.kind = (expressionKind)getNumber(reader, 1);
+            token.number = (long long)getNumber(reader, 8);
+            token.symbol = getSigned(reader);
+            token.text = getString(reader);
+        }
+        if (!isValidExpression(&expression, symbolCount))
+            reader->failed = true;
+    }
+    body->directives = getNumber(reader, 1) != 0;
+    body->calls.resize(getCount(reader, 24));
+    for (templateCall& call : body->calls) {
+        uint64_t index = getNumber(reader, 4);
+        if (index == NULL_MACRO_INDEX)
+            call.macro = &macros->nullMacro;
+        else if (index < macros->definitions.size())
+            call.macro = &macros->definitions[index];
+        else {
+            call.macro = &macros->nullMacro;
+            reader->failed = true;
+        }
+        call.arguments.resize(getCount(reader, 4));
+        for (string& argument : call.arguments)
+            argument = getString(reader);
+        if (call.arguments.size() != call.macro->body.parameters.size())
+            reader->failed = true;
+        call.labelName = getNumber(reader, 4);
+        call.firstLabel = getNumber(reader, 4);
+        call.firstOperand = getNumber(reader, 4);
+        call.operandCount = getNumber(reader, 4);
+        // A called macro with directives is written in place from its operands, one for every parameter
+        if (call.macro->body.directives && call.operandCount != call.arguments.size())
+            reader->failed = true;
+    }
+    getLineTable(reader, &body->code, symbolCount);
+    const vector<templateLine>& lines = body->code.lines;
+    for (const templateCall& call : body->calls) {
+        if (!isValidRun(call.firstOperand, call.operandCount, body->code.operands.size()))
+            reader->failed = true;
+    }
+    for (const templateLine& line : lines) {
+        if (line.call >= (int)body->calls.size())
+            reader->failed = true;
+        if (line.control < CONTROL_NONE || line.control > CONTROL_SET || line.target > (int)lines.size())
+            reader->failed = true;
+        bool needsExpression = line.control == CONTROL_IF || line.control == CONTROL_WHILE || line.control == CONTROL_SET;
+        if (needsExpression && (line.expression < 0 || line.expression >= (int)body->expressions.size()))
+            reader->failed = true;
+        if (line.control != CONTROL_NONE && line.control != CONTROL_ENDIF && line.target < 0)
+            reader->failed = true;
+        if (line.control == CONTROL_ENDW && (line.target >= (int)lines.size() || line.target < 0))
+            reader->failed = true;
+        if (line.control == CONTROL_SET && (line.variable < (int)body->parameters.size() || line.variable >= (int)symbolCount))
+            reader->failed = true;
+    }
+    // ENDW goes back to its WHILE, which holds the count of its rounds
+    for (const templateLine& line : lines) {
+        if (!reader->failed && line.control == CONTROL_ENDW && lines[line.target].control != CONTROL_WHILE)
+            reader->failed = true;
+    }
+}
+
+// writeMacroCache - saves a compiled library, returns false if the cache file can't be written
+bool writeMacroCache(const filesystem::path& cacheFilepath, uint64_t sourceHash, const macroTable* macros, const macroLibraryState* state) {
+    string out(MACRO_CACHE_MAGIC, sizeof(MACRO_CACHE_MAGIC));
+    putNumber(&out, MACRO_CACHE_VERSION, 4);
+    putNumber(&out, sourceHash, 8);
+    putNumber(&out, state->labelSubstitutions, 4);
+    putNumber(&out, state->defineMacroLabelSubstitutions, 4);
+    putNumber(&out, state->diagnostics.size(), 4);
+    for (const diagnostic& record : state->diagnostics) {
+        putNumber(&out, record.code, 1);
+        putNumber(&out, record.line, 4);
+        putString(&out, record.macro);
+        putString(&out, record.message);
+    }
+
+    putNumber(&out, macros->definitions.size(), 4);
+    unordered_map<const macroDefinition*, uint32_t> indices;
+    for (const macroDefinition& definition : macros->definitions) {
+        putString(&out, definition.name);
+        putString(&out, definition.params);
+        putNumber(&out, definition.line, 4);
+        putNumber(&out, definition.endLine, 4);
+        putNumber(&out, definition.callees.size(), 4);
+        for (const macroDefinition* callee : definition.callees)
+            putNumber(&out, indices.at(callee), 4);
+        putTemplate(&out, &definition.body, &indices);
+        indices.emplace(&definition, (uint32_t)indices.size());
+    }
+
+    // Written next to the cache and renamed over it, so another run never sees half a cache
+    filesystem::path temporaryFilepath = cacheFilepath;
+    temporaryFilepath += ".tmp";
+    {
+        ofstream cacheFile(temporaryFilepath, ios::binary | ios::trunc);
+        if (!cacheFile.write(out.data(), out.length()))
+            return false;
+    }
+    error_code error;
+    filesystem::rename(temporaryFilepath, cacheFilepath, error);
+    return !error;
+}
+
+// readMacroCache - loads a compiled library into an empty table
+// Returns false if there is no cache, it is damaged or it was made from a different source, the table and state are left empty then.
+bool readMacroCache(const filesystem::path& cacheFilepath, uint64_t sourceHash, macroTable* macros, macroLibraryState* state) {
+    sourceBuffer cacheFile;
+    if (!openSourceFile(&cacheFile, cacheFilepath))
+        return false;
+
+    cacheReader reader = { cacheFile.data, cacheFile.data + cacheFile.size };
+    bool valid = cacheFile.size >= sizeof(MACRO_CACHE_MAGIC) && memcmp(cacheFile.data, MACRO_CACHE_MAGIC, sizeof(MACRO_CACHE_MAGIC)) == 0;
+    reader.position += valid ? sizeof(MACRO_CACHE_MAGIC) : 0;
+    valid = valid && getNumber(&reader, 4) == MACRO_CACHE_VERSION && getNumber(&reader, 8) == sourceHash;
+
+    if (valid) {
+        state->labelSubstitutions = getNumber(&reader, 4);
+        state->defineMacroLabelSubstitutions = getNumber(&reader, 4);
+        state->diagnostics.resize(getCount(&reader, 13));
+        for (diagnostic& record : state->diagnostics) {
+            record.severity = SEVERITY_WARNING;
+            record.code = (diagnosticCode)getNumber(&reader, 1);
+            record.line = getNumber(&reader, 4);
+            record.macro = getString(&reader);
+            record.message = getString(&reader);
+            if (record.code >= DIAGNOSTIC_CODES)
+                reader.failed = true;
+        }
+
+        uint64_t count = getCount(&reader, 12);
+        for (uint64_t i = 0; i < count && !reader.failed; i++) {
+            macroDefinition definition;
+            definition.name = getString(&reader);
+            definition.params = getString(&reader);
+            definition.line = getNumber(&reader, 4);
+            definition.endLine = getNumber(&reader, 4);
+            definition.callees.resize(getCount(&reader, 4));
+            for (const macroDefinition*& callee : definition.callees) {
+                uint64_t index = getNumber(&reader, 4);
+                if (index >= macros->definitions.size()) {
+                    reader.failed = true;
+                    break;
+                }
+                callee = &macros->definitions[index];
+            }
+            getTemplate(&reader, &definition.body, macros);
+            addMacro(macros, move(definition));
+        }
+        valid = !reader.failed && reader.position == reader.end;
+    }
+    closeSourceFile(&cacheFile);
+
+    if (!valid) {
+        *macros = macroTable();
+        *state = macroLibraryState();
+    }
+    return valid;
+}
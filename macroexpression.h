@@ -0,0 +1,406 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cctype>
+#include <climits>
+
+using namespace std;
+
+// Expressions of IF, WHILE and SET, evaluated while a macro is expanded.
+//
+// An expression is compiled once, when its macro is defined, into postfix order. Evaluating it is one walk
+// over the tokens with a small fixed stack, nothing is parsed again however often a loop runs.
+//
+// Values are whole numbers. A parameter or SET variable stands for the text it currently has, read as a
+// number, 0 if it isn't one; = and <> compare the text itself when one side isn't a number. A word that is
+// neither stands for itself, as does 'quoted text'. Comparisons, NOT, AND and OR give 1 or 0, 0 is false.
+// Dividing by 0 gives 0. Arithmetic wraps around at 64 bits, a number written in an expression has to fit in
+// them. From the loosest to the tightest:
+//
+//   OR   AND   NOT   = <> < <= > >= (or EQ NE LT LE GT GE)   + -   * / MOD   unary -   ( )
+
+const unsigned int MAX_EXPRESSION_DEPTH = 32;   // values an expression may need on its stack at once
+
+enum expressionKind {
+    EXPRESSION_NUMBER, EXPRESSION_SYMBOL, EXPRESSION_WORD,
+    EXPRESSION_NEGATE, EXPRESSION_NOT,
+    EXPRESSION_ADD, EXPRESSION_SUBTRACT, EXPRESSION_MULTIPLY, EXPRESSION_DIVIDE, EXPRESSION_MODULO,
+    EXPRESSION_EQUAL, EXPRESSION_NOT_EQUAL, EXPRESSION_LESS, EXPRESSION_LESS_EQUAL, EXPRESSION_GREATER, EXPRESSION_GREATER_EQUAL,
+    EXPRESSION_AND, EXPRESSION_OR
+};
+
+struct expressionToken {
+    expressionKind kind;
+    long long number = 0;   // EXPRESSION_NUMBER
+    int symbol = -1;        // EXPRESSION_SYMBOL: the parameter or variable, numbered like operand parameters
+    string text;            // EXPRESSION_NUMBER and EXPRESSION_WORD: the text as written
+};
+
+// macroExpression - a compiled expression, its tokens in postfix order
+struct macroExpression {
+    vector<expressionToken> tokens;
+};
+
+// expressionValue - a value on the evaluation stack, text is empty for computed numbers
+struct expressionValue {
+    long long number;
+    bool isNumber;
+    string_view text;
+};
+
+// expressionParser - the words of an expression, and where parsing is in them
+struct expressionParser {
+    vector<string> words;
+    size_t position = 0;
+    const vector<string>* symbols;   // parameters, then variables
+    macroExpression* expression;
+    unsigned int depth = 0;          // values on the stack at this point of the postfix order
+    unsigned int maxDepth = 0;
+    string error;
+};
+
+// Wrapping arithmetic on the values, done on unsigned numbers so going past the range is defined
+long long wrapAdd(long long left, long long right) {
+    return (long long)((unsigned long long)left + (unsigned long long)right);
+}
+
+long long wrapSubtract(long long left, long long right) {
+    return (long long)((unsigned long long)left - (unsigned long long)right);
+}
+
+long long wrapMultiply(long long left, long long right) {
+    return (long long)((unsigned long long)left * (unsigned long long)right);
+}
+
+long long wrapNegate(long long value) {
+    return (long long)(0ull - (unsigned long long)value);
+}
+
+// wrapDivide - left / right, or left MOD right; 0 if right is 0, and the smallest number over -1 wraps to itself
+long long wrapDivide(long long left, long long right, bool modulo) {
+    if (right == 0)
+        return 0;
+    if (right == -1)
+        return modulo ? 0 : wrapNegate(left);
+    return modulo ? left % right : left / right;
+}
+
+// splitExpressionWords - splits an expression into numbers, names, quoted text and operators
+bool splitExpressionWords(string_view text, vector<string>* words, string* error) {
+    size_t i = 0;
+    while (i < text.length()) {
+        char c = text[i];
+        size_t start = i;
+        if (isspace((unsigned char)c)) {
+            i++;
+            continue;
+        }
+        if (c == '\'') {
+            size_t end = text.find('\'', i + 1);
+            if (end == string_view::npos) {
+                *error = "quote not closed";
+                return false;
+            }
+            i = end + 1;
+        }
+        else if (isalnum((unsigned char)c) || c == '&' || c == '$' || c == '_' || c == '.') {
+            while (i < text.length() && (isalnum((unsigned char)text[i]) || text[i] == '&' || text[i] == '$' || text[i] == '_' || text[i] == '.'))
+                i++;
+        }
+        else if ((c == '<' && i + 1 < text.length() && (text[i + 1] == '=' || text[i + 1] == '>')) || (c == '>' && i + 1 < text.length() && text[i + 1] == '='))
+            i += 2;
+        else if (string_view("+-*/%()=<>").find(c) != string_view::npos)
+            i++;
+        else {
+            *error = string("unexpected ") + c;
+            return false;
+        }
+        words->push_back(string(text.substr(start, i - start)));
+    }
+    return true;
+}
+
+void emitToken(expressionParser* parser, expressionKind kind, int operands) {
+    expressionToken token;
+    token.kind = kind;
+    parser->expression->tokens.push_back(token);
+    parser->depth = parser->depth - operands + 1;
+}
+
+void pushValue(expressionParser* parser, expressionToken token) {
+    parser->expression->tokens.push_back(move(token));
+    parser->depth++;
+    parser->maxDepth = max(parser->maxDepth, parser->depth);
+}
+
+// nextWordIs - moves past the next word if it is one of the given ones, returns which (0 if none)
+int nextWordIs(expressionParser* parser, initializer_list<const char*> choices) {
+    if (parser->position >= parser->words.size())
+        return 0;
+    int choice = 1;
+    for (const char* word : choices) {
+        if (parser->words[parser->position] == word) {
+            parser->position++;
+            return choice;
+        }
+        choice++;
+    }
+    return 0;
+}
+
+bool parseOr(expressionParser* parser);
+
+bool parsePrimary(expressionParser* parser) {
+    if (parser->position >= parser->words.size()) {
+        parser->error = "value missing";
+        return false;
+    }
+    if (nextWordIs(parser, { "(" })) {
+        if (!parseOr(parser))
+            return false;
+        if (!nextWordIs(parser, { ")" })) {
+            parser->error = "')' missing";
+            return false;
+        }
+        return true;
+    }
+
+    const string& word = parser->words[parser->position++];
+    expressionToken token;
+    if (isdigit((unsigned char)word[0])) {
+        token.kind = EXPRESSION_NUMBER;
+        token.text = word;
+        for (char c : word) {
+            if (!isdigit((unsigned char)c)) {
+                parser->error = word + " is not a number";
+                return false;
+            }
+            if (token.number > (LLONG_MAX - (c - '0')) / 10) {
+                parser->error = word + " is too large";
+                return false;
+            }
+            token.number = token.number * 10 + (c - '0');
+        }
+    }
+    else if (word[0] == '\'') {
+        token.kind = EXPRESSION_WORD;
+        token.text = word.substr(1, word.length() - 2);
+    }
+    else if (isalnum((unsigned char)word[0]) || word[0] == '&' || word[0] == '$' || word[0] == '_' || word[0] == '.') {
+        token.kind = EXPRESSION_WORD;
+        token.text = word;
+        for (size_t k = 0; k < parser->symbols->size(); k++) {
+            if ((*parser->symbols)[k] == word) {
+                token.kind = EXPRESSION_SYMBOL;
+                token.symbol = k;
+                break;
+            }
+        }
+    }
+    else {
+        parser->error = "unexpected " + word;
+        return false;
+    }
+    pushValue(parser, move(token));
+    return true;
+}
+
+bool parseUnary(expressionParser* parser) {
+    int sign = nextWordIs(parser, { "-", "+" });
+    if (sign == 0)
+        return parsePrimary(parser);
+    if (!parseUnary(parser))
+        return false;
+    if (sign == 1)
+        emitToken(parser, EXPRESSION_NEGATE, 1);
+    return true;
+}
+
+bool parseProduct(expressionParser* parser) {
+    if (!parseUnary(parser))
+        return false;
+    const expressionKind kinds[] = { EXPRESSION_MULTIPLY, EXPRESSION_DIVIDE, EXPRESSION_MODULO, EXPRESSION_MODULO };
+    while (int choice = nextWordIs(parser, { "*", "/", "%", "MOD" })) {
+        if (!parseUnary(parser))
+            return false;
+        emitToken(parser, kinds[choice - 1], 2);
+    }
+    return true;
+}
+
+bool parseSum(expressionParser* parser) {
+    if (!parseProduct(parser))
+        return false;
+    while (int choice = nextWordIs(parser, { "+", "-" })) {
+        if (!parseProduct(parser))
+            return false;
+        emitToken(parser, choice == 1 ? EXPRESSION_ADD : EXPRESSION_SUBTRACT, 2);
+    }
+    return true;
+}
+
+bool parseComparison(expressionParser* parser) {
+    if (!parseSum(parser))
+        return false;
+    const expressionKind kinds[] = { EXPRESSION_EQUAL, EXPRESSION_NOT_EQUAL, EXPRESSION_LESS, EXPRESSION_LESS_EQUAL, EXPRESSION_GREATER, EXPRESSION_GREATER_EQUAL };
+    int choice = nextWordIs(parser, { "=", "<>", "<", "<=", ">", ">=", "EQ", "NE", "LT", "LE", "GT", "GE" });
+    if (choice == 0)
+        return true;
+    if (!parseSum(parser))
+        return false;
+    emitToken(parser, kinds[(choice - 1) % 6], 2);
+    return true;
+}
+
+bool parseNot(expressionParser* parser) {
+    if (!nextWordIs(parser, { "NOT" }))
+        return parseComparison(parser);
+    if (!parseNot(parser))
+        return false;
+    emitToken(parser, EXPRESSION_NOT, 1);
+    return true;
+}
+
+bool parseAnd(expressionParser* parser) {
+    if (!parseNot(parser))
+        return false;
+    while (nextWordIs(parser, { "AND" })) {
+        if (!parseNot(parser))
+            return false;
+        emitToken(parser, EXPRESSION_AND, 2);
+    }
+    return true;
+}
+
+bool parseOr(expressionParser* parser) {
+    if (!parseAnd(parser))
+        return false;
+    while (nextWordIs(parser, { "OR" })) {
+        if (!parseAnd(parser))
+            return false;
+        emitToken(parser, EXPRESSION_OR, 2);
+    }
+    return true;
+}
+
+// compileMacroExpression - compiles the text of an expression, symbols are the names of the parameters and variables
+// Returns false and says why in *error if the expression can't be compiled.
+bool compileMacroExpression(string_view text, const vector<string>* symbols, macroExpression* expression, string* error) {
+    expressionParser parser;
+    parser.symbols = symbols;
+    parser.expression = expression;
+    expression->tokens.clear();
+    if (!splitExpressionWords(text, &parser.words, error))
+        return false;
+    if (!parseOr(&parser)) {
+        *error = parser.error;
+        return false;
+    }
+    if (parser.position < parser.words.size()) {
+        *error = "unexpected " + parser.words[parser.position];
+        return false;
+    }
+    if (parser.maxDepth > MAX_EXPRESSION_DEPTH) {
+        *error = "expression too deeply nested";
+        return false;
+    }
+    return true;
+}
+
+// isValidExpression - checks that a postfix order read from outside, a cache, can be evaluated safely
+bool isValidExpression(const macroExpression* expression, size_t symbolCount) {
+    unsigned int depth = 0;
+    for (const expressionToken& token : expression->tokens) {
+        if (token.kind > EXPRESSION_OR)
+            return false;
+        if (token.kind <= EXPRESSION_WORD) {
+            if (token.kind == EXPRESSION_SYMBOL && (token.symbol < 0 || (size_t)token.symbol >= symbolCount))
+                return false;
+            if (++depth > MAX_EXPRESSION_DEPTH)
+                return false;
+        }
+        else if (token.kind <= EXPRESSION_NOT) {
+            if (depth < 1)
+                return false;
+        }
+        else if (depth-- < 2)
+            return false;
+    }
+    return depth == (expression->tokens.empty() ? 0 : 1);
+}
+
+// parseValue - reads the text of a parameter or variable as a number
+// Text with more digits than a number holds isn't one, the smallest number reads back from what SET wrote.
+expressionValue parseValue(string_view text) {
+    expressionValue value = { 0, false, text };
+    bool negative = !text.empty() && text[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i >= text.length())
+        return value;
+    unsigned long long limit = negative ? 0ull - (unsigned long long)LLONG_MIN : (unsigned long long)LLONG_MAX;
+    unsigned long long magnitude = 0;
+    for (; i < text.length(); i++) {
+        if (!isdigit((unsigned char)text[i]))
+            return value;
+        unsigned int digit = text[i] - '0';
+        if (magnitude > (limit - digit) / 10)
+            return value;
+        magnitude = magnitude * 10 + digit;
+    }
+    value.number = negative ? (long long)(0ull - magnitude) : (long long)magnitude;
+    value.isNumber = true;
+    return value;
+}
+
+// evaluateMacroExpression - evaluates a compiled expression, symbols holds the current text of every parameter and variable
+// The result's text is only set when the expression is a single value, so SET can copy text as it is.
+expressionValue evaluateMacroExpression(const macroExpression* expression, const string_view* symbols) {
+    expressionValue stack[MAX_EXPRESSION_DEPTH];
+    unsigned int top = 0;
+    for (const expressionToken& token : expression->tokens) {
+        switch (token.kind) {
+        case EXPRESSION_NUMBER:
+            stack[top++] = { token.number, true, token.text };
+            continue;
+        case EXPRESSION_SYMBOL:
+            stack[top++] = parseValue(symbols[token.symbol]);
+            continue;
+        case EXPRESSION_WORD:
+            stack[top++] = { 0, false, token.text };
+            continue;
+        case EXPRESSION_NEGATE:
+            stack[top - 1] = { wrapNegate(stack[top - 1].number), true, string_view() };
+            continue;
+        case EXPRESSION_NOT:
+            stack[top - 1] = { stack[top - 1].number == 0, true, string_view() };
+            continue;
+        default:
+            break;
+        }
+
+        const expressionValue& left = stack[top - 2];
+        const expressionValue& right = stack[top - 1];
+        bool compareText = !left.isNumber || !right.isNumber;
+        long long result = 0;
+        switch (token.kind) {
+        case EXPRESSION_ADD: result = wrapAdd(left.number, right.number); break;
+        case EXPRESSION_SUBTRACT: result = wrapSubtract(left.number, right.number); break;
+        case EXPRESSION_MULTIPLY: result = wrapMultiply(left.number, right.number); break;
+        case EXPRESSION_DIVIDE: result = wrapDivide(left.number, right.number, false); break;
+        case EXPRESSION_MODULO: result = wrapDivide(left.number, right.number, true); break;
+        case EXPRESSION_EQUAL: result = compareText ? left.text == right.text : left.number == right.number; break;
+        case EXPRESSION_NOT_EQUAL: result = compareText ? left.text != right.text : left.number != right.number; break;
+        case EXPRESSION_LESS: result = left.number < right.number; break;
+        case EXPRESSION_LESS_EQUAL: result = left.number <= right.number; break;
+        case EXPRESSION_GREATER: result = left.number > right.number; break;
+        case EXPRESSION_GREATER_EQUAL: result = left.number >= right.number; break;
+        case EXPRESSION_AND: result = left.number != 0 && right.number != 0; break;
+        case EXPRESSION_OR: result = left.number != 0 || right.number != 0; break;
+        default: break;
+        }
+        top--;
+        stack[top - 1] = { result, true, string_view() };
+    }
+    return top > 0 ? stack[0] : expressionValue{ 0, true, string_view() };
+}
@@ -0,0 +1,987 @@
+#pragma once
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include "./utils.h"
+#include "./lineparser.h"
+#include "./macrotable.h"
+#include "./expansionengine.h"
+#include "./sourcefile.h"
+#include "./outputsink.h"
+#include "./arena.h"
+#include "./macrocache.h"
+#include "./depmap.h"
+#include "./threadpool.h"
+#include "./assembler.h"
+#include "./diagnostics.h"
+#include "./macrousage.h"
+
+using namespace std;
+
+// The macro processor itself: reading sources, defining macros and expanding their calls.
+// main.cpp only handles the command line, the benchmarks in bench/ drive the same functions.
+
+// Messages that don't belong to a source file go here, to stderr when the output itself goes to stdout
+ostream* messageStream = &cout;
+
+#ifdef _DEBUG // Enable debug features
+const bool DEBUG_OUTPUT = true;
+void debugOutput(string stringToOutput) {
+    *messageStream << "DEBUG: " << stringToOutput << endl;
+}
+#else
+// Messages built for every call are only built when they are printed, the strings cost more than the expansion
+const bool DEBUG_OUTPUT = false;
+void debugOutput(string) {
+}
+#endif
+
+// expansionContext - everything that belongs to processing one source file
+// Files processed in parallel each have their own context, so nothing depends on which thread gets there first.
+struct expansionContext {
+    macroTable macros;                    // macros defined by the file itself
+    const macroTable* library = nullptr;  // macros of the prelude, shared between files and never changed
+
+    // Temporary, will replace with Beck's label substitution later
+    unsigned int labelSubstitutions = 0;
+    unsigned int defineMacroLabelSubstitutions = 0;
+
+    diagnosticLog diagnostics;            // warnings about the file, and where messages about it go
+
+    expansionMemo memo;                   // calls inside bodies flattened so far, see expansionengine.h
+    bool recursive = false;               // lines of an expansion that call a macro are expanded too
+    unsigned int maxDepth = DEFAULT_MAX_DEPTH;
+    unsigned int depth = 0;               // expansions the current one is nested in
+    bool depthExceeded = false;           // the current call went past maxDepth, nothing more of it is expanded
+    bool lazy = false;                    // bodies are compiled when they are first needed, see defineMacro
+    unique_ptr<sourceBuffer> source;      // a prelude's source, kept open for the bodies it has not compiled yet
+    macroUsage* usage = nullptr;          // counts the calls for --macro-usage, if set
+
+    // The upper cased label and parameters of the call being expanded, kept from call to call so they don't allocate
+    string labelScratch;
+    string parametersScratch;
+};
+
+// fileMessages - the stream for messages about the file that are no diagnostics, the diagnostics so far are written first
+ostream* fileMessages(expansionContext* context) {
+    flushDiagnostics(&context->diagnostics);
+    return context->diagnostics.out;
+}
+
+// lookupMacro - finds a macro in the prelude or the file, the prelude was defined first so it wins
+// If not found, will return a null macro with all empty fields
+const macroDefinition& lookupMacro(const expansionContext* context, string_view macroName) {
+    uint64_t start = startTimer();
+    const macroDefinition* found = context->library != nullptr ? lookupMacro(context->library, macroName) : nullptr;
+    if (found == nullptr)
+        found = &findMacro(&context->macros, macroName);
+    stopTimer(STAT_FIND_MACRO, start);
+    return *found;
+}
+
+// Planned lines processFileParallel hands to a thread at a time
+const size_t PARALLEL_CHUNK_LINES = 2048;
+
+// plannedLine - an output line worked out by the first, sequential phase of processFileParallel
+// Either a line that is written as it is, or a macro call whose local labels are already numbered.
+struct plannedLine {
+    lineFields fields;
+    const macroDefinition* macro = nullptr;
+    string label;
+    string parameters;
+    unsigned int labelBase = 0;
+    unsigned int lineNumber = 0;
+};
+
+bool loadPrelude(expansionContext* prelude, const filesystem::path& preludeFilepath, const filesystem::path& cacheFilepath);
+bool processFile(expansionContext* context, const filesystem::path& sourceFilepath, outputSink* destFile);
+void processStream(expansionContext* context, outputSink* destFile);
+void processSource(expansionContext* context, sourceBuffer* sourceFile, outputSink* destFile);
+bool processFileParallel(expansionContext* context, const filesystem::path& sourceFilepath, outputSink* destFile, unsigned int jobs);
+void processSourceParallel(expansionContext* context, sourceBuffer* sourceFile, outputSink* destFile, unsigned int jobs, size_t chunkLines = PARALLEL_CHUNK_LINES);
+bool processFileIncremental(expansionContext* context, const filesystem::path& sourceFilepath, const filesystem::path& destFilepath, size_t flushThreshold);
+bool planLines(expansionContext* context, sourceBuffer* sourceFile, unsigned int* lineNumber, vector<plannedLine>* plan, size_t maxLines);
+void processLine(expansionContext* context, string_view line, sourceBuffer* sourceFile, outputSink* destFile, unsigned int* lineNumber, vector<plannedLine>* plan = nullptr);
+void writeLine(outputSink* destFile, const lineFields* fields);
+macroDefinition defineMacro(expansionContext* context, sourceBuffer* sourceFile, unsigned int* lineNumber, string macroName, string macroParameters);
+void compileLazyMacro(const macroDefinition* macro);
+void expandMacro(expansionContext* context, outputSink* destFile, const macroDefinition* macroToExpand, string_view label, string_view parameters, unsigned int lineNumber);
+void warnLoopStopped(expansionContext* context, const macroDefinition* macro, unsigned int lineNumber);
+bool writeExpansion(outputSink* destFile, const macroDefinition* macroToExpand, string_view label, string_view parameters, unsigned int labelBase, unsigned int lineNumber, expansionMemo* memo = nullptr);
+bool writeBody(outputSink* destFile, const macroTemplate* body, pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch);
+bool writeDirectiveBody(outputSink* destFile, const macroTemplate* body, pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch);
+bool writeCalledBody(outputSink* destFile, const macroTemplate* caller, const templateCall* call, const pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch);
+void writeTemplateLine(outputSink* destFile, const macroTemplate* body, const lineTable* table, const templateLine* line, const pmr::vector<string_view>* replacements, unsigned int labelBase, string* scratch);
+void writeOperand(outputSink* destFile, const macroTemplate* body, const lineTable* table, const templateOperand* operand, const pmr::vector<string_view>* replacements, unsigned int labelBase, string* scratch);
+
+
+// loadPrelude - defines the macros of the prelude, from its cache if there is an up to date one
+// Without a cache file path, the prelude is always read from source. With prelude->lazy, the definitions read
+// from source are compiled when they are first called.
+bool loadPrelude(expansionContext* prelude, const filesystem::path& preludeFilepath, const filesystem::path& cacheFilepath) {
+    uint64_t sourceHash = 0;
+    macroLibraryState state;
+    prelude->diagnostics.out = messageStream;
+    prelude->diagnostics.file = preludeFilepath.string();
+    if (!cacheFilepath.empty()) {
+        sourceBuffer preludeFile;
+        if (!openSourceFile(&preludeFile, preludeFilepath))
+            return false;
+        sourceHash = hashSource(string_view(preludeFile.data, preludeFile.size));
+        closeSourceFile(&preludeFile);
+
+        if (readMacroCache(cacheFilepath, sourceHash, &prelude->macros, &state)) {
+            debugOutput("Prelude loaded from cache " + cacheFilepath.string());
+            prelude->labelSubstitutions = state.labelSubstitutions;
+            prelude->defineMacroLabelSubstitutions = state.defineMacroLabelSubstitutions;
+            reportDiagnostics(&prelude->diagnostics, &state.diagnostics);
+            finishDiagnostics(&prelude->diagnostics);
+            return true;
+        }
+    }
+
+    // The cache keeps the diagnostics as they were reported, the limits of the run that loads it apply to them
+    prelude->diagnostics.keepAll = !cacheFilepath.empty();
+    outputSink discarded;
+    openOutputDiscard(&discarded);
+    bool opened;
+    if (prelude->lazy) {
+        // The bodies not compiled yet are read from the source when they are, it stays open for the whole run
+        prelude->source = make_unique<sourceBuffer>();
+        opened = openSourceFile(prelude->source.get(), preludeFilepath);
+        if (opened)
+            processSource(prelude, prelude->source.get(), &discarded);
+    }
+    else
+        opened = processFile(prelude, preludeFilepath, &discarded);
+    finishDiagnostics(&prelude->diagnostics);
+    if (!opened)
+        return false;
+
+    if (!cacheFilepath.empty()) {
+        // The cache holds compiled bodies, a run that loads it has nothing left to compile
+        for (const macroDefinition& definition : prelude->macros.definitions)
+            compileLazyMacro(&definition);
+        state.labelSubstitutions = prelude->labelSubstitutions;
+        state.defineMacroLabelSubstitutions = prelude->defineMacroLabelSubstitutions;
+        state.diagnostics = move(prelude->diagnostics.all);
+        if (!writeMacroCache(cacheFilepath, sourceHash, &prelude->macros, &state))
+            *messageStream << "Warning - could not write prelude cache " << cacheFilepath << endl;
+    }
+    return true;
+}
+
+// processFile - macroassembles a whole source file, returns false if the file can't be opened
+bool processFile(expansionContext* context, const filesystem::path& sourceFilepath, outputSink* destFile) {
+    sourceBuffer sourceFile;
+    if (!openSourceFile(&sourceFile, sourceFilepath))
+        return false;
+
+    processSource(context, &sourceFile, destFile);
+
+    closeSourceFile(&sourceFile);
+    return true;
+}
+
+// processStream - macroassembles the source coming in on stdin
+// The input is read ahead on another thread, memory only grows with the macros defined, not with the input.
+void processStream(expansionContext* context, outputSink* destFile) {
+    sourceBuffer sourceFile;
+    openSourceStream(&sourceFile);
+
+    processSource(context, &sourceFile, destFile);
+
+    closeSourceFile(&sourceFile);
+}
+
+void processSource(expansionContext* context, sourceBuffer* sourceFile, outputSink* destFile) {
+    string_view lineOfCode;
+    unsigned int lineNumber = 1;
+
+    while(readLine(sourceFile, &lineOfCode)) {
+        processLine(context, lineOfCode, sourceFile, destFile, &lineNumber);
+        lineNumber++;
+    }
+}
+
+// processFileParallel - processFile that expands the macro calls of one file on several threads
+//
+// Phase 1 goes through the lines in order, like processFile, but only defines macros, prints warnings and
+// numbers the local labels of every call. Phase 2 writes the planned lines in chunks on all threads and the
+// chunks are stitched back together in order, so the output is the same as processFile's, byte for byte.
+// The phases take turns on blocks of lines, so memory doesn't grow with the size of the file.
+bool processFileParallel(expansionContext* context, const filesystem::path& sourceFilepath, outputSink* destFile, unsigned int jobs) {
+    sourceBuffer sourceFile;
+    if (!openSourceFile(&sourceFile, sourceFilepath))
+        return false;
+
+    processSourceParallel(context, &sourceFile, destFile, jobs);
+
+    closeSourceFile(&sourceFile);
+    return true;
+}
+
+// processSourceParallel - the two phases of processFileParallel, chunkLines planned lines to a task
+void processSourceParallel(expansionContext* context, sourceBuffer* sourceFile, outputSink* destFile, unsigned int jobs, size_t chunkLines) {
+    const size_t BLOCK_LINES = chunkLines * 4 * max(jobs, 1u);
+
+    unsigned int lineNumber = 1;
+    vector<plannedLine> plan;
+    bool moreLines = true;
+
+    while (moreLines) {
+        moreLines = planLines(context, sourceFile, &lineNumber, &plan, BLOCK_LINES);
+
+        size_t chunkCount = (plan.size() + chunkLines - 1) / chunkLines;
+        vector<outputSink> chunks(chunkCount);
+        vector<char> loopStopped(plan.size(), 0);
+        parallelFor(chunkCount, jobs, [&](size_t chunk) {
+            openOutputMemory(&chunks[chunk]);
+            expansionMemo memo;
+            size_t end = min(plan.size(), (chunk + 1) * chunkLines);
+            for (size_t i = chunk * chunkLines; i < end; i++) {
+                if (plan[i].macro != nullptr)
+                    loopStopped[i] = !writeExpansion(&chunks[chunk], plan[i].macro, plan[i].label, plan[i].parameters, plan[i].labelBase, plan[i].lineNumber, &memo);
+                else
+                    writeLine(&chunks[chunk], &plan[i].fields);
+            }
+        });
+        // The warnings of the workers come out in source order, once the block is written
+        for (size_t i = 0; i < plan.size(); i++) {
+            if (loopStopped[i])
+                warnLoopStopped(context, plan[i].macro, plan[i].lineNumber);
+        }
+        for (outputSink& chunk : chunks)
+            writeOutput(destFile, chunk.buffer);
+    }
+}
+
+// planLines - runs the first phase of processFileParallel on the next lines, until the plan has maxLines lines
+// Returns false once the whole source was planned.
+bool planLines(expansionContext* context, sourceBuffer* sourceFile, unsigned int* lineNumber, vector<plannedLine>* plan, size_t maxLines) {
+    string_view lineOfCode;
+    plan->clear();
+    while (plan->size() < maxLines) {
+        if (!readLine(sourceFile, &lineOfCode))
+            return false;
+        processLine(context, lineOfCode, sourceFile, nullptr, lineNumber, plan);
+        *lineNumber = *lineNumber + 1;
+    }
+    return true;
+}
+
+// callKey - what decides the text of an expansion, see depmap.h
+struct callKey {
+    uint64_t callHash;
+    uint64_t definitionHash;
+    unsigned int labelBase;
+
+    bool operator==(const callKey& other) const {
+        return callHash == other.callHash && definitionHash == other.definitionHash && labelBase == other.labelBase;
+    }
+};
+
+struct callKeyHash {
+    size_t operator()(const callKey& key) const {
+        return key.callHash ^ (key.definitionHash * 31) ^ key.labelBase;
+    }
+};
+
+// hashDefinition - hash of what decides the expansions of a definition, the macros it calls included
+uint64_t hashDefinition(const macroDefinition* macro, unordered_map<const macroDefinition*, uint64_t>* hashes) {
+    auto known = hashes->find(macro);
+    if (known != hashes->end())
+        return known->second;
+
+    // The compiled body decides the expansions, the calls in it are hashed by what they call
+    string text = macro->name + '\0' + macro->params + '\0';
+    unordered_map<const macroDefinition*, uint32_t> noIndices;
+    putTemplate(&text, &macro->body, &noIndices);
+    for (const templateCall& call : macro->body.calls)
+        text += '\0' + to_string(hashDefinition(call.macro, hashes)) + ' ' + to_string(call.labelName);
+    uint64_t hash = hashSource(text);
+    hashes->emplace(macro, hash);
+    return hash;
+}
+
+// processFileIncremental - processFile that reuses the expansions of the previous run
+//
+// Lines are planned like in processFileParallel. A call whose text, definition and label numbers are the same
+// as those of a call in the previous run is copied from the previous output, everything else is written anew.
+// The label numbers come from the plan, so they are always what a full run would give.
+// The previous output is only trusted if it is exactly what the previous run wrote.
+bool processFileIncremental(expansionContext* context, const filesystem::path& sourceFilepath, const filesystem::path& destFilepath, size_t flushThreshold) {
+    const size_t BLOCK_LINES = 65536;
+
+    sourceBuffer sourceFile;
+    if (!openSourceFile(&sourceFile, sourceFilepath)) {
+        *fileMessages(context) << "ERROR: Could not open " << sourceFilepath << endl;
+        return false;
+    }
+
+    filesystem::path mapFilepath = destFilepath;
+    mapFilepath += ".dep";
+    filesystem::path temporaryFilepath = destFilepath;
+    temporaryFilepath += ".tmp";
+
+    dependencyMap previousMap;
+    sourceBuffer previousOutput;
+    unordered_map<callKey, const expansionRecord*, callKeyHash> previousExpansions;
+    if (readDependencyMap(mapFilepath, &previousMap) && openSourceFile(&previousOutput, destFilepath)) {
+        string_view output(previousOutput.data, previousOutput.size);
+        if (hashSource(output) == previousMap.outputHash) {
+            for (const expansionRecord& record : previousMap.records) {
+                if (record.offset <= output.length() && record.length <= output.length() - record.offset)
+                    previousExpansions.emplace(callKey{ record.callHash, record.definitionHash, record.labelBase }, &record);
+            }
+        }
+    }
+
+    outputSink destFile;
+    destFile.flushThreshold = flushThreshold;
+    if (!openOutputFile(&destFile, temporaryFilepath)) {
+        *fileMessages(context) << "ERROR: Could not open " << temporaryFilepath << " for writing" << endl;
+        return false;
+    }
+
+    dependencyMap currentMap;
+    unordered_map<const macroDefinition*, uint64_t> definitionHashes;
+    unsigned int reused = 0;
+    unsigned int lineNumber = 1;
+    vector<plannedLine> plan;
+    bool moreLines = true;
+
+    while (moreLines) {
+        moreLines = planLines(context, &sourceFile, &lineNumber, &plan, BLOCK_LINES);
+        for (const plannedLine& line : plan) {
+            if (line.macro == nullptr) {
+                writeLine(&destFile, &line.fields);
+                continue;
+            }
+
+            expansionRecord record;
+            record.callHash = hashSource(line.label + '\0' + line.parameters);
+            record.definitionHash = hashDefinition(line.macro, &definitionHashes);
+            record.labelBase = line.labelBase;
+            record.lineNumber = line.lineNumber;
+            record.offset = outputPosition(&destFile);
+
+            auto previous = previousExpansions.find(callKey{ record.callHash, record.definitionHash, record.labelBase });
+            if (previous != previousExpansions.end()) {
+                writeOutput(&destFile, string_view(previousOutput.data + previous->second->offset, previous->second->length));
+                record.loopStopped = previous->second->loopStopped;
+                reused++;
+            }
+            else
+                record.loopStopped = !writeExpansion(&destFile, line.macro, line.label, line.parameters, line.labelBase, line.lineNumber, &context->memo);
+            if (record.loopStopped)
+                warnLoopStopped(context, line.macro, line.lineNumber);
+
+            record.length = outputPosition(&destFile) - record.offset;
+            currentMap.records.push_back(record);
+        }
+    }
+    closeSourceFile(&sourceFile);
+    closeSourceFile(&previousOutput);
+    debugOutput("Reused " + to_string(reused) + " of " + to_string(currentMap.records.size()) + " expansions");
+
+    if (!closeOutput(&destFile)) {
+        *fileMessages(context) << "ERROR: Could not write to " << temporaryFilepath << endl;
+        return false;
+    }
+
+    // The new output replaces the old one only once it is complete, then the map is written for it
+    sourceBuffer newOutput;
+    if (openSourceFile(&newOutput, temporaryFilepath))
+        currentMap.outputHash = hashSource(string_view(newOutput.data, newOutput.size));
+    closeSourceFile(&newOutput);
+
+    error_code error;
+    filesystem::rename(temporaryFilepath, destFilepath, error);
+    if (error) {
+        *fileMessages(context) << "ERROR: Could not write to " << destFilepath << endl;
+        return false;
+    }
+    if (!writeDependencyMap(mapFilepath, &currentMap))
+        *fileMessages(context) << "Warning - could not write the dependency map " << mapFilepath << endl;
+    return true;
+}
+
+// processLine - handles one line of the source file
+// With a plan, nothing is written: the line is added to the plan instead, see processFileParallel.
+void processLine(expansionContext* context, string_view line, sourceBuffer* sourceFile, outputSink* destFile, unsigned int* lineNumber, vector<plannedLine>* plan) {
+    // The fields are views into the source buffer, they get upper cased only where they are compared or written out
+    lineFields fields;
+    splitLineFields(line, &fields);
+
+    if (fields.label.empty() && fields.opcode.empty() && fields.params.empty()) {
+        //debugOutput("Line " + to_string(*lineNumber) + " is empty!");
+        return;
+    }
+    // A definition moves the line number on, the span is for the line it started at
+    uint64_t spanStart = startSpan();
+    unsigned int startLine = *lineNumber;
+
+    if (fields.label.length() > 6) {
+        string* message = &context->diagnostics.message;
+        message->assign("label ");
+        appendFolded(message, fields.label, false);
+        *message += " is over 6 characters long!";
+        reportDiagnostic(&context->diagnostics, DIAGNOSTIC_LONG_LABEL, *lineNumber, string_view(), *message);
+    }
+
+    string opcodeScratch;
+    string_view opcode = foldedView(fields.opcode, fields.opcodeInString, &opcodeScratch);
+
+    // Searches for a macro definition of the same name in the table
+    // If not found, will return a null macro with all empty fields
+    const macroDefinition& foundMacro = lookupMacro(context, opcode);
+    if (opcode == "MACRO") {
+        string label, parameters;
+        appendFolded(&label, fields.label, false);
+        appendFolded(&parameters, fields.params, fields.paramsInString);
+        addMacro(&context->macros, defineMacro(context, sourceFile, lineNumber, label, parameters));
+    }
+    else if (foundMacro.name == opcode) {
+        if (DEBUG_OUTPUT)
+            debugOutput("Line " + to_string(*lineNumber) + ": Found a " + foundMacro.name + " macro call, expanding...");
+        if (plan != nullptr) {
+            string label, parameters;
+            appendFolded(&label, fields.label, false);
+            appendFolded(&parameters, fields.params, fields.paramsInString);
+            compileLazyMacro(&foundMacro);
+            if (context->usage != nullptr)
+                countMacroUse(context->usage, &foundMacro);
+            plannedLine call;
+            call.macro = &foundMacro;
+            call.label = move(label);
+            call.parameters = move(parameters);
+            call.labelBase = context->labelSubstitutions;
+            call.lineNumber = *lineNumber;
+            context->labelSubstitutions += foundMacro.body.labelCount;
+            plan->push_back(move(call));
+        }
+        else {
+            string_view label = foldedView(fields.label, false, &context->labelScratch);
+            string_view parameters = foldedView(fields.params, fields.paramsInString, &context->parametersScratch);
+            expandMacro(context, destFile, &foundMacro, label, parameters, *lineNumber);
+        }
+    }
+    else {
+        if (!isCommand(opcode)) {
+            string* message = &context->diagnostics.message;
+            message->assign("unknown command ");
+            message->append(opcode);
+            reportDiagnostic(&context->diagnostics, DIAGNOSTIC_UNKNOWN_COMMAND, *lineNumber, string_view(), *message);
+        }
+        if (plan != nullptr) {
+            plannedLine passedLine;
+            passedLine.fields = fields;
+            passedLine.lineNumber = *lineNumber;
+            plan->push_back(move(passedLine));
+        }
+        else
+            writeLine(destFile, &fields);
+    }
+    endSpan(TRACE_PROCESS_LINE, spanStart, string_view(), startLine);
+}
+
+// writeLine - writes a line that is not a macro call, upper cased outside of strings and with the comment cut off
+void writeLine(outputSink* destFile, const lineFields* fields) {
+    writeOutputFolded(destFile, fields->label, false);
+    writeOutput(destFile, '\t');
+    writeOutputFolded(destFile, fields->opcode, fields->opcodeInString);
+    writeOutput(destFile, '\t');
+    writeOutputFolded(destFile, fields->params, fields->paramsInString);
+    writeOutput(destFile, '\n');
+}
+
+// bodyScan - what a lazy definition needs to know of its body before it is compiled
+struct bodyScan {
+    unsigned int labelCount = 0;   // the labelCount the compiled body will have
+    unsigned int labelNames = 0;   // the $tmN names its calls will take
+    bool directives = false;       // a line that could be a macro-time directive, the body is compiled right away
+};
+
+// readMacroBody - reads the lines of a body up to and with its MEND, into the code compileMacroTemplate takes
+// Without code the lines are only scanned, the local labels of the body are counted the way compileMacroTemplate
+// counts them. isCall tells the lines that call a macro, and the macro they call. *codeLines gets the source
+// line of every line of the code, blank and comment lines are left out of the code.
+void readMacroBody(sourceBuffer* sourceFile, unsigned int* lineNumber, const macroResolver* isCall, string* code, bodyScan* scan, vector<unsigned int>* codeLines = nullptr) {
+    string_view line;
+    lineFields fields;
+    string opcodeScratch;
+    string opcodeText;
+
+    // get first line, at the end of the file the line is empty just like getline leaves it
+    bool isEOF = false;
+    if (!readLine(sourceFile, &line)) {
+        isEOF = true;
+        line = string_view();
+    }
+    *lineNumber = *lineNumber + 1;
+
+    splitLineFields(line, &fields);
+
+    while (!opcodeIs(&fields, "MEND") && !isEOF) {
+        bool lineIsNotEmpty = (!fields.label.empty() || !fields.opcode.empty() || !fields.params.empty());
+        bool macroExpanded = false;
+        if (lineIsNotEmpty && code != nullptr && codeLines != nullptr)
+            codeLines->push_back(*lineNumber);
+        if (lineIsNotEmpty) {
+            opcodeText.assign(foldedView(fields.opcode, fields.opcodeInString, &opcodeScratch));
+            const macroDefinition* foundMacro = (*isCall)(opcodeText);
+            bool localLabel = isLocalLabel(fields.label);
+            // A call stays in the body as it is, compileMacroTemplate finds the macro it calls again
+            if (foundMacro != nullptr) {
+                if (code != nullptr) {
+                    appendFolded(code, fields.code, false);
+                    *code += "\n";
+                }
+                else {
+                    // A lazy body may be being compiled on another thread, what the scan of it found stays the same
+                    unsigned int calledLabels = foundMacro->lazy != nullptr ? foundMacro->lazy->labelCount : foundMacro->body.labelCount;
+                    scan->labelCount += calledLabels + (localLabel ? 1 : 0);
+                    scan->labelNames += calledLabels;
+                }
+                macroExpanded = true;
+            }
+            else if (code != nullptr) {
+                // the sanitized line, comment cut off and upper cased outside of strings
+                appendFolded(code, fields.code, false);
+            }
+            else {
+                scan->labelCount += localLabel ? 1 : 0;
+                scan->directives = scan->directives || controlDirective(opcodeText) != CONTROL_NONE;
+            }
+        }
+
+
+        if (!readLine(sourceFile, &line)) {
+            isEOF = true;
+            line = string_view();
+        }
+        *lineNumber = *lineNumber + 1;
+
+        splitLineFields(line, &fields);
+        if (code != nullptr && !opcodeIs(&fields, "MEND") && lineIsNotEmpty && !macroExpanded) *code += "\n";
+    }
+}
+
+macroDefinition defineMacro(expansionContext* context, sourceBuffer* sourceFile, unsigned int* lineNumber, string macroName, string macroParameters) {
+    uint64_t start = startTimer();
+    uint64_t spanStart = startSpan();
+    unsigned int startLine = *lineNumber;
+    macroDefinition newDefinition;
+    newDefinition.name = macroName;
+    newDefinition.params = macroParameters;
+    newDefinition.line = startLine;
+    string code;   // the body as text, only kept until it is compiled
+
+    if (isCommand(macroName)) reportDiagnostic(&context->diagnostics, DIAGNOSTIC_REPLACES_COMMAND, *lineNumber, macroName, macroName + " replaces a SIC/XE command!");
+    const macroDefinition& searchDefinedMacro = lookupMacro(context, macroName);
+    if (searchDefinedMacro.name == macroName) reportDiagnostic(&context->diagnostics, DIAGNOSTIC_ALREADY_DEFINED, *lineNumber, macroName, macroName + " is already defined!");
+
+    // Nothing gets defined inside a definition, so calls find the same macros now as they did line by line
+    macroResolver isCall = [context](const string& opcode) {
+        const macroDefinition& found = lookupMacro(context, opcode);
+        return found.name == opcode ? &found : nullptr;
+    };
+
+    // A lazy body is only scanned for its MEND and its local labels, the source it is in stays open while it
+    // can be called. A streamed source doesn't, and a body with directives is compiled now so its problems are
+    // reported where it is defined.
+    bool lazy = context->lazy && sourceFile->stream == nullptr;
+    size_t bodyStart = sourceFile->position;
+    bodyScan scan;
+    vector<unsigned int> codeLines;
+    readMacroBody(sourceFile, lineNumber, &isCall, lazy ? nullptr : &code, &scan, &codeLines);
+    newDefinition.endLine = *lineNumber;
+    string_view bodySource = lazy ? string_view(sourceFile->data + bodyStart, sourceFile->position - bodyStart) : string_view();
+
+    if (lazy && !scan.directives) {
+        newDefinition.lazy = make_shared<lazyBody>();
+        lazyBody* body = newDefinition.lazy.get();
+        body->source = bodySource;
+        body->firstLine = startLine;
+        body->labelName = context->defineMacroLabelSubstitutions;
+        body->library = context->library;
+        body->macros = &context->macros;
+        body->visible = context->macros.definitions.size();
+        body->labelCount = scan.labelCount;
+        context->defineMacroLabelSubstitutions += scan.labelNames;
+        if (DEBUG_OUTPUT)
+            debugOutput("Line " + to_string(*lineNumber) + ": Macro " + newDefinition.name + " defined, compiled when it is first called");
+
+        stopTimer(STAT_DEFINE_MACRO, start);
+        endSpan(TRACE_DEFINE_MACRO, spanStart, macroName, startLine);
+        return newDefinition;
+    }
+    if (lazy) {
+        sourceBuffer body;
+        body.data = bodySource.data();
+        body.size = bodySource.size();
+        unsigned int bodyLine = startLine;
+        readMacroBody(&body, &bodyLine, &isCall, &code, nullptr, &codeLines);
+    }
+
+    macroResolver resolve = [context, &isCall, &newDefinition](const string& opcode) {
+        const macroDefinition* found = isCall(opcode);
+        if (found != nullptr && found != &context->macros.nullMacro) {
+            compileLazyMacro(found);
+            newDefinition.callees.push_back(found);
+        }
+        return found;
+    };
+    // A problem is reported at the line it is on
+    vector<templateProblem> problems;
+    newDefinition.body = compileMacroTemplate(newDefinition.params, code, &resolve, &context->defineMacroLabelSubstitutions, &problems);
+    for (const templateProblem& problem : problems) {
+        unsigned int problemLine = problem.codeLine < codeLines.size() ? codeLines[problem.codeLine] : *lineNumber;
+        reportDiagnostic(&context->diagnostics, DIAGNOSTIC_DIRECTIVE, problemLine, macroName, macroName + ": " + problem.message);
+    }
+    if (newDefinition.params != "")
+        debugOutput("Line " + to_string(*lineNumber) + ": Macro " + newDefinition.name + " defined with parameters " + newDefinition.params + ", with the following code:\n" + code);
+    else
+        debugOutput("Line " + to_string(*lineNumber) + ": Macro " + newDefinition.name + " defined without parameters, with the following code:\n" + code);
+
+    stopTimer(STAT_DEFINE_MACRO, start);
+    endSpan(TRACE_DEFINE_MACRO, spanStart, macroName, startLine);
+    return newDefinition;
+}
+
+// compileLazyMacro - compiles the body of a lazy definition the first time it is needed, see defineMacro
+// The prelude's definitions are shared by the files processed in parallel, the first one to need a body
+// compiles it and the others wait for it. The body comes out the way it would have at MEND time: its lines
+// can only call the macros defined before it, and its calls take the $tmN names they would have taken then.
+void compileLazyMacro(const macroDefinition* macro) {
+    lazyBody* lazy = macro->lazy.get();
+    if (lazy == nullptr)
+        return;
+    call_once(lazy->once, [macro, lazy]() {
+        uint64_t start = startTimer();
+        uint64_t spanStart = startSpan();
+        macroResolver isCall = [lazy](const string& opcode) {
+            const macroDefinition* found = lazy->library != nullptr ? lookupMacro(lazy->library, opcode) : nullptr;
+            if (found == nullptr) {
+                found = lookupMacro(lazy->macros, opcode);
+                if (found != nullptr && found->order >= lazy->visible)
+                    found = nullptr;
+            }
+            // A line with only a label calls the null macro, like it does when nothing is found in processLine
+            if (found == nullptr && opcode == "")
+                found = &lazy->macros->nullMacro;
+            return found;
+        };
+
+        string code;
+        sourceBuffer body;
+        body.data = lazy->source.data();
+        body.size = lazy->source.size();
+        unsigned int lineNumber = lazy->firstLine;
+        readMacroBody(&body, &lineNumber, &isCall, &code, nullptr);
+
+        // Only this thread gets here, and nothing reads the body before it is compiled
+        macroDefinition* definition = const_cast<macroDefinition*>(macro);
+        macroResolver resolve = [lazy, &isCall, definition](const string& opcode) {
+            const macroDefinition* found = isCall(opcode);
+            if (found != nullptr && found != &lazy->macros->nullMacro) {
+                compileLazyMacro(found);
+                definition->callees.push_back(found);
+            }
+            return found;
+        };
+        unsigned int labelNames = lazy->labelName;
+        definition->body = compileMacroTemplate(definition->params, code, &resolve, &labelNames);
+        lazy->compiled = true;
+        if (DEBUG_OUTPUT)
+            debugOutput("Macro " + definition->name + " compiled on first use, with the following code:\n" + code);
+
+        stopTimer(STAT_DEFINE_MACRO, start);
+        endSpan(TRACE_DEFINE_MACRO, spanStart, definition->name, lazy->firstLine);
+    });
+}
+
+// writeRenamed - writes operand text, with the local labels it names renamed to lbN
+void writeRenamed(outputSink* destFile, string_view text, const labelReference* labels, size_t labelCount, unsigned int labelBase) {
+    size_t position = 0;
+    for (size_t i = 0; i < labelCount; i++) {
+        writeOutput(destFile, text.substr(position, labels[i].start - position));
+        writeOutput(destFile, "lb");
+        writeOutputNumber(destFile, labelBase + labels[i].localLabel);
+        position = labels[i].start + labels[i].length;
+    }
+    writeOutput(destFile, text.substr(position));
+}
+
+void warnLoopStopped(expansionContext* context, const macroDefinition* macro, unsigned int lineNumber) {
+    string* message = &context->diagnostics.message;
+    *message = "a WHILE loop in " + macro->name + " was stopped after " + to_string(MAX_LOOP_ITERATIONS) + " rounds";
+    reportDiagnostic(&context->diagnostics, DIAGNOSTIC_LOOP_STOPPED, lineNumber, macro->name, *message);
+}
+
+void expandMacro(expansionContext* context, outputSink* destFile, const macroDefinition* macroToExpand, string_view label, string_view parameters, unsigned int lineNumber) {
+    compileLazyMacro(macroToExpand);
+    if (context->usage != nullptr)
+        countMacroUse(context->usage, macroToExpand);
+    // Local labels get new names to avoid label conflicts when expanding macro two times or more
+    unsigned int labelBase = context->labelSubstitutions;
+    context->labelSubstitutions += macroToExpand->body.labelCount;
+
+    if (!context->recursive) {
+        if (!writeExpansion(destFile, macroToExpand, label, parameters, labelBase, lineNumber, &context->memo))
+            warnLoopStopped(context, macroToExpand, lineNumber);
+        return;
+    }
+
+    // The expansion is read back line by line, lines calling a macro are expanded in its place
+    if (context->depth == 0)
+        context->depthExceeded = false;
+    outputSink expansion;
+    openOutputMemory(&expansion);
+    if (!writeExpansion(&expansion, macroToExpand, label, parameters, labelBase, lineNumber, &context->memo))
+        warnLoopStopped(context, macroToExpand, lineNumber);
+
+    sourceBuffer expandedCode;
+    expandedCode.data = expansion.buffer.data();
+    expandedCode.size = expansion.buffer.size();
+    string_view line;
+    lineFields fields;
+    while (readLine(&expandedCode, &line)) {
+        splitLineFields(line, &fields);
+        const macroDefinition& foundMacro = lookupMacro(context, fields.opcode);
+        if (fields.opcode.empty() || foundMacro.name != fields.opcode) {
+            writeOutput(destFile, line);
+            writeOutput(destFile, '\n');
+            continue;
+        }
+
+        // One call too deep stops the whole expansion from going deeper, a macro calling itself twice would never end otherwise
+        if (context->depth + 1 >= context->maxDepth || context->depthExceeded) {
+            if (!context->depthExceeded) {
+                string* message = &context->diagnostics.message;
+                *message = "macro calls nested deeper than " + to_string(context->maxDepth) + " levels, " + foundMacro.name + " is not expanded";
+                reportDiagnostic(&context->diagnostics, DIAGNOSTIC_TOO_DEEP, lineNumber, foundMacro.name, *message);
+            }
+            context->depthExceeded = true;
+            writeOutput(destFile, line);
+            writeOutput(destFile, '\n');
+            continue;
+        }
+        context->depth++;
+        expandMacro(context, destFile, &foundMacro, fields.label, fields.params, lineNumber);
+        context->depth--;
+    }
+}
+
+// writeExpansion - writes the code of a macro call, its local labels are numbered from labelBase on
+// Only reads the macro, so calls can be written on several threads at once. lineNumber is the source line of
+// the call, for the trace.
+// Returns false if a WHILE loop of the macro was stopped after MAX_LOOP_ITERATIONS rounds.
+bool writeExpansion(outputSink* destFile, const macroDefinition* macroToExpand, string_view label, string_view passedParameters, unsigned int labelBase, unsigned int lineNumber, expansionMemo* memo) {
+    const macroTemplate* body = &macroToExpand->body;
+    expansionArena arena;
+    trimMemo(memo);
+    uint64_t start = startTimer();
+    uint64_t spanStart = startSpan();
+    size_t startPosition = outputPosition(destFile);
+
+    // Remove all spaces in the parameters strings
+    pmr::string parameters(&arena.memory);
+    parameters.reserve(passedParameters.length());
+    for (char c : passedParameters) {
+        if (!isspace((unsigned char)c))
+            parameters += c;
+    }
+
+    // Parameters to replace and what to replace them with, in the order of the macro's parameters
+    pmr::vector<string_view> replacements(&arena.memory);
+    bindParameters(body, parameters, &replacements);
+    string scratch;
+
+    if (DEBUG_OUTPUT && !replacements.empty()) {
+        debugOutput("Substitutions:");
+        for (unsigned int i = 0; i < replacements.size(); i++) {
+            debugOutput(body->parameters[i] + " will be replaced by " + string(replacements[i]));
+        }
+    }
+
+    // Output the code to destination file
+    //
+    // If the macro call string has a label, it should be preserved
+    if (label != "") {
+        writeOutput(destFile, label);
+        writeOutput(destFile, '\n');
+    }
+
+    // Add a comment marking the beginning of macro expansion to the assembler program code
+    writeOutput(destFile, "; ");
+    writeOutput(destFile, macroToExpand->name);
+    writeOutput(destFile, ' ');
+    writeOutput(destFile, parameters);
+    writeOutput(destFile, '\n');
+
+    bool complete = writeBody(destFile, body, &replacements, labelBase, memo, &scratch);
+
+    // Add a comment marking the end of macro expansion to the assembler program code
+    writeOutput(destFile, "; MEND\n");
+
+    size_t bytes = outputPosition(destFile) - startPosition;
+    stopTimer(STAT_EXPAND_MACRO, start, bytes);
+    countMacroCall(macroToExpand->name, bytes);
+    endSpan(TRACE_EXPAND_MACRO, spanStart, macroToExpand->name, bytes, lineNumber);
+    return complete;
+}
+
+// writeBody - writes the code lines of a body, filling in parameters and local labels
+// A call inside the body is flattened into lines of the body first.
+bool writeBody(outputSink* destFile, const macroTemplate* body, pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch) {
+    if (body->directives)
+        return writeDirectiveBody(destFile, body, replacements, labelBase, memo, scratch);
+
+    lineTable flattened;
+    for (const templateLine& line : body->code.lines) {
+        if (line.call < 0) {
+            writeTemplateLine(destFile, body, &body->code, &line, replacements, labelBase, scratch);
+            continue;
+        }
+        const lineTable* lines = flattenCall(body, &body->calls[line.call], memo, &flattened);
+        for (const templateLine& flattenedLine : lines->lines)
+            writeTemplateLine(destFile, body, lines, &flattenedLine, replacements, labelBase, scratch);
+    }
+    return true;
+}
+
+// writeDirectiveBody - writeBody for a body with directives, which runs them as it goes
+// The body's variables get slots behind the parameters' replacements and start out empty.
+bool writeDirectiveBody(outputSink* destFile, const macroTemplate* body, pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch) {
+    expansionArena arena;
+    size_t parameterCount = body->parameters.size();
+    replacements->resize(parameterCount + body->variables.size());
+    pmr::vector<pmr::string> values(body->variables.size(), &arena.memory);
+    pmr::vector<unsigned int> iterations(body->code.lines.size(), 0, &arena.memory);   // rounds of each WHILE so far
+    lineTable flattened;
+    char number[24];
+    bool complete = true;
+
+    size_t next = 0;
+    while (next < body->code.lines.size()) {
+        size_t index = next++;
+        const templateLine& line = body->code.lines[index];
+        switch (line.control) {
+        case CONTROL_SET: {
+            // A computed number is written out, a single value is copied as it is
+            expressionValue value = evaluateMacroExpression(&body->expressions[line.expression], replacements->data());
+            pmr::string& variable = values[line.variable - parameterCount];
+            if (value.isNumber && value.text.empty())
+                variable.assign(number, to_chars(number, number + sizeof(number), value.number).ptr - number);
+            else if (value.text.data() != variable.data())
+                variable.assign(value.text.data(), value.text.length());
+            (*replacements)[line.variable] = variable;
+            continue;
+        }
+        case CONTROL_IF:
+        case CONTROL_WHILE:
+            if (evaluateMacroExpression(&body->expressions[line.expression], replacements->data()).number == 0) {
+                next = line.target;
+                iterations[index] = 0;
+            }
+            continue;
+        case CONTROL_ELSE:
+            next = line.target;
+            continue;
+        case CONTROL_ENDW:
+            if (++iterations[line.target] < MAX_LOOP_ITERATIONS)
+                next = line.target;
+            else {
+                iterations[line.target] = 0;
+                complete = false;
+            }
+            continue;
+        case CONTROL_ENDIF:
+            continue;
+        }
+
+        if (line.call < 0) {
+            writeTemplateLine(destFile, body, &body->code, &line, replacements, labelBase, scratch);
+            continue;
+        }
+        const templateCall* call = &body->calls[line.call];
+        if (call->macro->body.directives) {
+            complete = writeCalledBody(destFile, body, call, replacements, labelBase, memo, scratch) && complete;
+            continue;
+        }
+        const lineTable* lines = flattenCall(body, call, memo, &flattened);
+        for (const templateLine& flattenedLine : lines->lines)
+            writeTemplateLine(destFile, body, lines, &flattenedLine, replacements, labelBase, scratch);
+    }
+    return complete;
+}
+
+// writeCalledBody - writes a call of a macro with directives in place, there is nothing to flatten ahead of time
+// The arguments are filled in from this expansion, the called macro's local labels keep their slots in the caller's.
+bool writeCalledBody(outputSink* destFile, const macroTemplate* caller, const templateCall* call, const pmr::vector<string_view>* replacements, unsigned int labelBase, expansionMemo* memo, string* scratch) {
+    outputSink arguments;
+    openOutputMemory(&arguments);
+    for (unsigned int k = 0; k < call->operandCount; k++) {
+        if (k > 0)
+            writeOutput(&arguments, ',');
+        writeOperand(&arguments, caller, &caller->code, &caller->code.operands[call->firstOperand + k], replacements, labelBase, scratch);
+    }
+
+    expansionArena arena;
+    pmr::vector<string_view> calledReplacements(&arena.memory);
+    bindParameters(&call->macro->body, arguments.buffer, &calledReplacements);
+    return writeBody(destFile, &call->macro->body, &calledReplacements, labelBase + call->firstLabel, memo, scratch);
+}
+
+// writeTemplateLine - writes one line of a macro body from the table it is in, filling in the replacements of its parameters and numbering its local labels
+void writeTemplateLine(outputSink* destFile, const macroTemplate* body, const lineTable* table, const templateLine* line, const pmr::vector<string_view>* replacements, unsigned int labelBase, string* scratch) {
+    if (line->localLabel >= 0) {
+        writeOutput(destFile, "lb");
+        writeOutputNumber(destFile, labelBase + line->localLabel);
+    }
+    else
+        writeOutput(destFile, symbolText(table, line->label));
+    writeOutput(destFile, '\t');
+    writeOutput(destFile, symbolText(table, line->opcode));
+
+    for (unsigned int j = 0; j < line->operandCount; j++) {
+        writeOutput(destFile, j == 0 ? '\t' : ',');
+        writeOperand(destFile, body, table, lineOperand(table, line, j), replacements, labelBase, scratch);
+    }
+    writeOutput(destFile, '\n');
+}
+
+// writeOperand - writes one operand of a macro body, its parameter replaced and its local labels numbered
+void writeOperand(outputSink* destFile, const macroTemplate* body, const lineTable* table, const templateOperand* operand, const pmr::vector<string_view>* replacements, unsigned int labelBase, string* scratch) {
+    if (operand->parameter < 0) {
+        if (operand->prefix != 0) writeOutput(destFile, operand->prefix);
+        writeRenamed(destFile, symbolText(table, operand->text), operandLabels(table, operand), operand->labelCount, labelBase);
+        return;
+    }
+
+    // The passed parameter can itself name local labels of the macro, the prefix is the operand's or else the parameter's
+    string_view replacement = (*replacements)[operand->parameter];
+    char prefix = operand->prefix;
+    if (prefix == 0 && hasOperandPrefix(replacement)) {
+        prefix = replacement[0];
+        replacement.remove_prefix(1);
+    }
+    if (prefix != 0) writeOutput(destFile, prefix);
+    size_t position = 0;
+    size_t written = 0;
+    labelReference found;
+    while (findNextLocalLabel(body, replacement, &position, &found, scratch)) {
+        writeOutput(destFile, replacement.substr(written, found.start - written));
+        writeOutput(destFile, "lb");
+        writeOutputNumber(destFile, labelBase + found.localLabel);
+        written = found.start + found.length;
+    }
+    writeOutput(destFile, replacement.substr(written));
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "./symbols.h"
+#include "./macrotemplate.h"
+
+using namespace std;
+
+struct macroTable;
+
+// lazyBody - where the body of a definition made with --lazy is, it is compiled the first time it is needed
+// The body stays text in the source, which is kept open as long as the definition can be called.
+struct lazyBody {
+    string_view source;                   // the lines of the body and its MEND line
+    unsigned int firstLine = 0;           // the line the body starts on
+    unsigned int labelCount = 0;          // the labelCount the compiled body will have
+    unsigned int labelName = 0;           // the first $tmN name its calls get, as if it was compiled at MEND time
+    const macroTable* library = nullptr;  // the macros its lines could call when it was defined
+    const macroTable* macros = nullptr;
+    size_t visible = 0;                   // definitions of macros made before it, the ones after can't be called from it
+    once_flag once;
+    bool compiled = false;
+};
+
+struct macroDefinition {
+    string name;
+    string params;
+    macroTemplate body; // the code, compiled at MEND time, with --lazy it stays empty until it is needed
+    shared_ptr<lazyBody> lazy;   // set if the body is compiled on first use, see compileLazyMacro
+    vector<const macroDefinition*> callees;   // every macro the body calls, the ones without code too, for --macro-usage
+    size_t order = 0;                // definitions made before it in its table
+    unsigned int line = 0;           // the MACRO line and the MEND line, for --prune-prelude
+    unsigned int endLine = 0;
+};
+
+// macroTable - all macros defined so far, indexed by their interned name
+struct macroTable {
+    symbolTable names;
+    vector<macroDefinition*> bySymbol;   // symbol id -> definition that lookups of that name return
+    deque<macroDefinition> definitions;  // every definition in the order it was made, addresses never change
+    macroDefinition nullMacro;           // returned when nothing is found, all fields empty
+};
+
+// lookupMacro - returns the definition of the macro with the given name, nullptr if there is none
+const macroDefinition* lookupMacro(const macroTable* table, string_view macroName) {
+    unsigned int id = findSymbol(&table->names, macroName);
+    if (id == NO_SYMBOL || id >= table->bySymbol.size())
+        return nullptr;
+    return table->bySymbol[id];
+}
+
+// findMacro - returns the definition of the macro with the given name
+// If not found, will return the table's null macro with all empty fields, so callers compare the name as they always did
+const macroDefinition& findMacro(const macroTable* table, string_view macroName) {
+    const macroDefinition* found = lookupMacro(table, macroName);
+    return found != nullptr ? *found : table->nullMacro;
+}
+
+// addMacro - stores a new definition and returns a reference to it
+// If a macro of the same name is already defined, the new definition is kept but the first one keeps winning lookups
+macroDefinition& addMacro(macroTable* table, macroDefinition definition) {
+    table->definitions.push_back(move(definition));
+    macroDefinition* stored = &table->definitions.back();
+    stored->order = table->definitions.size() - 1;
+
+    unsigned int id = internSymbol(&table->names, stored->name);
+    if (id >= table->bySymbol.size())
+        table->bySymbol.resize(id + 1, nullptr);
+    if (table->bySymbol[id] == nullptr)
+        table->bySymbol[id] = stored;
+
+    return *stored;
+}
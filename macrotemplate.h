@@ -0,0 +1,293 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory_resource>
+#include <algorithm>
+#include <functional>
+#include "./lineparser.h"
+#include "./macroexpression.h"
+
+using namespace std;
+
+// A macro body compiled once at MEND time, so expanding it is just filling in the slots.
+//
+// Every operand of every body line already knows which macro parameter it is (if any) and
+// which '$' local labels it names (if any), so nothing has to be split or compared again per call.
+//
+// The lines are kept in a lineTable, a handful of flat arrays instead of strings and vectors per line: a line
+// is a fixed size record whose label and opcode are symbols - ids of text stored once per table - and whose
+// operands are a run of the table's operands, which name a run of its local label references in turn.
+// Flattened calls (see expansionengine.h) are line tables of their own.
+
+// labelReference - a local label named in an operand, either the whole operand or a term of an expression like $LOOP+3
+struct labelReference {
+    unsigned int start;    // where the name is in the operand text
+    unsigned int length;
+    int localLabel;
+};
+
+struct templateOperand {
+    char prefix;              // '#' or '@' if the operand has one, otherwise 0
+    int parameter;            // index of the first macro parameter the operand matches, else the SET variable after them, -1 if none
+    unsigned int text;        // symbol of the operand without its prefix
+    unsigned int firstLabel;  // the local labels named in text are the table's labels from here on, in order
+    unsigned int labelCount;
+};
+
+// Macro-time directives, lines that steer the expansion instead of being written
+enum templateControl { CONTROL_NONE, CONTROL_IF, CONTROL_ELSE, CONTROL_ENDIF, CONTROL_WHILE, CONTROL_ENDW, CONTROL_SET };
+
+struct templateLine {
+    unsigned int label = 0;         // symbol of the label
+    unsigned int opcode = 0;        // symbol of the opcode
+    unsigned int firstOperand = 0;  // the operands are the table's operands from here on
+    unsigned int operandCount = 0;
+    int localLabel = -1;  // number of the local label this line defines, -1 if the label is not local
+    int call = -1;        // index into the body's calls if the line calls another macro, the other fields are unused then
+    int control = CONTROL_NONE;
+    int expression = -1;  // IF, WHILE and SET: index into the body's expressions
+    int target = -1;      // IF and WHILE: the line to go on with when false, ELSE: past ENDIF, ENDW: its WHILE
+    int variable = -1;    // SET: the variable set, numbered like operand parameters
+};
+
+// textSpan - where the text of a symbol is in its table's text
+struct textSpan {
+    unsigned int start;
+    unsigned int length;
+};
+
+// lineTable - lines of code, their operands and the local labels those name, all in flat arrays
+struct lineTable {
+    vector<templateLine> lines;
+    vector<templateOperand> operands;
+    vector<labelReference> labels;
+    string text;               // every distinct label, opcode and operand once
+    vector<textSpan> symbols;  // symbol -> its text
+};
+
+// tableBuilder - a line table being filled in, with a hash of the symbols it has so far so that no text is stored twice
+// The hash is open addressing over symbol ids, it compares the text in the table itself and never allocates per symbol.
+struct tableBuilder {
+    lineTable* table;
+    vector<unsigned int> slots;   // a symbol plus one, 0 for an empty slot
+};
+
+string_view symbolText(const lineTable* table, unsigned int symbol) {
+    return string_view(table->text).substr(table->symbols[symbol].start, table->symbols[symbol].length);
+}
+
+// findSymbolSlot - the slot that holds the symbol of some text, or the empty slot it would go into
+size_t findSymbolSlot(const tableBuilder* builder, string_view text) {
+    size_t mask = builder->slots.size() - 1;
+    size_t slot = hash<string_view>()(text) & mask;
+    while (builder->slots[slot] != 0 && symbolText(builder->table, builder->slots[slot] - 1) != text)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// addSymbol - the symbol of some text, added to the table the first time it comes up
+unsigned int addSymbol(tableBuilder* builder, string_view text) {
+    lineTable* table = builder->table;
+    // Kept at most half full, growing puts every symbol the table has into the new slots
+    if (builder->slots.size() < 2 * (table->symbols.size() + 1)) {
+        builder->slots.assign(max((size_t)16, builder->slots.size() * 2), 0);
+        for (unsigned int symbol = 0; symbol < table->symbols.size(); symbol++)
+            builder->slots[findSymbolSlot(builder, symbolText(table, symbol))] = symbol + 1;
+    }
+    size_t slot = findSymbolSlot(builder, text);
+    if (builder->slots[slot] == 0) {
+        builder->slots[slot] = table->symbols.size() + 1;
+        table->symbols.push_back({ (unsigned int)table->text.length(), (unsigned int)text.length() });
+        table->text.append(text);
+    }
+    return builder->slots[slot] - 1;
+}
+
+// finishTable - gives back what the arrays of a filled in table reserved but didn't use
+void finishTable(lineTable* table) {
+    table->lines.shrink_to_fit();
+    table->operands.shrink_to_fit();
+    table->labels.shrink_to_fit();
+    table->text.shrink_to_fit();
+    table->symbols.shrink_to_fit();
+}
+
+// lineOperand - the j-th operand of a line of the table
+const templateOperand* lineOperand(const lineTable* table, const templateLine* line, unsigned int j) {
+    return &table->operands[line->firstOperand + j];
+}
+
+const labelReference* operandLabels(const lineTable* table, const templateOperand* operand) {
+    return table->labels.data() + operand->firstLabel;
+}
+
+struct macroDefinition;
+
+// templateCall - a call of an earlier macro inside the body, see expansionengine.h
+struct templateCall {
+    const macroDefinition* macro;   // the definition the call found when the body was defined
+    vector<string> arguments;       // what each parameter of the called macro is replaced with, spaces removed
+    unsigned int labelName;         // the called macro's local labels are named $tmN from this N on
+    unsigned int firstLabel;        // number of the local label of this body the called macro's first local label is
+    unsigned int firstOperand = 0;  // the arguments as operands of the body's table, only for a called macro with directives
+    unsigned int operandCount = 0;
+};
+
+struct macroTemplate {
+    vector<string> parameters;         // names of the macro's parameters, spaces removed
+    unordered_map<string, int> localLabels;  // name -> number of the first line that defines it
+    unsigned int labelCount = 0;       // how many lines define a '$' label, the label counter moves this far per expansion
+    lineTable code;
+    vector<templateCall> calls;
+    vector<string> variables;          // names of the SET variables, their slots follow the parameters'
+    vector<macroExpression> expressions;
+    bool directives = false;           // the body, or a macro it calls, has macro-time directives
+};
+
+// splitParameters - removes all whitespace from a parameter list and splits it on commas
+// An empty list has no parameters. At most maxCount parameters are returned, the rest are ignored.
+vector<string> splitParameters(string parameters, size_t maxCount = string::npos) {
+    vector<string> result;
+    parameters.erase(remove_if(parameters.begin(), parameters.end(), [](unsigned char c) { return isspace(c) != 0; }), parameters.end());
+    if (parameters == "")
+        return result;
+
+    size_t lineSeek;
+    size_t seekEnd = -1;
+    do {
+        lineSeek = seekEnd + 1;
+        seekEnd = parameters.find(',', lineSeek);
+        result.push_back(parameters.substr(lineSeek, seekEnd - lineSeek));
+    } while (seekEnd != string::npos && result.size() < maxCount);
+    return result;
+}
+
+bool hasOperandPrefix(string_view operand) {
+    return !operand.empty() && (operand[0] == '#' || operand[0] == '@');
+}
+
+// operandBody - the operand without its '#' or '@' prefix, the part local labels are looked for in
+string_view operandBody(string_view operand) {
+    return hasOperandPrefix(operand) ? operand.substr(1) : operand;
+}
+
+bool isExpressionOperator(char c) {
+    return c == '+' || c == '-' || c == '*' || c == '/' || c == '(' || c == ')';
+}
+
+// findNextLocalLabel - finds the next term of an operand, from *position on, that names a local label of the macro
+// An operand without operators is a single term, and so is an operand that is a local label with operators in its
+// name. *position is moved past the term that was found.
+bool findNextLocalLabel(const macroTemplate* body, string_view text, size_t* position, labelReference* found, string* scratch) {
+    if (body->localLabels.empty())
+        return false;
+
+    size_t start = *position;
+    while (start < text.length()) {
+        size_t end = start;
+        while (end < text.length() && !isExpressionOperator(text[end]))
+            end++;
+        // Only a term starting with '$' can be a local label, the others don't need a lookup
+        if (start == 0 && end < text.length() && text[0] == '$') {
+            scratch->assign(text.data(), text.length());
+            auto label = body->localLabels.find(*scratch);
+            if (label != body->localLabels.end()) {
+                *found = { 0, (unsigned int)text.length(), label->second };
+                *position = text.length();
+                return true;
+            }
+        }
+        if (end > start && text[start] == '$') {
+            scratch->assign(text.data() + start, end - start);
+            auto label = body->localLabels.find(*scratch);
+            if (label != body->localLabels.end()) {
+                *found = { (unsigned int)start, (unsigned int)(end - start), label->second };
+                *position = end;
+                return true;
+            }
+        }
+        start = end + 1;
+    }
+    *position = text.length();
+    return false;
+}
+
+// findLocalLabels - appends every term of an operand that names a local label of the macro to *references
+// Returns how many were appended.
+unsigned int findLocalLabels(const macroTemplate* body, string_view text, vector<labelReference>* references, string* scratch) {
+    size_t count = references->size();
+    size_t position = 0;
+    labelReference found;
+    while (findNextLocalLabel(body, text, &position, &found, scratch))
+        references->push_back(found);
+    return references->size() - count;
+}
+
+// findOperandLabels - finds the local labels an operand of the table names, they are added to the table's labels
+void findOperandLabels(const macroTemplate* body, lineTable* table, templateOperand* operand, string* scratch) {
+    operand->firstLabel = table->labels.size();
+    operand->labelCount = findLocalLabels(body, symbolText(table, operand->text), &table->labels, scratch);
+}
+
+// compileTemplateOperand - separates an operand's prefix and finds the parameter it is
+templateOperand compileTemplateOperand(const macroTemplate* body, tableBuilder* builder, string_view operandText) {
+    templateOperand operand;
+    operand.prefix = hasOperandPrefix(operandText) ? operandText[0] : 0;
+    string_view text = operandText.substr(operand.prefix != 0 ? 1 : 0);
+    operand.text = addSymbol(builder, text);
+    operand.parameter = -1;
+    operand.firstLabel = 0;
+    operand.labelCount = 0;
+    for (unsigned int k = 0; k < body->parameters.size() && operand.parameter < 0; k++) {
+        if (text == body->parameters[k])
+            operand.parameter = k;
+    }
+    for (unsigned int k = 0; k < body->variables.size() && operand.parameter < 0; k++) {
+        if (text == body->variables[k])
+            operand.parameter = body->parameters.size() + k;
+    }
+    return operand;
+}
+
+// compileTemplateLine - splits one line of macro code into label, opcode and operands, and finds the parameter each operand is
+// The operands are added to the builder's table. The line's local label and the labels its operands name
+// are left to the caller, they depend on the other lines.
+void compileTemplateLine(const macroTemplate* body, tableBuilder* builder, const string& text, templateLine* line, string* lineParameters) {
+    string label, opcode;
+    splitLine(text, &label, &opcode, lineParameters);
+    *line = templateLine();
+    line->label = addSymbol(builder, label);
+    line->opcode = addSymbol(builder, opcode);
+    line->firstOperand = builder->table->operands.size();
+
+    for (string& operandText : splitParameters(*lineParameters))
+        builder->table->operands.push_back(compileTemplateOperand(body, builder, operandText));
+    line->operandCount = builder->table->operands.size() - line->firstOperand;
+}
+
+// bindParameters - works out what each macro parameter is replaced with for one call
+// The parameter list has its whitespace removed already, the replacements are views into it.
+// Replacements are applied in parameter order, so a replacement that is itself the name of a later
+// parameter gets replaced again - this is resolved here once instead of on every operand.
+// TODO: Error if less parameters were passed than intended by the macro definition.
+void bindParameters(const macroTemplate* body, string_view parameters, pmr::vector<string_view>* replacements) {
+    replacements->assign(body->parameters.size(), string_view());
+    size_t count = 0;
+    size_t start = 0;
+    while (!parameters.empty() && count < replacements->size()) {
+        size_t end = parameters.find(',', start);
+        (*replacements)[count++] = parameters.substr(start, end - start);
+        if (end == string_view::npos)
+            break;
+        start = end + 1;
+    }
+
+    for (unsigned int i = 0; i < replacements->size(); i++) {
+        for (unsigned int k = i + 1; k < replacements->size(); k++) {
+            if ((*replacements)[i] == body->parameters[k])
+                (*replacements)[i] = (*replacements)[k];
+        }
+    }
+}
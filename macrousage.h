@@ -0,0 +1,165 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "./macrotable.h"
+#include "./sourcefile.h"
+#include "./diagnostics.h"
+
+using namespace std;
+
+// How much the macros of the prelude and the files are used, for --macro-usage and --prune-prelude.
+//
+// Every file counts the calls it expands per definition, the prelude's own lines and --recursive calls
+// included. A macro is used if it is called, or if the body of a used macro calls it; a call in a body counts
+// even when the macro it calls has no code. Taking the definitions that are not used out of the prelude
+// doesn't change the expansion of anything, --prune-prelude writes the prelude without them. With --lazy the
+// unused definitions are the ones that never had to be compiled.
+
+// macroUse - what the report says about one definition
+struct macroUse {
+    string file;
+    string name;
+    unsigned int line = 0;
+    unsigned int endLine = 0;
+    uint64_t calls = 0;
+    bool used = false;
+    bool compiled = true;
+};
+
+// macroUsage - the calls of one file, by the definition they expanded
+// Files processed in parallel each count into their own, they are summed once every file is done.
+struct macroUsage {
+    unordered_map<const macroDefinition*, uint64_t> calls;
+    unordered_set<const macroDefinition*> used;   // filled in by finishUsage
+    vector<macroUse> fileMacros;                  // the file's own definitions, kept by finishUsage before they are gone
+};
+
+void countMacroUse(macroUsage* usage, const macroDefinition* macro) {
+    usage->calls[macro]++;
+}
+
+// markUsed - marks a definition used, and every definition its body calls
+void markUsed(const macroDefinition* macro, unordered_set<const macroDefinition*>* used) {
+    vector<const macroDefinition*> pending = { macro };
+    while (!pending.empty()) {
+        const macroDefinition* next = pending.back();
+        pending.pop_back();
+        if (!used->insert(next).second)
+            continue;
+        pending.insert(pending.end(), next->callees.begin(), next->callees.end());
+    }
+}
+
+// appendMacroUses - a macroUse for every definition of the table, the calls of the usages summed
+void appendMacroUses(const macroTable* table, const string& file, const vector<const macroUsage*>* usages, vector<macroUse>* uses) {
+    for (const macroDefinition& definition : table->definitions) {
+        macroUse use;
+        use.file = file;
+        use.name = definition.name;
+        use.line = definition.line;
+        use.endLine = definition.endLine;
+        use.compiled = definition.lazy == nullptr || definition.lazy->compiled;
+        for (const macroUsage* usage : *usages) {
+            auto found = usage->calls.find(&definition);
+            use.calls += found != usage->calls.end() ? found->second : 0;
+            use.used = use.used || usage->used.count(&definition) > 0;
+        }
+        uses->push_back(move(use));
+    }
+}
+
+// finishUsage - works out what a file used, call it while the file's macros are still there
+// The file's own definitions are kept as macroUses, only the library's stay in the counts.
+void finishUsage(macroUsage* usage, const macroTable* library, const macroTable* fileMacros, const string& file) {
+    for (const auto& call : usage->calls)
+        markUsed(call.first, &usage->used);
+    if (fileMacros == nullptr)
+        return;
+
+    vector<const macroUsage*> usages = { usage };
+    appendMacroUses(fileMacros, file, &usages, &usage->fileMacros);
+    unordered_map<const macroDefinition*, uint64_t> libraryCalls;
+    unordered_set<const macroDefinition*> libraryUsed;
+    if (library != nullptr) {
+        for (const macroDefinition& definition : library->definitions) {
+            auto found = usage->calls.find(&definition);
+            if (found != usage->calls.end())
+                libraryCalls.emplace(found->first, found->second);
+            if (usage->used.count(&definition) > 0)
+                libraryUsed.insert(&definition);
+        }
+    }
+    usage->calls = move(libraryCalls);
+    usage->used = move(libraryUsed);
+}
+
+// writeUsageJson - the macroUses as a JSON file, for --macro-usage
+void writeUsageJson(ostream* out, const vector<macroUse>* uses) {
+    uint64_t used = 0;
+    string json = "{\"macros\":[";
+    char number[24];
+    auto appendNumber = [&](uint64_t value) {
+        json.append(number, to_chars(number, number + sizeof(number), value).ptr - number);
+    };
+    for (size_t i = 0; i < uses->size(); i++) {
+        const macroUse& use = (*uses)[i];
+        json += i == 0 ? "\n{\"file\":" : ",\n{\"file\":";
+        appendJsonString(&json, use.file);
+        json += ",\"name\":";
+        appendJsonString(&json, use.name);
+        json += ",\"line\":";
+        appendNumber(use.line);
+        json += ",\"endLine\":";
+        appendNumber(use.endLine);
+        json += ",\"calls\":";
+        appendNumber(use.calls);
+        json += use.used ? ",\"used\":true" : ",\"used\":false";
+        json += use.compiled ? ",\"compiled\":true}" : ",\"compiled\":false}";
+        used += use.used ? 1 : 0;
+    }
+    out->write(json.data(), json.length());
+    *out << "\n],\"defined\":" << uses->size() << ",\"used\":" << used << ",\"unused\":" << uses->size() - used << '}' << endl;
+}
+
+// writePrunedSource - the source without the lines of the definitions in it that are not used
+// Every other line is copied as it is, line ends included.
+bool writePrunedSource(const filesystem::path& sourceFilepath, const filesystem::path& destFilepath, const vector<macroUse>* uses) {
+    sourceBuffer sourceFile;
+    if (!openSourceFile(&sourceFile, sourceFilepath))
+        return false;
+
+    vector<pair<unsigned int, unsigned int>> unused;
+    for (const macroUse& use : *uses) {
+        if (!use.used && use.file == sourceFilepath.string())
+            unused.push_back({ use.line, use.endLine });
+    }
+    sort(unused.begin(), unused.end());
+
+    string pruned;
+    string_view line;
+    size_t next = 0;
+    for (unsigned int lineNumber = 1; ; lineNumber++) {
+        size_t start = sourceFile.position;
+        if (!readLine(&sourceFile, &line))
+            break;
+        while (next < unused.size() && unused[next].second < lineNumber)
+            next++;
+        if (next < unused.size() && unused[next].first <= lineNumber)
+            continue;
+        pruned.append(sourceFile.data + start, sourceFile.position - start);
+    }
+    closeSourceFile(&sourceFile);
+
+    ofstream destFile(destFilepath, ios::binary | ios::trunc);
+    destFile.write(pruned.data(), pruned.length());
+    return (bool)destFile;
+}
@@ -1,570 +1,378 @@
 #include <iostream>
 #include <filesystem>
 #include <string>
-#include <fstream>
+#include <sstream>
 #include <vector>
-#include "./utils.h"
+#include <fstream>
+#include "./macroprocessor.h"
 
 using namespace std;
 
-#ifdef _DEBUG // Enable debug features
-void debugOutput(string stringToOutput) {
-    cout << "DEBUG: " << stringToOutput << endl;
-}
-#else
-void debugOutput(string stringToOutput) {
-}
-#endif
-
-struct macroDefinition {
-    string name;
-    string params;
-    string code;
-};
-
-void sanitizeString(string* line);
-macroDefinition findMacro(vector<macroDefinition>* macroDefArray, string macroName);
-void splitLine(string line, string* label, string* opcode, string* params);
-void processLine(vector<macroDefinition>* macroDefArray, string line, ifstream* sourceFile, ofstream* destFile, unsigned int* lineNumber);
-macroDefinition defineMacro(ifstream* sourceFile, vector<macroDefinition>* macroDefArray, unsigned int* lineNumber, string macroName, string macroParameters);
-void expandInsideDefinition(macroDefinition* macroDef, macroDefinition macroToExpand, string label, string parameters);
-void expandMacro(ofstream* destFile, macroDefinition macroToExpand, string label, string parameters);
-
-
-// Temporary, will replace with Beck's label substitution later
-unsigned int labelSubstitutions = 0;
-unsigned int defineMacroLabelSubstitutions = 0;
-
 int main(int argc, char *argv[])
 {
-    vector<macroDefinition> macroDefArray;
-
     std::filesystem::path sourceFilepath;
     std::filesystem::path destFilepath;
 
-    cout << "SIC/XE Macroassmbler" << endl;
+    // Options start with "--", everything else is a file path
+    // A source of "-" is read from stdin and a destination of "-" writes the output to stdout, so the tool can be used in a pipeline
+    vector<string> filepaths;
+    size_t flushThreshold = DEFAULT_FLUSH_THRESHOLD;
+    bool batchMode = false;
+    bool parallelMode = false;
+    bool incrementalMode = false;
+    bool objectMode = false;
+    bool recursiveMode = false;
+    unsigned int maxDepth = DEFAULT_MAX_DEPTH;
+    unsigned int jobs = defaultThreadCount();
+    string preludeFilepath;
+    string preludeCacheFilepath;
+    bool statsMode = false;
+    string statsJsonFilepath;
+    string traceFilepath;
+    string diagnosticsJsonFilepath;
+    bool lazyMode = false;
+    string usageFilepath;
+    string prunedPreludeFilepath;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if ((argument == "--flush-threshold" || argument == "--jobs" || argument == "--max-depth" || argument == "--diagnostic-limit") && i + 1 < argc) {
+            char* end;
+            unsigned long long number = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i]) {
+                cout << "ERROR: " << argument << " needs a number" << endl;
+                return 1;
+            }
+            if (argument == "--jobs") jobs = number;
+            else if (argument == "--max-depth") maxDepth = number;
+            else if (argument == "--diagnostic-limit") diagnosticOptions.limit = number;
+            else flushThreshold = number;
+        }
+        else if (argument == "--prelude" && i + 1 < argc)
+            preludeFilepath = argv[++i];
+        else if (argument == "--prelude-cache" && i + 1 < argc)
+            preludeCacheFilepath = argv[++i];
+        else if (argument == "--stats-json" && i + 1 < argc)
+            statsJsonFilepath = argv[++i];
+        else if (argument == "--trace" && i + 1 < argc)
+            traceFilepath = argv[++i];
+        else if (argument == "--diagnostics-json" && i + 1 < argc)
+            diagnosticsJsonFilepath = argv[++i];
+        else if (argument == "--macro-usage" && i + 1 < argc)
+            usageFilepath = argv[++i];
+        else if (argument == "--prune-prelude" && i + 1 < argc)
+            prunedPreludeFilepath = argv[++i];
+        else if (argument == "--werror")
+            diagnosticOptions.warningsAreErrors = true;
+        else if (argument == "--dedupe-diagnostics")
+            diagnosticOptions.deduplicate = true;
+        else if (argument == "--stats")
+            statsMode = true;
+        else if (argument == "--batch")
+            batchMode = true;
+        else if (argument == "--parallel")
+            parallelMode = true;
+        else if (argument == "--incremental")
+            incrementalMode = true;
+        else if (argument == "--object")
+            objectMode = true;
+        else if (argument == "--recursive")
+            recursiveMode = true;
+        else if (argument == "--lazy")
+            lazyMode = true;
+        else
+            filepaths.push_back(argument);
+    }
+
+    bool inputFromStdin = !batchMode && filepaths.size() >= 1 && filepaths[0] == "-";
+    bool outputToStdout = !batchMode && ((filepaths.size() >= 2 && filepaths[1] == "-") || (filepaths.size() == 1 && inputFromStdin));
+    if (outputToStdout)
+        messageStream = &cerr;
+
+    *messageStream << "SIC/XE Macroassmbler" << endl;
+
+    // Counting and tracing start before anything is read, so the prelude is counted too
+    statsEnabled = statsMode || statsJsonFilepath != "";
+    traceEnabled = traceFilepath != "";
+    traceStart = statClock();
+    diagnosticOptions.json = diagnosticsJsonFilepath != "";
+    // The finished diagnostics of the prelude and the files, errors among them fail the run
+    vector<const diagnosticLog*> diagnosticLogs;
+    // The calls of the prelude and the files, counted when usage is reported or the prelude pruned
+    bool countUsage = usageFilepath != "" || prunedPreludeFilepath != "";
+    macroUsage preludeUsage;
+    vector<const macroUsage*> usages = { &preludeUsage };
+    expansionContext prelude;
+    auto finishRun = [&](int status) {
+        for (const diagnosticLog* log : diagnosticLogs) {
+            if (log->errors > 0)
+                status = 1;
+        }
+        if (diagnosticsJsonFilepath != "") {
+            ofstream diagnosticsFile(diagnosticsJsonFilepath);
+            writeDiagnosticsJson(&diagnosticsFile, &diagnosticLogs);
+            if (!diagnosticsFile) {
+                *messageStream << "ERROR: Could not write to " << diagnosticsJsonFilepath << endl;
+                status = 1;
+            }
+        }
+        if (countUsage) {
+            vector<macroUse> uses;
+            appendMacroUses(&prelude.macros, preludeFilepath, &usages, &uses);
+            for (const macroUsage* usage : usages)
+                uses.insert(uses.end(), usage->fileMacros.begin(), usage->fileMacros.end());
+            if (usageFilepath != "") {
+                ofstream usageFile(usageFilepath);
+                writeUsageJson(&usageFile, &uses);
+                if (!usageFile) {
+                    *messageStream << "ERROR: Could not write to " << usageFilepath << endl;
+                    status = 1;
+                }
+            }
+            if (prunedPreludeFilepath != "" && !writePrunedSource(preludeFilepath, prunedPreludeFilepath, &uses)) {
+                *messageStream << "ERROR: Could not write to " << prunedPreludeFilepath << endl;
+                status = 1;
+            }
+        }
+        if (traceFilepath != "") {
+            ofstream traceFile(traceFilepath);
+            writeTraceJson(&traceFile);
+            if (!traceFile) {
+                *messageStream << "ERROR: Could not write to " << traceFilepath << endl;
+                status = 1;
+            }
+        }
+        if (statsMode)
+            writeStatsText(messageStream);
+        if (statsJsonFilepath != "") {
+            ofstream statsFile(statsJsonFilepath);
+            writeStatsJson(&statsFile);
+            if (!statsFile) {
+                *messageStream << "ERROR: Could not write to " << statsJsonFilepath << endl;
+                return 1;
+            }
+        }
+        return status;
+    };
 
     #ifdef _DEBUG
-    cout << "Debug build" << endl;
+    *messageStream << "Debug build" << endl;
     #endif
 
-    // TODO: sourceFilepath should never equal destFilepath!!!
-    if (argc < 2) {
+    if (filepaths.size() < 1) {
         cout << "Please provide path to source file!";
         return 1;
     }
 
-    if (argc == 2) {
-        sourceFilepath = argv[1];
-        destFilepath = sourceFilepath;
-        destFilepath.replace_extension(".asm");
-        cout << "No destination file specified, will output to: " << destFilepath << endl;
-    }
-    else {
-        sourceFilepath = argv[1];
-        destFilepath = argv[2];
-    }
-
-    if (sourceFilepath == destFilepath) {
-        cout << "ERROR: Destination file cannot be the same as the source file" << endl;
+    if (prunedPreludeFilepath != "" && preludeFilepath == "") {
+        *messageStream << "ERROR: --prune-prelude needs a --prelude" << endl;
         return 1;
     }
-    debugOutput("The source file is: " + sourceFilepath.string());
-    debugOutput("The destination file is: " + destFilepath.string());
-    debugOutput("Commencing macroassembly...");
-
-    ifstream sourceFile(sourceFilepath);
-    ofstream destFile(destFilepath);
-    string lineOfCode;
 
-    unsigned int lineNumber = 1;
-
-    while(getline(sourceFile, lineOfCode)) {
-        processLine(&macroDefArray, lineOfCode, &sourceFile, &destFile, &lineNumber);
-        lineNumber++;
-    }
-
-    sourceFile.close();
-
-    return 0;
-}
-
-// sanitizeString - Make all characters upper case except for strings and delete comments
-string sanitizeString(string line) {
-    bool insideString = false;
-    for (long unsigned int i = 0; i < line.length(); i++) {
-        if (line[i] == '\'') insideString = !insideString;
-        // since there can be a ";" symbol inside a SIC/XE string, also check for the comment symbol but only OUTSIDE a SIC/XE string
-        // if there is a ";" (comment symbol) outside of a SIC/XE string, delete it and all that comes after it
-        if (!insideString && line[i] == ';') {
-            line.erase(i, line.length());
-            break;
-        }
-        // else just make the character upper case so we can easily parse the file later on
-        else if (!insideString) line[i] = ::toupper(line[i]);
-    }
-    return line;
-}
-
-macroDefinition findMacro(vector<macroDefinition>* macroDefArray, string macroName) {
-    for (unsigned int i = 0; i < macroDefArray->size(); i++) {
-        if (macroDefArray->at(i).name == macroName)
-            return macroDefArray->at(i);
+    // The prelude is a library of macros shared by every source file, only its definitions are kept
+    prelude.lazy = lazyMode;
+    prelude.usage = countUsage ? &preludeUsage : nullptr;
+    if (preludeFilepath != "" && !loadPrelude(&prelude, preludeFilepath, preludeCacheFilepath)) {
+        *messageStream << "ERROR: Could not open prelude " << preludeFilepath << endl;
+        return 1;
     }
-    macroDefinition nullMacro; nullMacro.name = ""; nullMacro.code = ""; nullMacro.params = "";
-    return nullMacro;
-}
-
-// splitLine - delete comments and split the string into separate strings - label, opcode, parameters. Returns the values through pointers to strings passed into it.
-void splitLine(string line, string* label, string* opcode, string* params) {
-
-    line = sanitizeString(line);
-
-    size_t lineSeek = line.find_first_not_of("\t\n\v\f\r ");
-    size_t seekEnd; // the end of the current part of line (label, opcode, params)
-
-    *label = "";
-    *opcode = "";
-    *params = "";
-
-    if (lineSeek != string::npos) {
-        if (lineSeek == 0) {
-            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
-            *label = line.substr(lineSeek, seekEnd - lineSeek);
-            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
-        }
+    finishUsage(&preludeUsage, &prelude.macros, nullptr, "");
+    diagnosticLogs.push_back(&prelude.diagnostics);
+
+    // Every file starts where the prelude left off, as if the prelude was pasted in front of it
+    auto newContext = [&](expansionContext* context) {
+        context->library = &prelude.macros;
+        context->labelSubstitutions = prelude.labelSubstitutions;
+        context->defineMacroLabelSubstitutions = prelude.defineMacroLabelSubstitutions;
+        context->recursive = recursiveMode;
+        context->maxDepth = maxDepth;
+        context->lazy = lazyMode;
+    };
 
-        // the line can have only a label and nothing else, check if it's not the case
-        if (lineSeek != string::npos) {
-            seekEnd = line.find_first_of("\t\n\v\f\r ", lineSeek);
-            *opcode = line.substr(lineSeek, seekEnd - lineSeek);
+    if (batchMode) {
+        // Every source goes to a .asm file next to it, the files are processed in parallel
+        // Messages are collected per file and printed in the order the files were given
+        vector<ostringstream> messages(filepaths.size());
+        vector<diagnosticLog> logs(filepaths.size());
+        vector<char> failed(filepaths.size(), false);
+        vector<macroUsage> fileUsages(filepaths.size());
+        parallelFor(filepaths.size(), jobs, [&](size_t i) {
+            expansionContext context;
+            newContext(&context);
+            context.usage = countUsage ? &fileUsages[i] : nullptr;
+            context.diagnostics.out = &messages[i];
+            context.diagnostics.file = filepaths[i];
+
+            filesystem::path batchDestFilepath = filepaths[i];
+            batchDestFilepath.replace_extension(objectMode ? ".obj" : ".asm");
+            if (batchDestFilepath == filesystem::path(filepaths[i])) {
+                messages[i] << "ERROR: Destination file cannot be the same as the source file" << endl;
+                failed[i] = true;
+                return;
+            }
 
-            lineSeek = line.find_first_not_of("\t\n\v\f\r ", seekEnd);
-            // the line can have no params, check if it's not the case
-            if (lineSeek != string::npos) {
-                *params = line.substr(lineSeek, line.length() - lineSeek);
+            outputSink batchDestFile;
+            batchDestFile.flushThreshold = flushThreshold;
+            if (!objectMode && !openOutputFile(&batchDestFile, batchDestFilepath)) {
+                messages[i] << "ERROR: Could not open " << batchDestFilepath << " for writing" << endl;
+                failed[i] = true;
+                return;
             }
+            outputSink expandedCode;
+            openOutputMemory(&expandedCode);
+            string objectProgram;
+            if (!processFile(&context, filepaths[i], objectMode ? &expandedCode : &batchDestFile)) {
+                messages[i] << "ERROR: Could not open " << filepaths[i] << endl;
+                failed[i] = true;
+            }
+            else if (objectMode && !assembleProgram(expandedCode.buffer, &objectProgram, fileMessages(&context)))
+                failed[i] = true;
+            if (objectMode && !failed[i]) {
+                if (openOutputFile(&batchDestFile, batchDestFilepath))
+                    writeOutput(&batchDestFile, objectProgram);
+                else {
+                    messages[i] << "ERROR: Could not open " << batchDestFilepath << " for writing" << endl;
+                    failed[i] = true;
+                }
+            }
+            else if (objectMode) {
+                // No object file is left behind for a program that didn't assemble, not even the one of an earlier run
+                error_code error;
+                filesystem::remove(batchDestFilepath, error);
+                openOutputDiscard(&batchDestFile);
+            }
+            if (!closeOutput(&batchDestFile)) {
+                *fileMessages(&context) << "ERROR: Could not write to " << batchDestFilepath << endl;
+                failed[i] = true;
+            }
+            finishDiagnostics(&context.diagnostics);
+            logs[i] = move(context.diagnostics);
+            finishUsage(&fileUsages[i], &prelude.macros, &context.macros, filepaths[i]);
+        });
+
+        bool anyFailed = false;
+        for (size_t i = 0; i < filepaths.size(); i++) {
+            string fileMessages = messages[i].str();
+            if (fileMessages != "")
+                cout << filepaths[i] << ":" << endl << fileMessages;
+            anyFailed = anyFailed || failed[i];
+            diagnosticLogs.push_back(&logs[i]);
+            usages.push_back(&fileUsages[i]);
         }
-    }
-}
-
-void processLine(vector<macroDefinition>* macroDefArray, string line, ifstream* sourceFile, ofstream* destFile, unsigned int* lineNumber) {
-    string label = "";
-    string opcode = "";
-    string parameters = "";
-
-    splitLine(line, &label, &opcode, &parameters);
-
-    if (label == "" && opcode == "" && parameters == "") {
-        //debugOutput("Line " + to_string(*lineNumber) + " is empty!");
-        return;
-    }
-    else {
-        //debugOutput("Line " + to_string(*lineNumber) + " has label: " + label + ", opcode: " + opcode + ", params: " + parameters);
+        return finishRun(anyFailed ? 1 : 0);
     }
 
-    if (label.length() > 6) cout << "Line " << *lineNumber << ": Warning - label " << label << " is over 6 characters long!" << endl;
-
-    // Searches for a macro definition of the same name in the vector
-    // If not found, will return a null macro with all empty fields
-    macroDefinition foundMacro = findMacro(macroDefArray, opcode);
-    if (opcode == "MACRO") {
-        macroDefinition newDefinition = defineMacro(sourceFile, macroDefArray, lineNumber, label, parameters);
-        macroDefArray->push_back(newDefinition);
-        if (newDefinition.params != "")
-            debugOutput("Line " + to_string(*lineNumber) + ": Macro " + newDefinition.name + " defined with parameters " + newDefinition.params + ", with the following code:\n" + newDefinition.code);
-        else
-            debugOutput("Line " + to_string(*lineNumber) + ": Macro " + newDefinition.name + " defined without parameters, with the following code:\n" + newDefinition.code);
-    }
-    else if (foundMacro.name == opcode) {
-        debugOutput("Line " + to_string(*lineNumber) + ": Found a " + opcode + " macro call, expanding...");
-        expandMacro(destFile, foundMacro, label, parameters);
+    // TODO: sourceFilepath should never equal destFilepath!!!
+    if (filepaths.size() == 1 && inputFromStdin) {
+        sourceFilepath = "-";
+        destFilepath = "-";
     }
-    else if (isCommand(opcode)) {
-        *destFile << label << "\t" << opcode << "\t" << parameters << endl;
+    else if (filepaths.size() == 1) {
+        sourceFilepath = filepaths[0];
+        destFilepath = sourceFilepath;
+        destFilepath.replace_extension(objectMode ? ".obj" : ".asm");
+        cout << "No destination file specified, will output to: " << destFilepath << endl;
     }
     else {
-        cout << "Line " << *lineNumber << ": Warning - unknown command " << opcode << endl;
-        *destFile << label << "\t" << opcode << "\t" << parameters << endl;
+        sourceFilepath = filepaths[0];
+        destFilepath = filepaths[1];
     }
-}
-
-macroDefinition defineMacro(ifstream* sourceFile, vector<macroDefinition>* macroDefArray, unsigned int* lineNumber, string macroName, string macroParameters) {
-    macroDefinition newDefinition;
-    newDefinition.name = macroName;
-    newDefinition.params = macroParameters;
-
-    if (isCommand(macroName)) cout << "Line " << *lineNumber << ": Warning - " << macroName << " replaces a SIC/XE command!" << endl;
-    macroDefinition searchDefinedMacro = findMacro(macroDefArray, macroName);
-    if (searchDefinedMacro.name == macroName) cout << "Line " << *lineNumber << ": Warning - " << macroName << " is already defined!" << endl;
 
-    string line;
-
-    string label = "";
-    string opcode = "";
-    string params = "";
-
-    // get first line
-    bool isEOF = false;
-    if (!getline(*sourceFile, line))
-        isEOF = true;
-    *lineNumber = *lineNumber + 1;
-
-    splitLine(line, &label, &opcode, &params);
-
-    while (opcode != "MEND" && !isEOF) {
-        line = sanitizeString(line);
-        bool lineIsNotEmpty = (label != "" || opcode != "" || params != "");
-        bool macroExpanded = false;
-        //debugOutput(label + " " + opcode + " " + params);
-        if (lineIsNotEmpty) {
-            macroDefinition foundMacro = findMacro(macroDefArray, opcode);
-            if (foundMacro.name == opcode) {
-                expandInsideDefinition(&newDefinition, foundMacro, label, params);
-                macroExpanded = true;
-            }
-            else {
-                newDefinition.code += line;
-            }
-        }
-
-
-        if (!getline(*sourceFile, line)) isEOF = true;
-        *lineNumber = *lineNumber + 1;
-
-        splitLine(line, &label, &opcode, &params);
-        if (opcode != "MEND" && lineIsNotEmpty && !macroExpanded) newDefinition.code += "\n";
+    if (sourceFilepath == destFilepath && !inputFromStdin) {
+        *messageStream << "ERROR: Destination file cannot be the same as the source file" << endl;
+        return 1;
     }
+    debugOutput("The source file is: " + sourceFilepath.string());
+    debugOutput("The destination file is: " + destFilepath.string());
+    debugOutput("Commencing macroassembly...");
 
-    return newDefinition;
-}
-
-
-void expandInsideDefinition(macroDefinition* macroDef, macroDefinition macroToExpand, string label, string parameters) {
-    struct substitution {
-        string match;
-        string replacement;
-    };
-
-    struct lineOfCode {
-        string label;
-        string opcode;
-        vector<string> parameters;
+    expansionContext context;
+    newContext(&context);
+    context.diagnostics.out = messageStream;
+    context.diagnostics.file = sourceFilepath.string();
+    diagnosticLogs.push_back(&context.diagnostics);
+    macroUsage fileUsage;
+    context.usage = countUsage ? &fileUsage : nullptr;
+    usages.push_back(&fileUsage);
+    auto finishFile = [&](int status) {
+        finishDiagnostics(&context.diagnostics);
+        finishUsage(&fileUsage, &prelude.macros, &context.macros, sourceFilepath.string());
+        return finishRun(status);
     };
 
-    // Step 1, turn the code of the macro into a vector of lines
-    vector<lineOfCode> codeToExpand;
-    size_t lineSeek = 0;
-    size_t seekEnd;
-
-    // A paranoid check if the macro has any code
-    if (macroToExpand.code != "") {
-        // Process each line, putting it into a vector of code lines (makes it easier to substitute labels later)
-        while (seekEnd != string::npos) {
-            seekEnd = macroToExpand.code.find_first_of("\n", lineSeek);
-            string currentLine = macroToExpand.code.substr(lineSeek, seekEnd - lineSeek);
-
-            string currentLineLabel, currentLineOpcode, currentLineParameters;
-            splitLine(currentLine, &currentLineLabel, &currentLineOpcode, &currentLineParameters);
-
-            lineOfCode currentLineOfCode;
-            currentLineOfCode.label = currentLineLabel;
-            currentLineOfCode.opcode = currentLineOpcode;
-
-            vector<string> tempParameterVector;
-            if (currentLineParameters != "") {
-                // Remove all spaces in the parameters strings
-                currentLineParameters.erase(remove_if(currentLineParameters.begin(), currentLineParameters.end(), ::isspace), currentLineParameters.end());
-                string delimiter = ",";
-                size_t paramLineSeek;
-                size_t paramSeekEnd = -1;
-                do {
-                    paramLineSeek = paramSeekEnd + 1;
-                    paramSeekEnd = currentLineParameters.find(delimiter, paramLineSeek);
-                    string tempParameter = currentLineParameters.substr(paramLineSeek, paramSeekEnd - paramLineSeek);
-                    tempParameterVector.push_back(tempParameter);
-                } while (paramSeekEnd != string::npos);
-            }
-            lineSeek = seekEnd + 1;
-            currentLineOfCode.parameters = tempParameterVector;
-            codeToExpand.push_back(currentLineOfCode);
-        }
+    // Both need the whole source at hand, a streamed source only holds a few lines at a time
+    if (inputFromStdin && (incrementalMode || parallelMode)) {
+        *messageStream << "ERROR: --incremental and --parallel need a source file, not stdin" << endl;
+        return 1;
     }
-
-
-    // Step 2, take macro parameters and substitute them
-    //
-    // Remove all spaces in the parameters strings
-    macroToExpand.params.erase(remove_if(macroToExpand.params.begin(), macroToExpand.params.end(), ::isspace), macroToExpand.params.end());
-    parameters.erase(remove_if(parameters.begin(), parameters.end(), ::isspace), parameters.end());
-
-    // Create a vector that stores substitutions
-    // Parameters to replace (match) and what to replace them with (replacement)
-    vector<substitution> substitutionVector;
-
-    // If the macro has any parameters, add them to the substitutionVector
-    if (macroToExpand.params != "") {
-        // Parameters are separated by commas, spaces were trimmed
-        string delimiter = ",";
-        size_t lineSeek;
-        size_t seekEnd = -1;
-        // Parse the parameters of the macro itself
-        do {
-            lineSeek = seekEnd + 1;
-            seekEnd = macroToExpand.params.find(delimiter, lineSeek);
-            string macroParameter = macroToExpand.params.substr(lineSeek, seekEnd - lineSeek);
-            substitution tempSubstitution;
-            tempSubstitution.match = macroParameter; tempSubstitution.replacement = "";
-            substitutionVector.push_back(tempSubstitution);
-        } while (seekEnd != string::npos);
-
-        // Parse the passed parameters
-        // TODO: Error if less parameters were passed than intended by the macro definition.
-        seekEnd = -1;
-        unsigned int i = -1;
-        do {
-            i++;
-            lineSeek = seekEnd + 1;
-            seekEnd = parameters.find(delimiter, lineSeek);
-            string parameter = parameters.substr(lineSeek, seekEnd - lineSeek);
-            substitutionVector[i].replacement = parameter;
-        } while (seekEnd != string::npos && i < substitutionVector.size());
-
-        debugOutput("Substitutions:");
-        for (unsigned int i = 0; i < substitutionVector.size(); i++) {
-            debugOutput(substitutionVector.at(i).match + " will be replaced by " + substitutionVector.at(i).replacement);
-        }
-
-        // Go through the parameters in the code and substitute them
-        for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-            for (unsigned int j = 0; j < codeToExpand.at(i).parameters.size(); j++) {
-                // Prefixes would make it difficult to compare strings so we'll store the prefix in a string
-                // and remove it from the parameter string, adding it back later
-                string prefix = "";
-                if (codeToExpand.at(i).parameters.at(j)[0] == '#' || codeToExpand.at(i).parameters.at(j)[0] == '@') {
-                        prefix = codeToExpand.at(i).parameters.at(j)[0];
-                        codeToExpand.at(i).parameters.at(j).erase(0, 1);
-                }
-                // Search the substitution vector for matches and replace with the corresponding replacement parameter, adding the prefix back in
-                for (unsigned int k = 0; k < substitutionVector.size(); k++) {
-                    if (codeToExpand.at(i).parameters.at(j) == substitutionVector.at(k).match) {
-                        codeToExpand.at(i).parameters.at(j) = (prefix + substitutionVector.at(k).replacement);
-                    }
-                }
-            }
-        }
+    // Calls expanded while writing number their labels as they go, the planned label numbers wouldn't fit
+    if (recursiveMode && (incrementalMode || parallelMode)) {
+        *messageStream << "ERROR: --recursive doesn't work with --incremental or --parallel" << endl;
+        return 1;
     }
-
-    // Substitute labels to avoid label conflicts when expanding macro two times or more
-    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-        // If label has '$' prefix, it is a local label inside the macro and should be replaced
-        if (codeToExpand.at(i).label[0] == '$') {
-            string oldLabel = codeToExpand.at(i).label;
-            string newLabel = "$tm" + to_string(defineMacroLabelSubstitutions++);
-            for (unsigned int j = 0; j < codeToExpand.size(); j++) {
-                for (unsigned int k = 0; k < codeToExpand.at(j).parameters.size(); k++) {
-                    // Check if there's a prefix
-                    if (codeToExpand.at(j).parameters.at(k)[0] == '#' || codeToExpand.at(j).parameters.at(k)[0] == '@') {
-                        string prefix;
-                        prefix = codeToExpand.at(j).parameters.at(k)[0];
-                        if (codeToExpand.at(j).parameters.at(k).substr(1,string::npos) == oldLabel)
-                            codeToExpand.at(j).parameters.at(k) = (prefix + newLabel);
-                    }
-                    else {
-                        if (codeToExpand.at(j).parameters.at(k) == oldLabel)
-                            codeToExpand.at(j).parameters.at(k) = newLabel;
-                    }
-                }
-            }
-            codeToExpand.at(i).label = newLabel;
-        }
+    if (incrementalMode && objectMode) {
+        *messageStream << "ERROR: --incremental only works on expanded code, not with --object" << endl;
+        return 1;
     }
 
-    // Output the code to destination file
-    //
-    // If the macro call string has a label, it should be preserved
-    if (label != "")
-        macroDef->code += (label + "\n");
-
-    // Output the code line vector
-    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-        macroDef->code += (codeToExpand.at(i).label + "\t" + codeToExpand.at(i).opcode);
-        if (codeToExpand.at(i).parameters.size() > 0) {
-            macroDef->code += ("\t" + codeToExpand.at(i).parameters.at(0));
-            for (unsigned int j = 1; j < codeToExpand.at(i).parameters.size(); j++) {
-                macroDef->code += ("," + codeToExpand.at(i).parameters.at(j));
-            }
+    // Incremental mode writes the destination itself, next to its dependency map
+    if (incrementalMode) {
+        if (outputToStdout) {
+            *messageStream << "ERROR: --incremental needs a destination file" << endl;
+            return 1;
         }
-        macroDef->code += "\n";
+        bool processed = processFileIncremental(&context, sourceFilepath, destFilepath, flushThreshold);
+        return finishFile(processed ? 0 : 1);
     }
-}
-
-
-
-void expandMacro(ofstream* destFile, macroDefinition macroToExpand, string label, string parameters) {
-    struct substitution {
-        string match;
-        string replacement;
-    };
-
-    struct lineOfCode {
-        string label;
-        string opcode;
-        vector<string> parameters;
-    };
-
-    // Step 1, turn the code of the macro into a vector of lines
-    vector<lineOfCode> codeToExpand;
-    size_t lineSeek = 0;
-    size_t seekEnd;
-
-    // A paranoid check if the macro has any code
-    if (macroToExpand.code != "") {
-        // Process each line, putting it into a vector of code lines (makes it easier to substitute labels later)
-        while (seekEnd != string::npos) {
-            seekEnd = macroToExpand.code.find_first_of("\n", lineSeek);
-            string currentLine = macroToExpand.code.substr(lineSeek, seekEnd - lineSeek);
 
-            string currentLineLabel, currentLineOpcode, currentLineParameters;
-            splitLine(currentLine, &currentLineLabel, &currentLineOpcode, &currentLineParameters);
-
-            lineOfCode currentLineOfCode;
-            currentLineOfCode.label = currentLineLabel;
-            currentLineOfCode.opcode = currentLineOpcode;
-
-            vector<string> tempParameterVector;
-            if (currentLineParameters != "") {
-                // Remove all spaces in the parameters strings
-                currentLineParameters.erase(remove_if(currentLineParameters.begin(), currentLineParameters.end(), ::isspace), currentLineParameters.end());
-                string delimiter = ",";
-                size_t paramLineSeek;
-                size_t paramSeekEnd = -1;
-                do {
-                    paramLineSeek = paramSeekEnd + 1;
-                    paramSeekEnd = currentLineParameters.find(delimiter, paramLineSeek);
-                    string tempParameter = currentLineParameters.substr(paramLineSeek, paramSeekEnd - paramLineSeek);
-                    tempParameterVector.push_back(tempParameter);
-                } while (paramSeekEnd != string::npos);
-            }
-            lineSeek = seekEnd + 1;
-            currentLineOfCode.parameters = tempParameterVector;
-            codeToExpand.push_back(currentLineOfCode);
-        }
+    outputSink destFile;
+    destFile.flushThreshold = flushThreshold;
+    if (outputToStdout)
+        openOutputStdout(&destFile);
+    else if (!objectMode && !openOutputFile(&destFile, destFilepath)) {
+        *messageStream << "ERROR: Could not open " << destFilepath << " for writing" << endl;
+        return 1;
     }
 
-
-    // Step 2, take macro parameters and substitute them
-    //
-    // Remove all spaces in the parameters strings
-    macroToExpand.params.erase(remove_if(macroToExpand.params.begin(), macroToExpand.params.end(), ::isspace), macroToExpand.params.end());
-    parameters.erase(remove_if(parameters.begin(), parameters.end(), ::isspace), parameters.end());
-
-    // Create a vector that stores substitutions
-    // Parameters to replace (match) and what to replace them with (replacement)
-    vector<substitution> substitutionVector;
-
-    // If the macro has any parameters, add them to the substitutionVector
-    if (macroToExpand.params != "") {
-        // Parameters are separated by commas, spaces were trimmed
-        string delimiter = ",";
-        size_t lineSeek;
-        size_t seekEnd = -1;
-        // Parse the parameters of the macro itself
-        do {
-            lineSeek = seekEnd + 1;
-            seekEnd = macroToExpand.params.find(delimiter, lineSeek);
-            string macroParameter = macroToExpand.params.substr(lineSeek, seekEnd - lineSeek);
-            substitution tempSubstitution;
-            tempSubstitution.match = macroParameter; tempSubstitution.replacement = "";
-            substitutionVector.push_back(tempSubstitution);
-        } while (seekEnd != string::npos);
-
-        // Parse the passed parameters
-        // TODO: Error if less parameters were passed than intended by the macro definition.
-        seekEnd = -1;
-        unsigned int i = -1;
-        do {
-            i++;
-            lineSeek = seekEnd + 1;
-            seekEnd = parameters.find(delimiter, lineSeek);
-            string parameter = parameters.substr(lineSeek, seekEnd - lineSeek);
-            substitutionVector[i].replacement = parameter;
-        } while (seekEnd != string::npos && i < substitutionVector.size());
-
-        debugOutput("Substitutions:");
-        for (unsigned int i = 0; i < substitutionVector.size(); i++) {
-            debugOutput(substitutionVector.at(i).match + " will be replaced by " + substitutionVector.at(i).replacement);
-        }
-
-        // Go through the parameters in the code and substitute them
-        for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-            for (unsigned int j = 0; j < codeToExpand.at(i).parameters.size(); j++) {
-                // Prefixes would make it difficult to compare strings so we'll store the prefix in a string
-                // and remove it from the parameter string, adding it back later
-                string prefix = "";
-                if (codeToExpand.at(i).parameters.at(j)[0] == '#' || codeToExpand.at(i).parameters.at(j)[0] == '@') {
-                        prefix = codeToExpand.at(i).parameters.at(j)[0];
-                        codeToExpand.at(i).parameters.at(j).erase(0, 1);
-                }
-                // Search the substitution vector for matches and replace with the corresponding replacement parameter, adding the prefix back in
-                for (unsigned int k = 0; k < substitutionVector.size(); k++) {
-                    if (codeToExpand.at(i).parameters.at(j) == substitutionVector.at(k).match) {
-                        //codeToExpand.at(i).parameters.at(j) = (prefix + substitutionVector.at(k).replacement);
-                        codeToExpand.at(i).parameters.at(j) = substitutionVector.at(k).replacement;
-                    }
-                }
-                // bugfix?
-                codeToExpand.at(i).parameters.at(j) = prefix + codeToExpand.at(i).parameters.at(j);
-            }
-        }
+    // With --object the expanded code stays in memory and only the assembled object program is written,
+    // the object file is only opened once the program assembled without errors
+    outputSink expandedCode;
+    openOutputMemory(&expandedCode);
+    outputSink* expansionSink = objectMode ? &expandedCode : &destFile;
+
+    bool processed = true;
+    if (inputFromStdin)
+        processStream(&context, expansionSink);
+    else if (parallelMode)
+        processed = processFileParallel(&context, sourceFilepath, expansionSink, jobs);
+    else
+        processed = processFile(&context, sourceFilepath, expansionSink);
+    if (!processed) {
+        *fileMessages(&context) << "ERROR: Could not open " << sourceFilepath << endl;
+        closeOutput(&destFile);
+        return finishFile(1);
     }
 
-    // Substitute labels to avoid label conflicts when expanding macro two times or more
-    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-        // If label has '$' prefix, it is a local label inside the macro and should be replaced
-        if (codeToExpand.at(i).label[0] == '$') {
-            string oldLabel = codeToExpand.at(i).label;
-            string newLabel = "lb" + to_string(labelSubstitutions++);
-            for (unsigned int j = 0; j < codeToExpand.size(); j++) {
-                for (unsigned int k = 0; k < codeToExpand.at(j).parameters.size(); k++) {
-                    // Check if there's a prefix
-                    if (codeToExpand.at(j).parameters.at(k)[0] == '#' || codeToExpand.at(j).parameters.at(k)[0] == '@') {
-                        string prefix;
-                        prefix = codeToExpand.at(j).parameters.at(k)[0];
-                        if (codeToExpand.at(j).parameters.at(k).substr(1,string::npos) == oldLabel)
-                            codeToExpand.at(j).parameters.at(k) = (prefix + newLabel);
-                    }
-                    else {
-                        if (codeToExpand.at(j).parameters.at(k) == oldLabel)
-                            codeToExpand.at(j).parameters.at(k) = newLabel;
-                    }
-                }
-            }
-            codeToExpand.at(i).label = newLabel;
+    string objectProgram;
+    bool assembled = !objectMode || assembleProgram(expandedCode.buffer, &objectProgram, fileMessages(&context));
+    if (objectMode && !outputToStdout) {
+        if (!assembled) {
+            // No object file is left behind for a program that didn't assemble, not even the one of an earlier run
+            error_code error;
+            filesystem::remove(destFilepath, error);
+            openOutputDiscard(&destFile);
+        }
+        else if (!openOutputFile(&destFile, destFilepath)) {
+            *fileMessages(&context) << "ERROR: Could not open " << destFilepath << " for writing" << endl;
+            return 1;
         }
     }
+    if (assembled && objectMode)
+        writeOutput(&destFile, objectProgram);
 
-    // Output the code to destination file
-    //
-    // If the macro call string has a label, it should be preserved
-    if (label != "")
-        *destFile << label << endl;
-
-    // Add a comment marking the beginning of macro expansion to the assembler program code
-    *destFile << "; " << macroToExpand.name << " " << parameters << endl;
-
-    // Output the code line vector
-    for (unsigned int i = 0; i < codeToExpand.size(); i++) {
-        *destFile << codeToExpand.at(i).label << "\t" << codeToExpand.at(i).opcode;
-        if (codeToExpand.at(i).parameters.size() > 0) {
-            *destFile << "\t" << codeToExpand.at(i).parameters.at(0);
-            for (unsigned int j = 1; j < codeToExpand.at(i).parameters.size(); j++) {
-                *destFile << "," << codeToExpand.at(i).parameters.at(j);
-            }
-        }
-        *destFile << endl;
+    if (!closeOutput(&destFile)) {
+        *fileMessages(&context) << "ERROR: Could not write to " << destFilepath << endl;
+        return 1;
     }
 
-    // Add a comment marking the end of macro expansion to the assembler program code
-    *destFile << "; MEND" << endl;
+    return finishFile(assembled ? 0 : 1);
 }
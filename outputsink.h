@@ -0,0 +1,178 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <charconv>
+#include <cstdio>
+#include "./lineparser.h"
+#include "./trace.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace std;
+
+const size_t DEFAULT_FLUSH_THRESHOLD = 1 << 20;
+
+// outputSink - collects the output in a large buffer and writes it out in big chunks
+// The buffer is written when it reaches flushThreshold bytes (never before closing if the threshold is 0).
+struct outputSink {
+    string buffer;
+    size_t flushThreshold = DEFAULT_FLUSH_THRESHOLD;
+    bool failed = false;   // set when a write fails, the rest of the output is dropped
+    bool ownsFile = false;
+    bool discard = false;
+    size_t writtenBytes = 0;   // everything handed to the file so far, not counting the buffer
+#ifdef _WIN32
+    FILE* file = nullptr;  // text mode, so line endings come out the same as they did through ofstream
+#else
+    int fd = -1;
+#endif
+};
+
+bool openOutputFile(outputSink* sink, const filesystem::path& path) {
+#ifdef _WIN32
+    sink->file = _wfopen(path.wstring().c_str(), L"w");
+    if (sink->file == nullptr)
+        return false;
+    setvbuf(sink->file, nullptr, _IONBF, 0);
+#else
+    sink->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (sink->fd < 0)
+        return false;
+#endif
+    sink->ownsFile = true;
+    if (sink->flushThreshold > 0)
+        sink->buffer.reserve(sink->flushThreshold);
+    return true;
+}
+
+void openOutputStdout(outputSink* sink) {
+#ifdef _WIN32
+    sink->file = stdout;
+#else
+    sink->fd = STDOUT_FILENO;
+#endif
+    sink->ownsFile = false;
+    if (sink->flushThreshold > 0)
+        sink->buffer.reserve(sink->flushThreshold);
+}
+
+// openOutputMemory - a sink that only collects the output in its buffer, nothing is ever written
+void openOutputMemory(outputSink* sink) {
+    sink->ownsFile = false;
+    sink->discard = true;
+    sink->flushThreshold = 0;
+}
+
+// openOutputDiscard - a sink that throws everything away, for sources that are only read for their macros
+void openOutputDiscard(outputSink* sink) {
+    sink->ownsFile = false;
+    sink->discard = true;
+}
+
+// writeChunks - writes the buffered output followed by one more chunk, in a single system call where possible
+void writeChunks(outputSink* sink, string_view first, string_view second) {
+    sink->writtenBytes += first.length() + second.length();
+    if (sink->failed || sink->discard)
+        return;
+    uint64_t start = startTimer();
+    uint64_t spanStart = startSpan();
+#ifdef _WIN32
+    if ((first.length() > 0 && fwrite(first.data(), 1, first.length(), sink->file) != first.length())
+        || (second.length() > 0 && fwrite(second.data(), 1, second.length(), sink->file) != second.length()))
+        sink->failed = true;
+#else
+    struct iovec chunks[2] = { { (void*)first.data(), first.length() }, { (void*)second.data(), second.length() } };
+    int chunk = 0;
+    while (chunk < 2) {
+        if (chunks[chunk].iov_len == 0) {
+            chunk++;
+            continue;
+        }
+        ssize_t written = writev(sink->fd, &chunks[chunk], 2 - chunk);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            sink->failed = true;
+            return;
+        }
+        // Skip whatever was written, writev is allowed to stop part way through
+        while (chunk < 2 && (size_t)written >= chunks[chunk].iov_len) {
+            written -= chunks[chunk].iov_len;
+            chunk++;
+        }
+        if (chunk < 2) {
+            chunks[chunk].iov_base = (char*)chunks[chunk].iov_base + written;
+            chunks[chunk].iov_len -= written;
+        }
+    }
+#endif
+    stopTimer(STAT_WRITE_OUTPUT, start, first.length() + second.length());
+    endSpan(TRACE_WRITE_OUTPUT, spanStart, string_view(), first.length() + second.length());
+}
+
+// outputPosition - how many bytes of output there are so far
+size_t outputPosition(const outputSink* sink) {
+    return sink->writtenBytes + sink->buffer.length();
+}
+
+void flushOutput(outputSink* sink) {
+    writeChunks(sink, sink->buffer, string_view());
+    sink->buffer.clear();
+}
+
+void writeOutput(outputSink* sink, string_view text) {
+    if (sink->flushThreshold > 0 && sink->buffer.length() + text.length() > sink->flushThreshold) {
+        // A chunk too big for the buffer goes out together with what is buffered, without being copied
+        if (text.length() >= sink->flushThreshold) {
+            writeChunks(sink, sink->buffer, text);
+            sink->buffer.clear();
+            return;
+        }
+        flushOutput(sink);
+    }
+    sink->buffer.append(text.data(), text.length());
+}
+
+void writeOutput(outputSink* sink, char c) {
+    if (sink->flushThreshold > 0 && sink->buffer.length() >= sink->flushThreshold)
+        flushOutput(sink);
+    sink->buffer.push_back(c);
+}
+
+void writeOutputNumber(outputSink* sink, unsigned int number) {
+    char digits[16];
+    char* end = to_chars(digits, digits + sizeof(digits), number).ptr;
+    writeOutput(sink, string_view(digits, end - digits));
+}
+
+// writeOutputFolded - writes text upper cased outside of SIC/XE strings, see appendFolded
+void writeOutputFolded(outputSink* sink, string_view text, bool insideString) {
+    if (isFolded(text, insideString)) {
+        writeOutput(sink, text);
+        return;
+    }
+    if (sink->flushThreshold > 0 && sink->buffer.length() + text.length() > sink->flushThreshold)
+        flushOutput(sink);
+    appendFolded(&sink->buffer, text, insideString);
+}
+
+// closeOutput - writes whatever is still buffered and closes the file, returns false if any write failed
+bool closeOutput(outputSink* sink) {
+    flushOutput(sink);
+    if (sink->ownsFile) {
+#ifdef _WIN32
+        if (fclose(sink->file) != 0) sink->failed = true;
+        sink->file = nullptr;
+#else
+        if (close(sink->fd) != 0) sink->failed = true;
+        sink->fd = -1;
+#endif
+        sink->ownsFile = false;
+    }
+    return !sink->failed;
+}
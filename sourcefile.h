@@ -0,0 +1,214 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include "./linering.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace std;
+
+// sourceBuffer - the whole source file mapped into memory, lines are handed out as views into it
+// If the file can't be mapped (empty files, pipes and the like), it is read into memory instead.
+// A streamed source (stdin) only ever holds a few batches of lines, see openSourceStream.
+struct sourceBuffer {
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t position = 0;   // start of the next line
+    bool mapped = false;
+    string fallback;       // holds the file contents when it isn't mapped
+    unique_ptr<lineRing> stream;   // batches of lines filled by the reader thread, data is the current batch
+    thread reader;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+bool mapSourceFile(sourceBuffer* source, const filesystem::path& path) {
+#ifdef _WIN32
+    source->file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (source->file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(source->file, &fileSize) && fileSize.QuadPart > 0) {
+        source->mapping = CreateFileMappingW(source->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (source->mapping != NULL) {
+            source->data = (const char*)MapViewOfFile(source->mapping, FILE_MAP_READ, 0, 0, 0);
+            if (source->data != nullptr) {
+                source->size = fileSize.QuadPart;
+                source->mapped = true;
+                return true;
+            }
+            CloseHandle(source->mapping);
+            source->mapping = NULL;
+        }
+    }
+    CloseHandle(source->file);
+    source->file = INVALID_HANDLE_VALUE;
+    return false;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0) {
+        void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+            source->data = (const char*)data;
+            source->size = fileStat.st_size;
+            source->mapped = true;
+        }
+    }
+    close(fd);
+    return source->mapped;
+#endif
+}
+
+// openSourceFile - maps the file or reads it into memory, returns false if it can't be opened at all
+bool openSourceFile(sourceBuffer* source, const filesystem::path& path) {
+    if (mapSourceFile(source, path))
+        return true;
+
+    ifstream file(path, ios::binary);
+    if (!file)
+        return false;
+    source->fallback.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    source->data = source->fallback.data();
+    source->size = source->fallback.size();
+    return true;
+}
+
+// readInput - reads whatever input is there, up to size bytes. Returns 0 at the end of the input or on an error.
+size_t readInput(int fd, char* buffer, size_t size) {
+#ifdef _WIN32
+    int count = _read(fd, buffer, (unsigned int)min(size, (size_t)INT_MAX));
+    return count > 0 ? count : 0;
+#else
+    while (true) {
+        ssize_t count = read(fd, buffer, size);
+        if (count >= 0)
+            return count;
+        if (errno != EINTR)
+            return 0;
+    }
+#endif
+}
+
+// readStream - the reader thread of a streamed source, cuts the input into batches of whole lines
+// Only the last batch can end without a '\n', so the lines come out exactly as if the input was one buffer.
+void readStream(lineRing* ring, int fd) {
+    string partialLine;   // the start of a line that didn't fit into the last batch
+    while (string* batch = acquireFreeBatch(ring)) {
+        batch->assign(partialLine);
+        partialLine.clear();
+
+        // Read until the batch holds at least one whole line, pipes hand out whatever they have
+        size_t lastNewline = string::npos;
+        bool endOfInput = false;
+        while (lastNewline == string::npos && !endOfInput) {
+            size_t start = batch->size();
+            batch->resize(start + LINE_BATCH_SIZE);
+            size_t count = readInput(fd, &(*batch)[start], LINE_BATCH_SIZE);
+            batch->resize(start + count);
+            endOfInput = count == 0;
+            lastNewline = batch->rfind('\n');
+        }
+
+        if (!endOfInput) {
+            partialLine.assign(*batch, lastNewline + 1, string::npos);
+            batch->resize(lastNewline + 1);
+        }
+        if (!batch->empty())
+            publishBatch(ring);
+        if (endOfInput)
+            break;
+    }
+    finishBatches(ring);
+}
+
+// openSourceStream - reads the source from a pipe or terminal (stdin by default) on a thread of its own
+// Lines are processed while the next ones are read, and only a few batches of them are held at any time.
+// A line stays valid until the next readLine, unlike lines of a file that stay valid until the file is closed.
+void openSourceStream(sourceBuffer* source, int fd = 0) {
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);  // the same bytes a file would give, line endings included
+#endif
+    source->stream = make_unique<lineRing>();
+    source->reader = thread(readStream, source->stream.get(), fd);
+}
+
+// openSourceMemory - a source that is already in memory, the text is moved into the buffer
+void openSourceMemory(sourceBuffer* source, string text) {
+    source->fallback = move(text);
+    source->data = source->fallback.data();
+    source->size = source->fallback.size();
+}
+
+// nextBatch - moves a streamed source on to its next batch, giving the batch that was read back to the reader
+bool nextBatch(sourceBuffer* source) {
+    if (source->data != nullptr)
+        releaseBatch(source->stream.get());
+    const string* batch = acquireFullBatch(source->stream.get());
+    source->data = batch != nullptr ? batch->data() : nullptr;
+    source->size = batch != nullptr ? batch->size() : 0;
+    source->position = 0;
+    return batch != nullptr;
+}
+
+void closeSourceFile(sourceBuffer* source) {
+    if (source->stream != nullptr) {
+        source->stream->cancelled = true;
+        source->reader.join();
+        source->stream.reset();
+    }
+    if (source->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(source->data);
+        CloseHandle(source->mapping);
+        CloseHandle(source->file);
+#else
+        munmap((void*)source->data, source->size);
+#endif
+    }
+    source->data = nullptr;
+    source->size = 0;
+    source->position = 0;
+    source->mapped = false;
+    source->fallback.clear();
+}
+
+// readLine - hands out the next line without its '\n', works exactly like getline on the same file
+bool readLine(sourceBuffer* source, string_view* line) {
+    if (source->position >= source->size && (source->stream == nullptr || !nextBatch(source)))
+        return false;
+
+    const char* start = source->data + source->position;
+    size_t remaining = source->size - source->position;
+    const char* newline = (const char*)memchr(start, '\n', remaining);
+    size_t length = newline != nullptr ? newline - start : remaining;
+
+    *line = string_view(start, length);
+    source->position += newline != nullptr ? length + 1 : length;
+    return true;
+}
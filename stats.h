@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Counters and timers for the hot paths, turned on at runtime with --stats or --stats-json.
+//
+// Every thread counts into a block of its own, so counting takes no locks or atomics; a thread adds its block
+// to the totals when it ends, and the report adds the block of the thread asking. Switched off, a counted call
+// costs one check of statsEnabled, no clock is read. Times are inclusive: the lines defineMacro splits count
+// for splitLine and for defineMacro.
+
+enum statPhase { STAT_SPLIT_LINE, STAT_FIND_MACRO, STAT_DEFINE_MACRO, STAT_EXPAND_MACRO, STAT_WRITE_OUTPUT, STAT_PHASES };
+const char* const STAT_PHASE_NAMES[STAT_PHASES] = { "splitLine", "findMacro", "defineMacro", "expandMacro", "writeOutput" };
+const size_t STATS_TEXT_MACROS = 20;   // macros the text summary lists, the JSON lists all of them
+
+// Set once before any work starts, never changed while threads run
+bool statsEnabled = false;
+
+struct macroStats {
+    uint64_t calls = 0;
+    uint64_t bytes = 0;   // expanded code written for the macro's calls
+};
+
+struct threadStats {
+    uint64_t calls[STAT_PHASES] = {};
+    uint64_t nanoseconds[STAT_PHASES] = {};
+    uint64_t bytes[STAT_PHASES] = {};   // expandMacro: bytes expanded, writeOutput: bytes written to the file
+    unordered_map<string, macroStats> macros;
+    string nameScratch;
+};
+
+void addStats(threadStats* total, const threadStats* stats) {
+    for (int phase = 0; phase < STAT_PHASES; phase++) {
+        total->calls[phase] += stats->calls[phase];
+        total->nanoseconds[phase] += stats->nanoseconds[phase];
+        total->bytes[phase] += stats->bytes[phase];
+    }
+    for (const auto& macro : stats->macros) {
+        macroStats& counted = total->macros[macro.first];
+        counted.calls += macro.second.calls;
+        counted.bytes += macro.second.bytes;
+    }
+}
+
+// What the threads that already ended counted
+threadStats finishedStats;
+mutex finishedStatsLock;
+
+// threadStatsBlock - the counts of one thread, added to finishedStats when the thread ends
+struct threadStatsBlock {
+    threadStats stats;
+    ~threadStatsBlock() {
+        lock_guard<mutex> guard(finishedStatsLock);
+        addStats(&finishedStats, &stats);
+    }
+};
+
+threadStats* currentThreadStats() {
+    thread_local threadStatsBlock block;
+    return &block.stats;
+}
+
+uint64_t statClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// startTimer - the time a counted call starts, 0 while stats are off
+uint64_t startTimer() {
+    return statsEnabled ? statClock() : 0;
+}
+
+// stopTimer - counts a call of a phase that started at start, and the bytes it handled
+void stopTimer(statPhase phase, uint64_t start, uint64_t bytes = 0) {
+    if (!statsEnabled)
+        return;
+    threadStats* stats = currentThreadStats();
+    stats->calls[phase]++;
+    stats->nanoseconds[phase] += statClock() - start;
+    stats->bytes[phase] += bytes;
+}
+
+// countMacroCall - counts one expansion of a macro and the bytes it wrote
+void countMacroCall(string_view name, uint64_t bytes) {
+    if (!statsEnabled)
+        return;
+    threadStats* stats = currentThreadStats();
+    stats->nameScratch.assign(name.data(), name.length());
+    macroStats& counted = stats->macros[stats->nameScratch];
+    counted.calls++;
+    counted.bytes += bytes;
+}
+
+// collectStats - everything counted so far, only called once the worker threads are done
+threadStats collectStats() {
+    threadStats total;
+    lock_guard<mutex> guard(finishedStatsLock);
+    addStats(&total, &finishedStats);
+    addStats(&total, currentThreadStats());
+    return total;
+}
+
+// sortedMacros - the counted macros, the ones that wrote the most first
+vector<pair<string, macroStats>> sortedMacros(const threadStats* stats) {
+    vector<pair<string, macroStats>> macros(stats->macros.begin(), stats->macros.end());
+    sort(macros.begin(), macros.end(), [](const pair<string, macroStats>& a, const pair<string, macroStats>& b) {
+        return a.second.bytes != b.second.bytes ? a.second.bytes > b.second.bytes : a.first < b.first;
+    });
+    return macros;
+}
+
+// writeStatsText - the --stats summary, a line with only a label counts as a call of the unnamed null macro
+void writeStatsText(ostream* out) {
+    threadStats stats = collectStats();
+    *out << "Stats:" << endl;
+    for (int phase = 0; phase < STAT_PHASES; phase++) {
+        *out << "  " << STAT_PHASE_NAMES[phase] << ": " << stats.calls[phase] << " calls, "
+             << stats.nanoseconds[phase] / 1000000.0 << " ms";
+        if (phase == STAT_EXPAND_MACRO || phase == STAT_WRITE_OUTPUT)
+            *out << ", " << stats.bytes[phase] << " bytes";
+        *out << endl;
+    }
+
+    vector<pair<string, macroStats>> macros = sortedMacros(&stats);
+    if (!macros.empty())
+        *out << "  Macros by bytes expanded (" << macros.size() << " called):" << endl;
+    for (size_t i = 0; i < macros.size() && i < STATS_TEXT_MACROS; i++)
+        *out << "    " << (macros[i].first != "" ? macros[i].first : "(label alone)") << ": " << macros[i].second.calls << " calls, " << macros[i].second.bytes << " bytes" << endl;
+}
+
+// appendJsonString - text as a JSON string literal, the one escaper every JSON output goes through
+void appendJsonString(string* out, string_view text) {
+    const char* hex = "0123456789abcdef";
+    *out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            *out += '\\';
+            *out += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            *out += "\\u00";
+            *out += hex[(c >> 4) & 0xF];
+            *out += hex[c & 0xF];
+        }
+        else
+            *out += c;
+    }
+    *out += '"';
+}
+
+// writeJsonString - a string as a JSON string literal
+void writeJsonString(ostream* out, string_view text) {
+    string literal;
+    appendJsonString(&literal, text);
+    out->write(literal.data(), literal.length());
+}
+
+// writeStatsJson - the same numbers for --stats-json, times in nanoseconds
+void writeStatsJson(ostream* out) {
+    threadStats stats = collectStats();
+    *out << "{\"phases\":{";
+    for (int phase = 0; phase < STAT_PHASES; phase++) {
+        *out << (phase > 0 ? "," : "") << '"' << STAT_PHASE_NAMES[phase] << "\":{\"calls\":" << stats.calls[phase]
+             << ",\"nanoseconds\":" << stats.nanoseconds[phase] << ",\"bytes\":" << stats.bytes[phase] << '}';
+    }
+    *out << "},\"macros\":[";
+    vector<pair<string, macroStats>> macros = sortedMacros(&stats);
+    for (size_t i = 0; i < macros.size(); i++) {
+        *out << (i > 0 ? "," : "") << "{\"name\":";
+        writeJsonString(out, macros[i].first);
+        *out << ",\"calls\":" << macros[i].second.calls << ",\"bytes\":" << macros[i].second.bytes << '}';
+    }
+    *out << "]}" << endl;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+
+using namespace std;
+
+const unsigned int NO_SYMBOL = (unsigned int)-1;
+
+// symbolTable - interns names so that every distinct name is stored once and can be referred to by a small id
+struct symbolTable {
+    deque<string> names; // a deque never moves its elements, so the views in ids stay valid
+    unordered_map<string_view, unsigned int> ids;
+};
+
+// findSymbol - returns the id of an already interned name, or NO_SYMBOL. Never adds anything to the table.
+unsigned int findSymbol(const symbolTable* table, string_view name) {
+    auto found = table->ids.find(name);
+    if (found == table->ids.end())
+        return NO_SYMBOL;
+    return found->second;
+}
+
+// internSymbol - returns the id of a name, adding it to the table first if it's not there yet
+unsigned int internSymbol(symbolTable* table, string_view name) {
+    unsigned int id = findSymbol(table, name);
+    if (id == NO_SYMBOL) {
+        id = table->names.size();
+        table->names.emplace_back(name);
+        table->ids.emplace(table->names.back(), id);
+    }
+    return id;
+}
+
+const string& symbolName(const symbolTable* table, unsigned int id) {
+    return table->names[id];
+}
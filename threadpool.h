@@ -0,0 +1,86 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A small work-stealing pool. The tasks are dealt out to the workers up front, every worker takes tasks
+// from the front of its own queue and, once that is empty, steals from the back of the other queues.
+// Tasks of very different sizes (a huge source file next to many small ones) still keep every core busy.
+
+struct workerQueue {
+    mutex lock;
+    deque<size_t> tasks;
+};
+
+bool takeTask(workerQueue* queue, size_t* task, bool fromFront) {
+    lock_guard<mutex> guard(queue->lock);
+    if (queue->tasks.empty())
+        return false;
+    if (fromFront) {
+        *task = queue->tasks.front();
+        queue->tasks.pop_front();
+    }
+    else {
+        *task = queue->tasks.back();
+        queue->tasks.pop_back();
+    }
+    return true;
+}
+
+// The queue the thread works on, 0 for the thread that called parallelFor and any thread outside of it
+thread_local unsigned int currentWorker = 0;
+
+void runWorker(vector<unique_ptr<workerQueue>>* queues, unsigned int self, const function<void(size_t)>* body) {
+    currentWorker = self;
+    size_t task;
+    while (true) {
+        if (takeTask((*queues)[self].get(), &task, true)) {
+            (*body)(task);
+            continue;
+        }
+        // Nothing left here, look for work in the other queues. No task adds new tasks, so if every queue is empty we're done.
+        bool stolen = false;
+        for (unsigned int i = 1; i < queues->size() && !stolen; i++)
+            stolen = takeTask((*queues)[(self + i) % queues->size()].get(), &task, false);
+        if (!stolen)
+            return;
+        (*body)(task);
+    }
+}
+
+// parallelFor - calls body(i) for every i below count on up to threadCount threads, returns when all calls are done
+void parallelFor(size_t count, unsigned int threadCount, function<void(size_t)> body) {
+    if (threadCount == 0)
+        threadCount = 1;
+    if (threadCount > count)
+        threadCount = count;
+    if (threadCount <= 1) {
+        for (size_t i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+
+    vector<unique_ptr<workerQueue>> queues;
+    for (unsigned int i = 0; i < threadCount; i++)
+        queues.push_back(make_unique<workerQueue>());
+    for (size_t i = 0; i < count; i++)
+        queues[i % threadCount]->tasks.push_back(i);
+
+    // The calling thread works too
+    vector<thread> threads;
+    for (unsigned int i = 1; i < threadCount; i++)
+        threads.emplace_back(runWorker, &queues, i, &body);
+    runWorker(&queues, 0, &body);
+    for (thread& worker : threads)
+        worker.join();
+}
+
+unsigned int defaultThreadCount() {
+    unsigned int count = thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./stats.h"
+#include "./threadpool.h"
+
+using namespace std;
+
+// A timeline of the run in Chrome's trace event format, turned on with --trace <file>.
+//
+// Spans are recorded around processLine, defineMacro, every expansion and every write to the output file.
+// Each thread appends its spans to a buffer of its own, without locks, and hands the whole buffer over when it
+// ends; the file is written once at the end. A span that starts inside another one on the same thread shows up
+// nested in it. The file opens in chrome://tracing or Perfetto, every worker of a batch or parallel run on a
+// row of its own. An expansion also has the source line of its call, so the spans of a parallel or incremental run
+// can be told apart. A thread records at most MAX_TRACE_EVENTS spans, the count of the ones dropped is in the file.
+
+const size_t MAX_TRACE_EVENTS = 1 << 20;
+
+enum traceCategory { TRACE_PROCESS_LINE, TRACE_DEFINE_MACRO, TRACE_EXPAND_MACRO, TRACE_WRITE_OUTPUT, TRACE_CATEGORIES };
+const char* const TRACE_CATEGORY_NAMES[TRACE_CATEGORIES] = { "processLine", "defineMacro", "expandMacro", "writeOutput" };
+const char* const TRACE_ARGUMENT_NAMES[TRACE_CATEGORIES] = { "line", "line", "bytes", "bytes" };
+
+// Set once before any work starts, never changed while threads run
+bool traceEnabled = false;
+uint64_t traceStart = 0;
+
+// traceEvent - one span, times in nanoseconds of statClock
+struct traceEvent {
+    traceCategory category;
+    string name;          // the macro for defineMacro and expandMacro, else empty
+    uint64_t start;
+    uint64_t duration;
+    uint64_t argument;    // the line or the bytes, see TRACE_ARGUMENT_NAMES
+    unsigned int line;    // the source line of the call for expandMacro, else 0
+};
+
+struct threadTrace {
+    unsigned int thread = 0;   // the row, the worker the thread was plus one
+    vector<traceEvent> events;
+    uint64_t dropped = 0;
+};
+
+// The spans of the threads that already ended
+vector<threadTrace> finishedTraces;
+mutex finishedTracesLock;
+
+// threadTraceBuffer - the spans of one thread, handed to finishedTraces when the thread ends
+struct threadTraceBuffer {
+    threadTrace trace;
+    threadTraceBuffer() {
+        trace.thread = currentWorker + 1;
+    }
+    ~threadTraceBuffer() {
+        lock_guard<mutex> guard(finishedTracesLock);
+        finishedTraces.push_back(move(trace));
+    }
+};
+
+threadTrace* currentThreadTrace() {
+    thread_local threadTraceBuffer buffer;
+    return &buffer.trace;
+}
+
+// startSpan - the time a traced span starts, 0 while tracing is off
+uint64_t startSpan() {
+    return traceEnabled ? statClock() : 0;
+}
+
+// endSpan - records a span that started at start, line is only given for an expansion
+void endSpan(traceCategory category, uint64_t start, string_view name, uint64_t argument, unsigned int line = 0) {
+    if (!traceEnabled)
+        return;
+    uint64_t end = statClock();
+    threadTrace* trace = currentThreadTrace();
+    if (trace->events.size() >= MAX_TRACE_EVENTS) {
+        trace->dropped++;
+        return;
+    }
+    trace->events.push_back({ category, string(name), start, end - start, argument, line });
+}
+
+// writeTraceMicroseconds - a time for the trace file, microseconds since the run started with nanoseconds kept as decimals
+void writeTraceMicroseconds(ostream* out, uint64_t nanoseconds) {
+    char decimals[4] = { (char)('0' + nanoseconds / 100 % 10), (char)('0' + nanoseconds / 10 % 10), (char)('0' + nanoseconds % 10), 0 };
+    *out << nanoseconds / 1000 << '.' << decimals;
+}
+
+void writeTraceEvents(ostream* out, const threadTrace* trace, bool* first) {
+    for (const traceEvent& event : trace->events) {
+        *out << (*first ? "\n" : ",\n") << "{\"name\":";
+        *first = false;
+        writeJsonString(out, event.name != "" ? string_view(event.name) : string_view(TRACE_CATEGORY_NAMES[event.category]));
+        *out << ",\"cat\":\"" << TRACE_CATEGORY_NAMES[event.category] << "\",\"ph\":\"X\",\"ts\":";
+        writeTraceMicroseconds(out, event.start - traceStart);
+        *out << ",\"dur\":";
+        writeTraceMicroseconds(out, event.duration);
+        *out << ",\"pid\":1,\"tid\":" << trace->thread << ",\"args\":{\"" << TRACE_ARGUMENT_NAMES[event.category] << "\":" << event.argument;
+        if (event.line != 0)
+            *out << ",\"line\":" << event.line;
+        *out << "}}";
+    }
+}
+
+// writeTraceJson - writes every span recorded so far, only called once the worker threads are done
+void writeTraceJson(ostream* out) {
+    const threadTrace* own = currentThreadTrace();
+    lock_guard<mutex> guard(finishedTracesLock);
+    uint64_t dropped = own->dropped;
+    bool first = true;
+    *out << "{\"traceEvents\":[";
+    writeTraceEvents(out, own, &first);
+    for (const threadTrace& trace : finishedTraces) {
+        writeTraceEvents(out, &trace, &first);
+        dropped += trace.dropped;
+    }
+    *out << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"droppedEvents\":" << dropped << "}}" << endl;
+}
@@ -1,22 +1,136 @@
+#pragma once
 #include <string>
+#include <string_view>
+#include <array>
 #include <iostream>
 
 using namespace std;
 
-string SICXE_COMMANDS[] = { "ADD", "ADDF", "ADDR", "AND", "CLEAR", "COMP", "COMPF", "DIV", "DIVF", "DIVR", "FIX", "FLOAT", "HIO", "J", "JEQ", "JGT", "JLT", "JSUB", "LDA", "LDB", "LDCH", "LDF", "LDL", "LDS", "LDT", "LDX", "LPS", "MUL", "MULF", "MULR", "NORM", "OR", "RD", "RMO", "RSUB", "SIO", "SSK", "STA", "STB", "STCH", "STF", "STI", "STL", "STS", "STSW", "STT", "STX", "SUB", "SUBF", "SUBR", "SVC", "TD", "TIO", "TIX", "TIXR", "WD" };
-string SICXE_DIRECTIVES[] = { "BYTE", "EQU", "WORD", "RESW", "START", "END" };
-
-bool isCommand(string opcode) {
-    if (opcode.length() > 0) {
-        if (opcode[0] == '+') {
-            opcode.erase(0, 1);
-        }
-        for (int i = 0; i < 56; i++) {
-            if (opcode == SICXE_COMMANDS[i]) return true;
-        }
-        for (int i = 0; i < 6; i++) {
-            if (opcode == SICXE_DIRECTIVES[i]) return true;
-        }
+constexpr string_view SICXE_COMMANDS[] = { "ADD", "ADDF", "ADDR", "AND", "CLEAR", "COMP", "COMPF", "DIV", "DIVF", "DIVR", "FIX", "FLOAT", "HIO", "J", "JEQ", "JGT", "JLT", "JSUB", "LDA", "LDB", "LDCH", "LDF", "LDL", "LDS", "LDT", "LDX", "LPS", "MUL", "MULF", "MULR", "NORM", "OR", "RD", "RMO", "RSUB", "SIO", "SSK", "STA", "STB", "STCH", "STF", "STI", "STL", "STS", "STSW", "STT", "STX", "SUB", "SUBF", "SUBR", "SVC", "TD", "TIO", "TIX", "TIXR", "WD" };
+constexpr string_view SICXE_DIRECTIVES[] = { "BYTE", "EQU", "WORD", "RESW", "START", "END" };
+
+// Machine code of every command in SICXE_COMMANDS, and its format: 1, 2 or 3 (3 becomes 4 with a '+' in front)
+constexpr unsigned char SICXE_OPCODE_VALUES[] = { 0x18, 0x58, 0x90, 0x40, 0xB4, 0x28, 0x88, 0x24, 0x64, 0x9C, 0xC4, 0xC0, 0xF4, 0x3C, 0x30, 0x34, 0x38, 0x48, 0x00, 0x68, 0x50, 0x70, 0x08, 0x6C, 0x74, 0x04, 0xD0, 0x20, 0x60, 0x98, 0xC8, 0x44, 0xD8, 0xAC, 0x4C, 0xF0, 0xEC, 0x0C, 0x78, 0x54, 0x80, 0xD4, 0x14, 0x7C, 0xE8, 0x84, 0x10, 0x1C, 0x5C, 0x94, 0xB0, 0xE0, 0xF8, 0x2C, 0xB8, 0xDC };
+constexpr unsigned char SICXE_OPCODE_FORMATS[] = { 3, 3, 2, 3, 2, 3, 3, 3, 3, 2, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 1, 3, 3, 2, 3, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 3, 1, 3, 2, 3 };
+static_assert(size(SICXE_OPCODE_VALUES) == size(SICXE_COMMANDS) && size(SICXE_OPCODE_FORMATS) == size(SICXE_COMMANDS), "every command needs a machine code and a format");
+
+// The directives by their index in SICXE_DIRECTIVES
+enum directiveIndex {
+    DIRECTIVE_BYTE,
+    DIRECTIVE_EQU,
+    DIRECTIVE_WORD,
+    DIRECTIVE_RESW,
+    DIRECTIVE_START,
+    DIRECTIVE_END
+};
+
+// What kind of opcode a line has. A '+' in front of a command makes it a format 4 command.
+enum opcodeKind {
+    OPCODE_UNKNOWN,
+    OPCODE_COMMAND,
+    OPCODE_DIRECTIVE,
+    OPCODE_FORMAT4
+};
+
+// The opcodes are looked up in a perfect hash table that is generated at compile time:
+// a seed is searched for with which no two opcodes land in the same slot, so a lookup is one hash and one compare.
+
+struct opcodeEntry {
+    string_view name;
+    opcodeKind kind;
+    int index; // index into SICXE_COMMANDS or SICXE_DIRECTIVES
+};
+
+const size_t OPCODE_COUNT = size(SICXE_COMMANDS) + size(SICXE_DIRECTIVES);
+const size_t OPCODE_TABLE_SIZE = 512;
+const size_t OPCODE_MAX_LENGTH = 5;
+
+constexpr array<opcodeEntry, OPCODE_COUNT> buildOpcodeEntries() {
+    array<opcodeEntry, OPCODE_COUNT> entries = {};
+    for (size_t i = 0; i < size(SICXE_COMMANDS); i++)
+        entries[i] = { SICXE_COMMANDS[i], OPCODE_COMMAND, (int)i };
+    for (size_t i = 0; i < size(SICXE_DIRECTIVES); i++)
+        entries[size(SICXE_COMMANDS) + i] = { SICXE_DIRECTIVES[i], OPCODE_DIRECTIVE, (int)i };
+    return entries;
+}
+
+constexpr array<opcodeEntry, OPCODE_COUNT> OPCODE_ENTRIES = buildOpcodeEntries();
+
+constexpr bool opcodesFitMaxLength() {
+    for (const opcodeEntry& entry : OPCODE_ENTRIES) {
+        if (entry.name.length() > OPCODE_MAX_LENGTH) return false;
+    }
+    return true;
+}
+static_assert(opcodesFitMaxLength(), "OPCODE_MAX_LENGTH is shorter than an opcode");
+
+constexpr size_t opcodeHash(string_view opcode, unsigned int seed) {
+    unsigned int hash = seed;
+    for (char c : opcode)
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    return (hash ^ (hash >> 16)) & (OPCODE_TABLE_SIZE - 1);
+}
+
+constexpr bool opcodeSeedIsPerfect(unsigned int seed) {
+    bool used[OPCODE_TABLE_SIZE] = {};
+    for (const opcodeEntry& entry : OPCODE_ENTRIES) {
+        size_t slot = opcodeHash(entry.name, seed);
+        if (used[slot]) return false;
+        used[slot] = true;
     }
-    return false;
+    return true;
 }
+
+constexpr unsigned int findOpcodeSeed() {
+    for (unsigned int seed = 2166136261u; seed < 2166136261u + 10000; seed++) {
+        if (opcodeSeedIsPerfect(seed)) return seed;
+    }
+    return 0;
+}
+
+constexpr unsigned int OPCODE_HASH_SEED = findOpcodeSeed();
+static_assert(OPCODE_HASH_SEED != 0, "no perfect hash seed found for the SIC/XE opcodes");
+
+// Slot -> 1 + index into OPCODE_ENTRIES, 0 for an empty slot
+constexpr array<unsigned char, OPCODE_TABLE_SIZE> buildOpcodeSlots() {
+    array<unsigned char, OPCODE_TABLE_SIZE> slots = {};
+    for (size_t i = 0; i < OPCODE_COUNT; i++)
+        slots[opcodeHash(OPCODE_ENTRIES[i].name, OPCODE_HASH_SEED)] = i + 1;
+    return slots;
+}
+
+constexpr array<unsigned char, OPCODE_TABLE_SIZE> OPCODE_SLOTS = buildOpcodeSlots();
+
+// findOpcode - returns the table entry of an opcode without its '+' prefix, nullptr if it's not a SIC/XE opcode
+constexpr const opcodeEntry* findOpcode(string_view opcode) {
+    if (opcode.length() == 0 || opcode.length() > OPCODE_MAX_LENGTH)
+        return nullptr;
+    unsigned char slot = OPCODE_SLOTS[opcodeHash(opcode, OPCODE_HASH_SEED)];
+    if (slot == 0 || OPCODE_ENTRIES[slot - 1].name != opcode)
+        return nullptr;
+    return &OPCODE_ENTRIES[slot - 1];
+}
+
+// classifyOpcode - tells whether an opcode is a SIC/XE command, a format 4 command or a directive
+// A '+' in front of a directive has always been accepted, such an opcode is still classified as a directive.
+constexpr opcodeKind classifyOpcode(string_view opcode) {
+    bool format4 = false;
+    if (opcode.length() > 0 && opcode[0] == '+') {
+        opcode.remove_prefix(1);
+        format4 = true;
+    }
+
+    const opcodeEntry* entry = findOpcode(opcode);
+    if (entry == nullptr)
+        return OPCODE_UNKNOWN;
+    if (format4 && entry->kind == OPCODE_COMMAND)
+        return OPCODE_FORMAT4;
+    return entry->kind;
+}
+
+constexpr bool isCommand(string_view opcode) {
+    return classifyOpcode(opcode) != OPCODE_UNKNOWN;
+}
+
+static_assert(classifyOpcode("LDA") == OPCODE_COMMAND && classifyOpcode("+JSUB") == OPCODE_FORMAT4 && classifyOpcode("RESW") == OPCODE_DIRECTIVE, "opcode table is broken");
+static_assert(classifyOpcode("LDAX") == OPCODE_UNKNOWN && classifyOpcode("+") == OPCODE_UNKNOWN && classifyOpcode("") == OPCODE_UNKNOWN, "opcode table is broken");